@@ -6,28 +6,51 @@
  * In this case we are willing to wait for chatter from the client
  * _or_ for a new connection.
 */
+#define _GNU_SOURCE // execvpe, close_range
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <math.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <arpa/inet.h>
+#include "rules.h"
+#include "journal.h"
+#include "federation.h"
+#if defined(TRACE) && (defined(__x86_64__) || defined(__i386__))
+    #include <x86intrin.h>
+#endif
 
 #ifndef PORT
     #define PORT 56218
 #endif
 
-#define MAX_PARTIAL 5
+#define LISTEN_BACKLOG SOMAXCONN // Connections the kernel holds for accept, capped by net.core.somaxconn
+#define ACCEPT_BATCH 64 // Connections accepted per wakeup
+#define MAX_LISTENERS 64 // Listening sockets with -r, one per shard
 #define MAX_NAME 20
-#define MAX_HP 21
-#define MAX_POW 3
-#define MAX_BLC 3
-#define A_DMG 2
-#define P_DMG 6
-#define B_DMG 1
 #define MAX_LINE 200
 #define MOV_MSG "\r\n(a)ttack\r\n(p)ower move\r\n(b)lock\r\n(s)peak something\r\n\r\n"
 #define MOV_MSG_LEN 57
@@ -38,7 +61,259 @@
 #define TIE_MSG_LEN 23
 #define NO_SPAM "\r\nDO NOT SPAM\r\n\r\n"
 #define NO_SPAM_LEN 18
+#define TIME_MSG "\r\nOut of time, you attack!\r\n"
+#define TIME_MSG_LEN 29
+#define IDLE_MSG "\r\nIdle for too long, bye!\r\n"
+#define IDLE_MSG_LEN 28
+#define HUSH_MSG "\r\nSlow down, that was not sent\r\n"
+#define HUSH_MSG_LEN 32
+#ifndef REGISTER_TIMEOUT
+    #define REGISTER_TIMEOUT 60000 // ms to send a name
+#endif
+#ifndef IDLE_TIMEOUT
+    #define IDLE_TIMEOUT 600000 // ms a lobby client can stay silent
+#endif
+#ifndef MOVE_TIMEOUT
+    #define MOVE_TIMEOUT 30000 // ms to pick a move each turn
+#endif
+#define MOVE_MISSES 2 // Turns missed in a row before forfeiting
+// TCP keepalive, a half-open connection is noticed within KEEP_IDLE + KEEP_INTVL * KEEP_CNT seconds
+#define KEEP_IDLE 30
+#define KEEP_INTVL 10
+#define KEEP_CNT 3
+#define GONE_C1 4 // Exit status bits of a forked battle, for battlers that disconnected
+#define GONE_C2 8
+#define REPORT_DRAIN 2000 // ms a worker waits for a settled battle's output to go before it gives up on the stalled battler
+#define STAT_SLOTS 64 // Per thread counters, threads beyond share slots
+#define HIST_SUB 3 // Histogram precision, 2^HIST_SUB linear sub-buckets per power of 2
+#define HIST_BUCKETS 320 // Up to 2^41 us
+#define STATS_MAX 65536 // Bytes of a metrics dump
+#define JOURNAL_RING 65536 // Records waiting for the journal writer, power of 2
+#define JOURNAL_BATCH (1 << 20) // Bytes written and synced at once at most
+#define JOURNAL_COMMIT 10 // ms the journal writer gathers records between commits
+#define JOURNAL_SEGMENT (64 << 20) // Bytes per journal segment
+#define JOURNAL_IDS (1 << 20) // Battle ids reserved on disk ahead of use
+// Tracing, built in with -DTRACE (make TRACE=1), SIGUSR1 dumps the spans in the Chrome trace format
+#define TRACE_SPANS 16384 // Spans kept per ring, power of 2, older ones are overwritten
+#define TRACE_RINGS 64 // Per thread rings, threads beyond share rings, forked battles their parent's
+#ifndef TRACE_FILE
+    #define TRACE_FILE "battle-trace.json"
+#endif
+// What a span times
+#define SP_WAIT 0 // In select()/epoll_wait()
+#define SP_ACCEPT 1
+#define SP_REGISTER 2
+#define SP_MATCH 3
+#define SP_FORK 4 // Forking a battle
+#define SP_REAP 5 // Ending a forked battle, on SIGCHLD
+#define SP_TURN_INFO 6 // Rendering and sending the turn status
+#define SP_RESOLVE 7 // Damages of a turn
+#define SP_SETTLE 8
+#define SP_BROADCAST 9
+#define SP_WRITE 10 // A write() to a client (forking server)
+#define SP_FLUSH 11 // Flushing the queued output (reactor)
+#define SP_SPEAK 12
+// Hot restart, SIGUSR2 hands the listener and every client not in a battle to a freshly exec'd server
+#define HANDOFF_ENV "BATTLE_HANDOFF" // Socket to the predecessor, set for the successor
+#define HANDOFF_WAIT 5000 // ms the successor has to get ready before the restart is called off
+#define DRAIN_TICK 100 // ms between checks whether the last battle of a handed over server ended
+#define H_READY 0 // Successor ready for the listener
+#define H_LISTEN 1 // The listening sockets
+#define H_CLIENTS 2 // One or two clients (a pair leaving a battle), a socket each
+// Admission, token buckets for new connections overall (split between shards) and per address
+#ifndef ADMIT_RATE
+    #define ADMIT_RATE 20000 // Connections a second
+#endif
+#define ADMIT_BURST (ADMIT_RATE / 4) // A quarter second of connections at once
+#ifndef PEER_RATE
+    #define PEER_RATE 10 // Connections a second from one address, loopback is exempt
+#endif
+#define PEER_BURST 20
+#ifndef PEER_MAX
+    #define PEER_MAX 32 // Connections open at once from one address
+#endif
+#ifndef CHAT_RATE
+    #define CHAT_RATE 1 // Lines a second a player may say, in battle and in the lobby
+#endif
+#define CHAT_BURST 5
+#define PEER_SLOTS 65536 // Addresses tracked, power of 2
+#define PEER_PROBE 8 // Slots looked at for an address, it goes untracked if they are taken
+#define FULL_MSG "Server full, try again later\r\n"
+#define FULL_MSG_LEN 30
+#define NAME_MSG "What is your name?"
+#define NAME_MSG_LEN 19
+#define TAKEN_MSG "\r\nThat name is taken\r\n"
+#define TAKEN_MSG_LEN 22
+#define AWAY_MSG "\r\nNo such player in the lobby\r\n"
+#define AWAY_MSG_LEN 31
+// Federation (reactor mode), players nobody here matched are offered to a coordinator pairing them across nodes
+#define FED_SHARE 3000 // ms a client waits unmatched before it is offered, after the other shards were tried
+#define FED_WAIT 3000 // ms a paired player waits for the relay of the other node to start (or end)
+#define FED_ADDR "127.0.0.1" // Address other nodes reach this one at, unless -a
+// Client states of the client gauge
+#define S_REGISTER 0
+#define S_LOBBY 1
+#define S_BATTLE 2
+#define S_WATCH 3
+// Reasons a client got dropped
+#define D_SLOW 0 // Could not keep up with its output
+#define D_IDLE 1
+#define D_LOGIN 2 // Never sent a name
+// Reasons a new connection got shed
+#define SH_FULL 0 // Out of client slots (or of select()'s reach)
+#define SH_RATE 1 // Over the admission rate
+#define SH_PEER 2 // Over its address's rate or cap
+#define TIMER_TICK 10 // ms per timer wheel slot
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS) // Slots per wheel level
+#define WHEEL_LEVELS 4 // Each level spans WHEEL_SLOTS times the one below
+#define MAX_EVENTS 64 // epoll events per wakeup
+#define LISTEN_TAG(soc) (-(soc) - 1) // epoll data of a listening socket, apart from client sockets (and back)
+#ifndef MAX_CLIENTS
+    #define MAX_CLIENTS 65536 // Client slots, preallocated
+#endif
+#define MAX_BATTLES (MAX_CLIENTS / 2)
+#define OUT_POOL (MAX_CLIENTS * 2) // Output chunks, preallocated
+#define MSG_POOL (MAX_CLIENTS + 4096) // Messages between shards, preallocated
+#define BCAST_WINDOW 100 // ms arrivals and departures are held to be announced together
+#define BCAST_NAMES 3 // Names spelled out in a merged announcement
+#define MATCH_RING 1024 // Pending matches a shard can queue, power of 2
+#define IN_RING 512 // Bytes of input a client can have pending, power of 2
+#define OUT_CHUNK 2048 // Bytes per output chunk
+#define OUT_SEGS 32 // Output chunks a client can have queued
+#define OUT_HIGH (OUT_CHUNK * OUT_SEGS) // Queued bytes before a slow client is dropped
+#ifndef PLAYER_FILE
+    #define PLAYER_FILE "battle.db" // Player store, -p to change
+#endif
+#define PLAYER_MAGIC "BTLPLYR1" // Player store format
+#define MAX_PLAYERS (1 << 22) // Player slots of a new store, power of 2
+#define STORE_HEAD 4096 // Bytes of the store before the player records
+#define LEADERS 10 // Players shown by the top command
+#define LEADER_KEEP 64 // Best players tracked, so the top LEADERS can lose a few and still be known
+#define RESCAN_CHUNK 16384 // Player slots the board rescan looks at per hold of the lock
+#define PLAYER_STRIPES 64 // Locks over the player records, power of 2
+#define P_FREE 0 // Player slot states
+#define P_USED 1
+#define P_NEW 2 // Being written, skipped by lookups
+// Spectators (reactor mode), watching a battle on its shard
+#define WATCH_LAG 8192 // Bytes queued to a spectator before it skips events
+#define WATCH_SKIPS 64 // Events skipped in a row before a spectator is dropped
+#define WATCH_LIST 10 // Battles shown by the battles command
+#define NO_BATTLE_MSG "\r\nNo such battle\r\n"
+#define NO_BATTLE_MSG_LEN 18
+#define NO_WATCH_MSG "\r\nSpectating needs -e or -t\r\n"
+#define NO_WATCH_MSG_LEN 29
+#define ELO_START 1500
+#define ELO_K 32
+#define MM_BUCKET 50 // Rating points per matchmaking bucket
+#define MM_BUCKETS 80 // Buckets, ratings beyond the last ones are clamped
+#define MM_WINDOW 100 // Rating difference accepted right away
+#define MM_WIDEN 50 // Rating difference added per second of waiting
+#define MM_TICK 1000 // ms between retries of waiting clients with their widened windows
+#define MM_SCAN 8 // Waiting clients looked at per bucket
+#define MM_RECENT 4 // Recent opponents avoided
+#define MM_REMATCH 5000 // ms of waiting after which recent opponents are fine again
+// Client states (reactor mode)
+#define C_REGISTER 0
+#define C_LOBBY 1
+#define C_BATTLE 2
+#define C_DEAD 3
+#define C_MOVING 4 // Detached, on its way to another shard
+#define C_WATCH 5 // Spectating a battle
+#define C_FED 6 // Out of the lobby for a battle of the federation, waiting for it or relayed to another node
+// Binary protocol (reactor mode), a client whose first bytes are HELLO gets frames from then on instead of text:
+// a 2 byte big endian length of the rest, a type byte, then the payload
+// Every client is sent the text prompt at once, HELLO cannot start a name
+#define HELLO "\xb7" "BIN1"
+#define HELLO_LEN 5
+#define MAX_FRAME (MAX_LINE + 4)
+#define F_HELLO 1 // Binary protocol on, payload: its version
+#define F_NAME 2 // Name prompt, or a client's name
+#define F_WAIT 3 // Awaiting the next opponent
+#define F_ENGAGE 4 // Payload: the opponent's name
+#define F_TURN 5 // Pick a move, payload: T_* bits of what changed since the last one, then a byte for each
+#define F_MOVED 6 // The opponent made a choice
+#define F_MOVE 7 // A client's move, payload: a, p, b or s
+#define F_SPEAK 8 // Payload: 0 to speak now, 1 when the opponent speaks
+#define F_CHAT 9 // A speech
+#define F_RESULT 10 // Payload: R_*
+#define F_NOTICE 11 // Payload: N_*
+#define F_LOBBY 12 // Payload: 0 for arrivals or 1 for departures, a 2 byte count, then a length byte and a name each named
+#define F_TOP 13 // Leaderboard request, payload (server): a count, then per player a length byte, the name, 2 byte rating and 4 byte wins, losses and ties
+#define F_WATCH 14 // Spectating, payload (client): what follows the watch command, ? for the battles; (server): a W_* kind and its fields
+#define F_CHALLENGE 15 // Payload (client): name of the player to battle
+#define F_SAY 16 // Lobby chat, payload (client): the line; (server): a length byte and the speaker's name, the line
+#define F_RELAY 17 // Federation, from a hosting node to the relaying one: bytes for the relayed player
+#define F_RATED 18 // Federation, the relayed player's R_* result, then its new rating (4 bytes)
+#define W_START 0 // 8 byte battle id, a length byte and name for c1 then c2, hp of c1 and c2
+#define W_TURN 1 // Moves of c1 and c2, then their hp
+#define W_CHAT 2 // Speaker (0 for c1, 1 for c2), the speech
+#define W_END 3 // Result (0 tie, 1 c1 won, 2 c2 won), J_GONE_* bits, then back in the lobby
+#define W_NONE 4 // No such battle
+#define W_LIST 5 // A count, then per battle 8 byte id, a length byte, name and 2 byte rating for c1 then c2, 2 byte spectator count
+#define T_HP 1
+#define T_POW 2
+#define T_BLC 4
+#define T_OPP_HP 8
+#define R_TIE 0
+#define R_WIN 1
+#define R_LOSS 2
+#define R_DROP 3 // Won, the opponent dropped
+#define N_TIME 0 // Out of time, you attack
+#define N_SPAM 1
+#define N_IDLE 2
+#define N_TAKEN 3 // Name taken, prompted again
+#define N_AWAY 4 // Challenged player not in the lobby
+#define N_HUSH 5 // Over the chat rate, the line was dropped
+// Ends of a relay (federation)
+#define RL_GUEST 1 // On the hosting node, battles for a player of another node, its output goes in F_RELAY frames
+#define RL_LINK 2 // On the player's node, the socket to the hosting node
+// Battle states (reactor mode)
+#define B_MOVES 0 // Awaiting moves
+#define B_SETTLE 1 // Over, being settled
+
+// Preallocated objects of one size, handed out by index from a lock-free free list
+typedef struct Slabpool {
+    char *base;
+    size_t size; // Object size rounded up to whole cache lines
+    unsigned count;
+    _Atomic uint64_t head; // ABA tag << 32 | index + 1 of the first free object, 0 when exhausted
+    atomic_uint *next; // index + 1 of the next free object
+} Slab;
+
+// Timer of a timing wheel, embedded in what it times
+typedef struct Wheeltimer Timer; // Alias
+struct Wheeltimer {
+    long long due; // Tick it fires at
+    Timer *prev;
+    Timer *next;
+    short armed;
+    void (*fire)(Timer *timer);
+};
+#define OWNER(timer, type) ((type *) ((char *) (timer) - offsetof(type, timer)))
+
+// Hierarchical timing wheel, per shard (thread)
+typedef struct Timingwheel {
+    long long now; // Next tick to run
+    int count; // Armed timers
+    Timer slot[WHEEL_LEVELS][WHEEL_SLOTS]; // List heads
+} Wheel;
+
+// Token bucket, refilled at a rate up to a burst
+typedef struct Tokenbucket {
+    double tokens;
+    long long at; // ms of the last refill, 0 for a full bucket
+} Bucket;
 
+typedef struct Outchunk Outbuf; // Alias
+struct Outchunk {
+    atomic_int refs; // Queues holding the chunk
+    short shared; // Broadcast to many queues, nothing is appended to it
+    int len;
+    char data[OUT_CHUNK];
+};
+
+typedef struct Linkedbattle Battle; // Alias
 typedef struct Linkedclient Client; // Alias
 typedef Client * volatile Clientptr;
 struct Linkedclient {
@@ -49,25 +324,411 @@ struct Linkedclient {
     short hp;
     short pow;
     short blc;
-};
+    short state;
+    short gone; // Connection known closed, from events (or the battle's exit status)
+    short missed; // Turns missed in a row
+    short speaking; // Typing a speech, the forking server gathers it in the input ring
+    Bucket chat; // Of CHAT_RATE, lines it may still say
+    short side; // 0 for c1 and 1 for c2 of its battle
+    uint64_t battleid; // Id of its battle, the journal's when journaling
+    Timer timer; // Registration or idle deadline
+    short hello; // Protocol not settled yet (reactor mode)
+    short binary; // Speaks the binary protocol
+    short adopted; // Handed over by a predecessor, which may not have closed its copy of the socket yet
+    unsigned peer; // Slot + 1 in the peer table, 0 if its address is not counted
+    unsigned named; // Slot + 1 in the name table, 0 if its name is not registered
+    short shown[4]; // Turn state last framed to a binary client, by T_* bit
+    Battle *battle; // Battle the client is in (reactor mode)
+    // Federation
+    short offered; // Offered to the coordinator
+    short relay; // RL_* end of a relay it is, 0 for a player
+    Client *link; // Relayed player and the socket to its hosting node, to each other
+    uint64_t fedkey; // Of the battle it was paired for
+    // Input ring (reactor mode), filled by fill_input() and consumed by tokens
+    char in[IN_RING];
+    short inhead;
+    short inlen;
+    short inscan; // Bytes already scanned for a newline
+    short hup; // Peer hung up, read to the end
+    short eof; // Nothing more will come
+    // Output queue (reactor mode), flushed with writev() at the end of an iteration
+    Outbuf *out[OUT_SEGS]; // Ring of chunks
+    short outhead;
+    short outn;
+    int outoff; // Bytes of the head chunk already sent
+    int outlen; // Bytes queued
+    short dirty; // On the shard's dirty list
+    short skipped; // Spectator events skipped in a row
+    Client *dirtynext;
+    // Matchmaking
+    unsigned player; // Slot + 1 in the player table, 0 if unrated
+    int rating;
+    unsigned recent[MM_RECENT]; // Players of the last opponents
+    short recentpos;
+    short fresh; // Queued but not tried yet
+    long long queued_at; // ms
+    Client *rungprev; // Clients of the same rating bucket, oldest first
+    Client *rungnext;
+} __attribute__((aligned(64)));
 
-typedef struct Linkedbattle Battle; // Alias
 struct Linkedbattle {
     int pid;
     Clientptr c1;
     Clientptr c2;
     Battle *prev;
     Battle *next;
+    // Turn state (reactor mode), index 0 for c1 and 1 for c2
+    short state;
+    char mov[2];
+    short late; // J_LATE_* bits of the battlers attacked for this turn
+    Timer timer; // Move deadline of the turn
+    // Spectators (reactor mode), other shards read the fields below under id (seqlock)
+    _Atomic uint64_t id; // While it runs, 0 otherwise
+    short home; // Shard running it
+    int rating[2];
+    char names[2][MAX_NAME + 1];
+    atomic_int watching;
+    Clientptr watchers; // Only touched by its shard
+    // Pool worker
+    unsigned ref; // Handle of the battle in the server
+    short result; // Once settled
+} __attribute__((aligned(64)));
+
+// A running battle as found from any shard
+typedef struct Battlesummary {
+    uint64_t id;
+    short home;
+    int rating[2];
+    char names[2][MAX_NAME + 1];
+    int watching;
+} Summary;
+
+// Player record of the store, its layout is the file format
+typedef struct Ratedplayer {
+    char name[MAX_NAME + 1];
+    _Atomic char used; // P_*
+    short pad;
+    int rating;
+    unsigned wins;
+    unsigned losses;
+    unsigned ties;
+    long long seen; // Last seen, seconds since the epoch
+} Player;
+
+// Head of the player store, the leaderboard is kept in the file with the records
+typedef struct Playerstore {
+    char magic[8];
+    unsigned capacity; // Record slots, power of 2
+    unsigned count; // Players
+    int floor; // Best rating of the players off the board
+    int leaders; // Players on the board
+    unsigned board[LEADER_KEEP]; // Slots by rating, best first
+} Store;
+
+// Rescan of the store refilling a board that ran short, by its own thread a chunk at a time
+typedef struct Boardrescan {
+    short on;
+    unsigned at; // Next slot to look at, players before it that change are offered by rank_player
+    int floor; // Best rating left out of the candidates
+    int n;
+    unsigned slot[LEADER_KEEP]; // Candidates off the board, best first
+} Rescan;
+
+// Waiting clients by rating, per shard
+typedef struct Matchladder {
+    Client *head[MM_BUCKETS];
+    Client *tail[MM_BUCKETS];
+    uint64_t busy[(MM_BUCKETS + 63) / 64]; // Nonempty buckets
+    int count;
+    int fresh; // Clients queued since the last pass, at the top of matchingclient
+} Ladder;
+
+// Connections from one address, for admission
+typedef struct Peeraddress {
+    uint32_t addr; // Network byte order, 0 for a free slot
+    int live; // Connections open
+    Bucket bucket;
+} Peer;
+
+// Name of a registered client, interned in the name table
+typedef struct Registeredname {
+    char name[MAX_NAME + 1];
+    uint32_t hash;
+    Clientptr client; // NULL for a free slot
+    short home; // Shard of the client, -1 while it moves (reactor mode)
+} Name;
+
+// Log-linear (HDR style) histogram of microseconds
+typedef struct Histogram {
+    atomic_ullong count[HIST_BUCKETS];
+    atomic_ullong sum;
+} Hist;
+
+// Counters of a thread, shared with forked battles; gauges are deltas summed over the slots
+typedef struct Statslot {
+    atomic_ullong accepts;
+    atomic_ullong bytes_in;
+    atomic_ullong bytes_out;
+    atomic_ullong dropped[3];
+    atomic_ullong shed[3];
+    atomic_ullong spam;
+    atomic_ullong chat[2]; // Lines said, dropped for the chat rate
+    atomic_llong clients[4];
+    atomic_llong battles;
+    Hist queue_wait;
+    Hist turn; // From the event deciding a turn to the turn resolved
+} __attribute__((aligned(64))) Stats;
+#define STAT_ADD(field, n) atomic_fetch_add_explicit(&stats->field, n, memory_order_relaxed)
+// Spans, compiled out without TRACE: TRACE_BEGIN(t); ... TRACE_END(t, SP_*);
+#ifdef TRACE
+    #define TRACE_BEGIN(t) uint64_t t = tsc()
+    #define TRACE_END(t, what) trace_span(t, what)
+    #define TRACE_DUMP() if (dumptrace) dump_trace()
+#else
+    #define TRACE_BEGIN(t)
+    #define TRACE_END(t, what)
+    #define TRACE_DUMP()
+#endif
+
+// Messages between shards
+#define M_ADOPT 0 // Take over a waiting client
+#define M_BCAST 1 // Queue a broadcast chunk to the shard's clients
+#define M_MATCH 2 // A matched pair to queue (never crosses shards)
+#define M_DRAIN 3 // Hand the shard's clients over to the successor
+#define M_WATCH 4 // A spectator for one of the shard's battles
+#define M_CHALLENGE 5 // A client challenging one of the shard's (or a relay for one hosted)
+#define M_FED 6 // The coordinator paired one of the shard's clients
+typedef struct Shardmsg Msg; // Alias
+struct Shardmsg {
+    short type;
+    short to; // Destination shard of M_ADOPT
+    Clientptr c1;
+    Clientptr c2;
+    Outbuf *buf; // M_BCAST chunk, one reference for the shard
+    Outbuf *bin; // M_BCAST chunk of binary clients, if any
+    short lobby; // M_BCAST only to the lobby
+    uint64_t battle; // M_WATCH id of the battle, M_FED key
+    char name[MAX_NAME + 1]; // M_CHALLENGE player challenged, M_FED player paired
+    char line[FED_LINE]; // M_FED line of the coordinator
+    Msg *next;
+};
+
+// Slot of a pending match ring (bounded lock-free MPMC queue)
+typedef struct Pendingmatch {
+    atomic_size_t seq;
+    Clientptr c1;
+    Clientptr c2;
+} Pending;
+
+// A reactor thread, owner of the clients and battles registered on its epoll
+typedef struct Reactorshard Shard; // Alias
+struct Reactorshard {
+    short id;
+    pthread_t tid;
+    int epfd;
+    int evfd; // Wakes the shard up for its inbox
+    atomic_int idle; // Blocked in epoll_wait with no battle running
+    Msg *_Atomic inbox; // Lock-free stack, drained all at once
+    Msg drain; // M_DRAIN, not taken from the pool it may find empty
+    _Atomic uint64_t waiting[(MM_BUCKETS + 63) / 64]; // Buckets with clients no local partner fits, as of the last pass
+    atomic_int rematch; // A lower shard has waiters in range of ours, offer them there
+    _Alignas(64) atomic_size_t head; // Pending matches, popped by the owner or thieves
+    _Alignas(64) atomic_size_t tail;
+    Pending ring[MATCH_RING];
 };
 
-Battle *battlelist;
-Clientptr registerlist; // Clients waiting for registration (name)
-Clientptr matchedclient; // Mached clients for a battle
-Clientptr matchingclient; // Clients waiting for match
-char e;
+// A client as handed to the successor
+typedef struct Handedclient {
+    char name[MAX_NAME + 1];
+    short state; // C_REGISTER, C_LOBBY or C_BATTLE when leaving a battle
+    short hp; // Name bytes, of the name read so far while registering
+    short hello;
+    short binary;
+    short gone;
+    unsigned player;
+    int rating;
+    unsigned recent[MM_RECENT];
+    short recentpos;
+    long long queued_at;
+    short inlen;
+    char in[IN_RING]; // Input not taken yet
+    int outlen; // Output not sent yet, following the message head
+} Handed;
+
+// Message to the successor, H_CLIENTS output follows the head in client order
+typedef struct Handoffmsg {
+    short kind;
+    short result; // Of the battle the clients leave, -1 if none
+    short count;
+    Handed c[2];
+} Handoff;
+#define HANDOFF_MAX (sizeof(Handoff) + 2 * OUT_HIGH)
+
+// A pre-forked battle process of the forking server (-w)
+typedef struct Poolworker {
+    pid_t pid;
+    int soc; // Its end of the channel, -1 if none
+    int battles; // Running there
+} Worker;
+
+// A battle given to a worker, both sockets ride along in c1, c2 order
+typedef struct Workerjob {
+    unsigned battle; // Handle in the server's battle slab
+    struct {
+        char name[MAX_NAME + 1];
+        int rating;
+        Bucket chat;
+    } c[2];
+} Job;
+
+// A worker's battle ended, its sockets are the server's alone again
+typedef struct Workerreport {
+    unsigned battle;
+    short outcome; // As a forked battle's exit status, -1 if not played
+    short inlen[2];
+    char in[2][IN_RING]; // Input read past the end, lobby commands
+    Bucket chat[2]; // As the battle left them, the rate limit goes on in the lobby
+} Report;
+
+// Per shard (thread) state, the forking server only has the main thread
+__thread Battle *battlelist;
+__thread Clientptr registerlist; // Clients waiting for registration (name)
+__thread Clientptr matchedclient; // Mached clients for a battle
+__thread Clientptr matchingclient; // Clients waiting for match
+int reactor; // Run battles in process on an epoll reactor instead of forking
+short nshard; // Reactor threads
+Shard *shards;
+__thread Shard *shard; // Shard of the running thread
+__thread int epfd;
+__thread Clientptr deadclient; // Removed clients, freed at the end of a reactor iteration
+__thread Battle *endedbattle; // Ended battles, freed at the end of a reactor iteration
+__thread Msg *outbox; // Clients leaving the shard at the end of the iteration
+__thread uint64_t wanted[(MM_BUCKETS + 63) / 64]; // Buckets the waiters of the last pass would take elsewhere
+__thread Client *dirtylist; // Clients with output to flush
+// Record waiting for the journal writer
+typedef struct Journalslot {
+    _Atomic uint64_t seq;
+    short len;
+    char rec[JR_MAX];
+} Jslot;
+
+// Records on their way to the journal (lock-free MPSC queue), shared with forked battles
+typedef struct Journalring {
+    _Atomic uint64_t tail; // Next slot to claim
+    _Atomic uint64_t head; // Next slot to write out, only the writer moves it
+    _Atomic uint64_t nextid; // Next battle id
+    _Atomic uint64_t reserved; // Battle ids reserved on disk
+    _Atomic uint64_t written; // Records written
+    _Atomic uint64_t dropped; // Records lost to a full ring
+    _Atomic uint64_t failed; // Records lost to a failed write or sync
+    _Atomic uint64_t synced; // Records before it are on disk, it stops at the first batch failed
+    Jslot slot[JOURNAL_RING];
+} Journal;
+Journal *journal; // NULL when not journaling
+char *journaldir;
+#ifdef TRACE
+// A timed piece of work, written in place by its thread
+typedef struct Tracespan {
+    _Atomic uint64_t seq; // Position + 1 once written, 0 while being written
+    uint64_t start; // TSC
+    uint64_t ticks;
+    int pid;
+    short tid; // Shard
+    short what; // SP_*
+} Span;
+
+// The latest spans of a thread (lock-free, overwritten in turn), shared with forked battles
+typedef struct Tracering {
+    _Alignas(64) _Atomic uint64_t head; // Spans taken so far
+    Span span[TRACE_SPANS];
+} Trace;
+Trace *traces; // TRACE_RINGS rings
+__thread Trace *trace; // Ring of the running thread
+__thread int tracepid;
+__thread short tracetid;
+uint64_t tsc0; // TSC at tsc0_us, spans are timed from there
+long long tsc0_us;
+atomic_int dumptrace; // SIGUSR1 came
+atomic_int dumping; // A dump is being written
+#endif
+// Announcements (reactor mode) waiting to be merged, per shard
+typedef struct Crowdannouncement {
+    int count;
+    char names[BCAST_NAMES][MAX_NAME + 1];
+} Crowd;
+__thread Crowd entering;
+__thread Crowd leaving;
+__thread Timer heraldtimer; // Sends the held announcements
+__thread Ladder ladder;
+__thread Timer matchtimer; // Retries the waiting clients
+__thread Wheel wheel;
+fd_set regiset; // Sockets the forking server selects on
+__thread short matching; // In a matching pass, 2 if the lists changed under it
+Store *store; // Memory mapped file
+Player *players; // Records after the head, open addressing by name
+pthread_mutex_t playerlock = PTHREAD_MUTEX_INITIALIZER; // The board, and ratings as they change
+pthread_mutex_t recordlocks[PLAYER_STRIPES]; // Fields of the records a lookup reads
+Rescan rescan; // Under playerlock
+pthread_cond_t rescancond = PTHREAD_COND_INITIALIZER;
+Stats *statslots; // Shared mapping, forked battles count in it too
+Bucket (*chatback)[2]; // Shared mapping, the chat buckets forked battles leave by battle handle
+Bucket *chatleft; // In a forked battle, its slot of chatback
+__thread Stats *stats; // Slot of the running thread
+__thread long long woke_us; // When the event loop last woke up
+Slab clientslab;
+Slab battleslab;
+Slab chunkslab;
+Slab msgslab;
+Client **fdtab; // Client of each socket
+int maxfd;
+unsigned *pidtab; // Battle handle + 1 of each battle child pid
+int maxpid;
+char **args; // Command line, for the successor
+atomic_int restart; // SIGUSR2 came, on whichever thread
+int successor = -1; // Socket to the successor, once handing over
+atomic_int handing; // Clients go to the successor, nothing new starts here
+int handoff_soc = -1; // Socket to the predecessor, while it hands over
+__thread Timer draintimer; // Exits once handed over and the last battle ended
+int listeners[MAX_LISTENERS]; // Listening sockets, all on the same port
+short nlisten;
+short spread; // A listening socket per shard (SO_REUSEPORT), the kernel spreads connections over them
+__thread Bucket admitbucket; // Of the shard's share of ADMIT_RATE
+Peer *peers; // Addresses of the connected clients, open addressing
+pthread_mutex_t peerlock = PTHREAD_MUTEX_INITIALIZER;
+Name *names; // Names of the registered clients, open addressing (linear probing)
+unsigned namemask; // Slots - 1, a power of 2 of at least twice MAX_CLIENTS
+pthread_mutex_t namelock = PTHREAD_MUTEX_INITIALIZER;
+atomic_uint battletop; // Battle handles in use are below it, for lookups by id
+atomic_ullong nextbattle = 1; // Battle ids when not journaling
+int port = PORT; // Listening port, -P
+int fedsoc = -1; // Socket to the coordinator, read by shard 0
+char *fedaddr = FED_ADDR;
+pthread_mutex_t fedlock = PTHREAD_MUTEX_INITIALIZER; // Lines to the coordinator are written whole
+Worker *workers; // Battle process pool of the forking server, -w
+short nworker;
+int poolsoc = -1; // In a worker, its channel to the server
+Battle *reportlist; // In a worker, battles settled and waiting for their output to go
 
 int _init_server();
+int open_listener();
+void init_pools();
+void slab_init(Slab *s, size_t size, unsigned count);
+void *slab_get(Slab *s);
+void slab_put(Slab *s, void *obj);
+unsigned slab_handle(Slab *s, void *obj);
+void *slab_at(Slab *s, unsigned handle);
 Clientptr init_client(int soc);
+Clientptr admit(int soc, struct sockaddr_in *addr);
+short take_token(Bucket *b, double rate, double burst, long long now);
+int enter_peer(struct sockaddr_in *addr, long long now);
+void leave_peer(unsigned peer);
+uint32_t hash_name(const char *name);
+short claim_name(Clientptr client);
+void release_name(Clientptr client);
+void move_name(Clientptr client, short home);
+Clientptr find_name(const char *name, short *home);
+void name_taken(Clientptr client);
+void shed(int soc, short reason);
 int getname(Clientptr client);
 Clientptr add_client(Clientptr list, Clientptr client);
 Battle *add_battle(Battle *list, Battle *battle);
@@ -76,11 +737,48 @@ Clientptr poll_client(Clientptr list, Clientptr client);
 Battle *poll_battle(Battle *list, Battle *battle);
 void welcome_client(Clientptr client);
 void _start_battle(Clientptr c1, Clientptr c2);
-void _end_battle(pid_t battlepid);
+void _end_battle(pid_t battlepid, int status);
 int client_connection(Clientptr client);
-void notify_all(char *msg, int msglen);
+void notify_all(char *msg, int msglen, char *bin, int binlen, short lobby);
 Battle *poll_battle(Battle *list, Battle *battle);
 void _match();
+void pair_clients(Clientptr c1, Clientptr c2, long long now);
+void match_pass(short all);
+void match_tick(Timer *timer);
+Clientptr partner(Clientptr client, long long now);
+int window(Clientptr client, long long now);
+short met(Clientptr c1, Clientptr c2);
+void queue_client(Clientptr client);
+void unqueue_client(Clientptr client);
+short rung(int rating);
+int busy_above(int b, int hi);
+int busy_below(int b, int lo);
+unsigned find_player(char *name, int *rating);
+void open_players(char *path);
+void rank_player(unsigned slot);
+void off_board(unsigned slot);
+void candidate(unsigned slot);
+void drop_candidate(unsigned slot);
+void start_rescan();
+void *rescan_loop(void *arg);
+void merge_candidates();
+short leaders(Player top[], short max);
+void lobby_command(Clientptr client, char line[], short n);
+void show_top(Clientptr client);
+void challenge_command(Clientptr client, char *name);
+short in_lobby(Clientptr client);
+void watch_command(Clientptr client, char *arg);
+void watch(Clientptr client, Battle *b);
+void unwatch(Clientptr client);
+void rejoin(Clientptr client);
+short summarize(Battle *b, Summary *s);
+Battle *find_battle(uint64_t id, Summary *s);
+void list_battles(Clientptr client);
+void spectate(Battle *b, const char *text, short tlen, const char *bin, short blen);
+void watch_turn(Battle *b);
+void watch_chat(Battle *b, Clientptr speaker, char line[], short n);
+void watch_end(Battle *b, short result);
+void rate_battle(Clientptr c1, Clientptr c2, short result);
 void sigchld_handler(int sig);
 Battle *init_battle(pid_t pid, Clientptr client1, Clientptr client2);
 void init_battler(Clientptr client);
@@ -88,65 +786,399 @@ void battle(Clientptr c1, Clientptr c2);
 void battle(Clientptr c1, Clientptr c2);
 void play_turn(Clientptr c1, Clientptr c2, char buf[], short max, fd_set set);
 void settle(Clientptr winner, Clientptr loser, short tie, char buf[]);
-void evaluate(Clientptr c1, Clientptr c2, char buf[]);
-short dmg(char c);
-int speak(char buf[], Clientptr speaker, Clientptr listener);
+short evaluate(Clientptr c1, Clientptr c2, char buf[]);
+void open_speech(Clientptr client);
+void speech_char(Clientptr speaker, Clientptr listener, char c);
+void say(Clientptr speaker, Clientptr listener, char line[], short n);
+short chat_token(Clientptr client);
+void lobby_say(Clientptr client, char text[], short n);
 char move(Clientptr client, char mov);
+void engage(Clientptr c1, Clientptr c2, char buf[]);
+void turn_info(Clientptr client, Clientptr opponent, char buf[]);
+int clear_garbage(Clientptr client, char buf[]);
+void _resume_client(Clientptr client);
+void run_reactor(short threads);
+void *shard_loop(void *arg);
+void notify_local(char *msg, int msglen, short lobby);
+void fan_out(Outbuf *buf, Outbuf *bin, short lobby);
+void release_chunk(Outbuf *buf);
+void send_shared(Clientptr client, Outbuf *buf);
+void announce(Crowd *crowd, char *name);
+void herald(Timer *timer);
+short render_crowd(Crowd *crowd, char *verb, char msg[]);
+short frame_crowd(Crowd *crowd, char kind, char out[]);
+long long now_ms();
+void post(Shard *to, Msg *msg);
+void take_inbox();
+void wake(Shard *s);
+void attach(Clientptr client);
+void detach(Clientptr client);
+short share_waiter(Clientptr client, long long now);
+void publish_waiting(short all);
+uint64_t span(short w, int lo, int hi);
+void ship();
+int push_match(Shard *s, Clientptr c1, Clientptr c2);
+int pop_match(Shard *s, Clientptr *c1, Clientptr *c2);
+void take_matches();
+void start_pair(Clientptr c1, Clientptr c2);
+void accept_clients(int listen_soc);
+void register_client(Clientptr client);
+short negotiate(Clientptr client);
+void greet(Clientptr client);
+Battle *open_battle(Clientptr c1, Clientptr c2);
+void begin_turn(Battle *b);
+void battle_input(Battle *b, Clientptr client);
+void pick(Battle *b, short i, char c);
+void resolve_turn(Battle *b);
+void close_battle(Battle *b);
+void bury();
+void send_client(Clientptr client, const char *msg, int len);
+void tell(Clientptr client, const char *text, int len, char type, const void *payload, short plen);
+short frame(char out[], char type, const void *payload, short len);
+void mark_dirty(Clientptr client);
+void flush_client(Clientptr client);
+void flush_dirty();
+void drop_output(Clientptr client);
+void drop_slow(Clientptr client);
+void client_input(Clientptr client);
+void fill_input(Clientptr client);
+short take_char(Clientptr client, char *c);
+short take_line(Clientptr client, char line[], short max);
+short cut_line(Clientptr client, char line[], short max);
+short take_frame(Clientptr client, char out[], short max);
+void lobby_input(Clientptr client);
+void wheel_init();
+void wheel_place(Timer *timer);
+void wheel_run();
+int wheel_timeout();
+void timer_arm(Timer *timer, int ms, void (*fire)(Timer *timer));
+void timer_cancel(Timer *timer);
+void register_timeout(Timer *timer);
+void idle_timeout(Timer *timer);
+void move_timeout(Timer *timer);
+void keep_alive(int soc);
+void serve_stats(char *path);
+void open_journal(char *dir);
+void *journal_loop(void *arg);
+int next_segment(int fd, unsigned long long *seg);
+void reserve_ids(uint64_t upto);
+uint64_t journal_id();
+void journal_put(char rec[], short len);
+void journal_start(Clientptr c1, Clientptr c2);
+void journal_turn(Clientptr c1, Clientptr c2, char mov1, char mov2, short late);
+void journal_chat(Clientptr speaker, char text[], short n);
+void journal_spam(Clientptr spammer);
+void journal_end(Clientptr c1, Clientptr c2, short result);
+void journal_settle();
+void restart_handler(int sig);
+void restart_server();
+void accepting(short on);
+void drain_clients();
+void drain_tick(Timer *timer);
+void hand_over(Clientptr c1, Clientptr c2, short result);
+int take_listener();
+int take_handoff();
+Clientptr adopt_client(int soc, Handed *h, char out[]);
+uint64_t journal_us();
+#ifdef TRACE
+void open_trace();
+void trace_thread(short tid);
+uint64_t tsc();
+void trace_span(uint64_t start, short what);
+void trace_handler(int sig);
+void dump_trace();
+void *trace_loop(void *arg);
+#endif
+void *stats_loop(void *arg);
+int render_stats(char out[], int max);
+int render_hist(char out[], int max, char *name, char *help, Hist *h);
+void hist_add(Hist *h, long long us);
+long long now_us();
+void record_player(Clientptr client, char outcome);
+void queue_output(Clientptr client, const char *msg, int len);
+void open_federation(char *where);
+void fed_send(const char *fmt, ...);
+void fed_offer(Clientptr client);
+void fed_read();
+void fed_command(char *line);
+void fed_paired(Msg *msg);
+void open_relay(Clientptr client, char *line);
+void relay_guest(Clientptr client);
+void host_guest(Clientptr guest, Clientptr rival);
+void fed_input(Clientptr client);
+void relay_frames(Clientptr link);
+void relay_end(Clientptr link);
+void fed_release(Clientptr client);
+void fed_timeout(Timer *timer);
+void relay_rated(Clientptr guest, char outcome);
+void finish_battle(Battle *b, short outcome);
+void lobby_lines(Clientptr client, char buf[], ssize_t got);
+int spawn_worker(Worker *w);
+short pool_battle(Clientptr c1, Clientptr c2);
+int take_reports(Worker *w);
+int lose_worker(Worker *w);
+void worker_loop(int soc);
+void take_jobs();
+void report_battles();
+void drain_timeout(Timer *timer);
 
 
 
-int main() { // Launch Server
+int main(int argc, char *argv[]) { // Launch Server
+    int opt;
+    short threads = 1;
+    args = argv;
+    char *statpath = NULL, *playerpath = PLAYER_FILE, *journalpath = NULL, *fedpath = NULL;
+    while ((opt = getopt(argc, argv, "et:rw:s:p:j:P:c:a:")) != -1) {
+        if (opt == 'e') reactor = 1; // Battles run in process, no fork
+        else if (opt == 't') { // Sharded reactors, 0 for one per core
+            reactor = 1;
+            threads = atoi(optarg);
+            if (threads < 1) threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        else if (opt == 'r') spread = 1; // A listening socket per shard
+        else if (opt == 'w') { // Pre-forked battle processes, 0 for one per core
+            nworker = atoi(optarg);
+            if (nworker < 1) nworker = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        else if (opt == 's') statpath = optarg; // Metrics on a unix socket
+        else if (opt == 'p') playerpath = optarg; // Player store
+        else if (opt == 'j') journalpath = optarg; // Battle journal directory
+        else if (opt == 'P') port = atoi(optarg); // Listening port
+        else if (opt == 'c') fedpath = optarg; // Coordinator of the federation
+        else if (opt == 'a') fedaddr = optarg; // Address other nodes reach this one at
+        else {
+            fprintf(stderr, "usage: %s [-e | -t threads [-r] | -w workers] [-s stats_socket] [-p player_file] [-j journal_dir] [-P port] [-c coordinator [-a address]]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (fedpath && !reactor) {
+        fprintf(stderr, "%s: -c needs -e or -t\n", argv[0]);
+        exit(1);
+    }
+    if (nworker && reactor) {
+        fprintf(stderr, "%s: -w is for the forking server, not with -e or -t\n", argv[0]);
+        exit(1);
+    }
     int listen_soc = _init_server();
-    int max = listen_soc;
-    fd_set regiset, set;
+#ifdef TRACE
+    open_trace();
+#endif
+    open_players(playerpath);
+    if (journalpath) open_journal(journalpath);
+    if (statpath) serve_stats(statpath);
+    if (handoff_soc != -1) listen_soc = take_listener(); // Once ready for clients
+    if (fedpath) open_federation(fedpath);
+    if (reactor) run_reactor(threads); // Never returns
+    if (fcntl(listen_soc, F_SETFL, O_NONBLOCK) == -1) fprintf(stderr, "%s/fcntl: %s\n", __func__, strerror(errno)); // Accepts until the queue is empty
+    int max = (listen_soc > handoff_soc) ? listen_soc:handoff_soc;
+    fd_set set;
     FD_ZERO(&regiset);
     FD_SET(listen_soc, &regiset);
+    if (handoff_soc != -1) FD_SET(handoff_soc, &regiset);
     sigset_t lock, unlock;
     sigemptyset(&lock);
-    // Lock sigchld_handler from matching when the main process is matching
+    // Lock sigchld_handler from matching when the main process is matching, it only runs in pselect()
     sigaddset(&lock, SIGCHLD);
-    // Prevent processes from shutting down by writting on closed socket
-    sigaddset(&lock, SIGPIPE);
-    sigaddset(&unlock, SIGPIPE);
+    sigaddset(&lock, SIGUSR2); // Restarts between iterations too
+    sigaddset(&lock, SIGUSR1); // Trace dumps as well
+    sigprocmask(SIG_BLOCK, &lock, &unlock);
+    if (nworker && !(workers = calloc(nworker, sizeof(Worker)))) {
+        fprintf(stderr, "%s/calloc: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    for (short i = 0; i < nworker; i++) { // Forked now, while the server is small and holds no client
+        int soc = spawn_worker(&workers[i]);
+        if (soc > max) max = soc;
+    }
+    wheel_init();
     while (1) {
+        wheel_run(); // Before select, so no expired socket is seen ready
         set = regiset;
-        int n = select(max + 1, &set, NULL, NULL, NULL);
+        int wait = wheel_timeout();
+        struct timespec tick = {.tv_sec = wait / 1000, .tv_nsec = wait % 1000 * 1000000L};
+        TRACE_BEGIN(waited);
+        int n = pselect(max + 1, &set, NULL, NULL, (wait < 0) ? NULL:&tick, &unlock);
+        TRACE_END(waited, SP_WAIT);
+        woke_us = now_us();
+        if (restart) restart_server();
+        TRACE_DUMP();
         if (n == -1) {
-            fprintf(stderr, "%s/select: %s\n", __func__, strerror(errno));
+            if (errno != EINTR) fprintf(stderr, "%s/select: %s\n", __func__, strerror(errno));
             continue;
         }
-        if (FD_ISSET(listen_soc, &set)) { // New Client comming
-            int new_soc = accept(listen_soc, NULL, NULL);
-            if (new_soc == -1) fprintf(stderr, "%s/accept: %s\n", __func__, strerror(errno));
-            FD_SET(new_soc, &regiset);
-            registerlist = add_client(registerlist, init_client(new_soc));
-            write(new_soc, "What is your name?", 19);
-            if (new_soc > max) max = new_soc;
+        if (!n) continue;
+        if (handoff_soc != -1 && FD_ISSET(handoff_soc, &set)) { // Clients of the predecessor
+            int top = take_handoff();
+            if (top > max) max = top;
+            if (--n == 0) continue;
+        }
+        for (short i = 0; i < nworker && n > 0; i++) { // Battles the pool settled
+            if (workers[i].soc == -1 || !FD_ISSET(workers[i].soc, &set)) continue;
+            n--;
+            int top = take_reports(&workers[i]);
+            if (top > max) max = top;
+        }
+        if (!n) continue;
+        if (FD_ISSET(listen_soc, &set)) { // New Clients comming, a batch at a time
+            TRACE_BEGIN(accepted);
+            for (short i = 0; i < ACCEPT_BATCH; i++) {
+                struct sockaddr_in addr;
+                socklen_t len = sizeof(addr);
+                int new_soc = accept4(listen_soc, (struct sockaddr *) &addr, &len, SOCK_CLOEXEC);
+                if (new_soc == -1) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) fprintf(stderr, "%s/accept4: %s\n", __func__, strerror(errno));
+                    break;
+                }
+                Clientptr client = admit(new_soc, &addr);
+                if (!client) continue; // Shed
+                keep_alive(new_soc);
+                FD_SET(new_soc, &regiset);
+                registerlist = add_client(registerlist, client);
+                STAT_ADD(accepts, 1);
+                STAT_ADD(clients[S_REGISTER], 1);
+                timer_arm(&client->timer, REGISTER_TIMEOUT, register_timeout);
+                send_client(client, NAME_MSG, NAME_MSG_LEN);
+                if (new_soc > max) max = new_soc;
+            }
+            TRACE_END(accepted, SP_ACCEPT);
             if (--n == 0) continue;
         }
         Clientptr next;
         for (Clientptr cur = registerlist; cur && n; cur = next) { // Registering clients inputting names
             next = cur->next;
             if (!FD_ISSET(cur->soc, &set)) continue; // Socket not ready
+            TRACE_BEGIN(registered);
             short got = getname(cur);
+            TRACE_END(registered, SP_REGISTER);
             if (got < 0) continue; // Haven't finished the name yet
+            if (got > 0 && !claim_name(cur)) { // Someone online goes by it
+                cur->hp = 0;
+                name_taken(cur);
+                continue;
+            }
+            registerlist = poll_client(registerlist, cur);
+            STAT_ADD(clients[S_REGISTER], -1);
+            FD_CLR(cur->soc, &regiset);
+            FD_CLR(cur->soc, &set); // Read already, a lobby client from now on
             if (got > 0) { // Name Complete
-                registerlist = poll_client(registerlist, cur);
+                cur->state = C_LOBBY;
                 welcome_client(cur);
-                sigprocmask(SIG_BLOCK, &lock, &unlock); // Block sigchld (which also calls _match())
                 _match(); // Registered client inidcating potential match
-                sigprocmask(SIG_SETMASK, &unlock, &lock);
-            }
-            else { // Got nothing, indicating disconnected client (or error)
-                registerlist = poll_client(registerlist, cur);
-                remove_client(cur, 0);
             }
-            FD_CLR(cur->soc, &regiset);
+            else remove_client(cur, 0); // Got nothing, indicating disconnected client (or error)
             if (--n == 0) break;
         }
+        for (Clientptr cur = matchingclient; cur && n > 0; cur = next) { // Lobby clients, watched for hang ups
+            next = cur->next;
+            if (!FD_ISSET(cur->soc, &set)) continue; // Socket not ready
+            n--;
+            char buf[MAX_LINE + 1];
+            ssize_t got = read(cur->soc, buf, sizeof(buf));
+            if (got > 0) STAT_ADD(bytes_in, got);
+            if (got > 0) { // Still around, lines are commands
+                lobby_lines(cur, buf, got);
+                if (!in_lobby(cur)) break; // Challenged into a battle, the lobby changed under next
+            }
+            else if (!got || errno != EINTR) { // Disconnected client
+                cur->gone = 1;
+                unqueue_client(cur);
+                remove_client(cur, 1);
+            }
+        }
     }
 }
 
+/*
+ * Preallocate clients, battles, output chunks and shard messages, and the fd/pid lookup tables
+*/
+void init_pools() {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == -1) fprintf(stderr, "%s/getrlimit: %s\n", __func__, strerror(errno));
+    maxfd = (lim.rlim_cur == RLIM_INFINITY || lim.rlim_cur > 4 * MAX_CLIENTS) ? 4 * MAX_CLIENTS:lim.rlim_cur;
+    maxpid = 1 << 22; // Linux PID_MAX_LIMIT
+    fdtab = mmap(NULL, sizeof(Client *) * maxfd, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    pidtab = mmap(NULL, sizeof(unsigned) * maxpid, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    peers = mmap(NULL, sizeof(Peer) * PEER_SLOTS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    for (namemask = 1; namemask < 2 * MAX_CLIENTS; namemask <<= 1);
+    names = mmap(NULL, sizeof(Name) * namemask--, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (fdtab == MAP_FAILED || pidtab == MAP_FAILED || peers == MAP_FAILED || names == MAP_FAILED) {
+        fprintf(stderr, "%s/mmap: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    slab_init(&clientslab, sizeof(Client), MAX_CLIENTS);
+    slab_init(&battleslab, sizeof(Battle), MAX_BATTLES);
+    slab_init(&chunkslab, sizeof(Outbuf), OUT_POOL);
+    slab_init(&msgslab, sizeof(Msg), MSG_POOL);
+    statslots = mmap(NULL, sizeof(Stats) * STAT_SLOTS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (statslots == MAP_FAILED) {
+        fprintf(stderr, "%s/mmap: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    stats = &statslots[0];
+    if (reactor) return;
+    chatback = mmap(NULL, sizeof(*chatback) * MAX_BATTLES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (chatback == MAP_FAILED) {
+        fprintf(stderr, "%s/mmap: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+}
+
+/*
+ * Reserve a slab, pages are only backed once touched
+*/
+void slab_init(Slab *s, size_t size, unsigned count) {
+    s->size = (size + 63) & ~(size_t) 63;
+    s->count = count;
+    s->base = mmap(NULL, s->size * count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    s->next = mmap(NULL, sizeof(atomic_uint) * count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s->base == MAP_FAILED || s->next == MAP_FAILED) {
+        fprintf(stderr, "%s/mmap: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    for (unsigned i = 0; i < count; i++) atomic_init(&s->next[i], (i + 1 < count) ? i + 2:0);
+    atomic_init(&s->head, 1);
+}
+
+/*
+ * Take a free object, NULL if exhausted
+*/
+void *slab_get(Slab *s) {
+    uint64_t head = atomic_load(&s->head), next;
+    do {
+        if (!(unsigned) head) return NULL;
+        next = (((head >> 32) + 1) << 32) | atomic_load_explicit(&s->next[(unsigned) head - 1], memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(&s->head, &head, next));
+    return slab_at(s, (unsigned) head - 1);
+}
+
+/*
+ * Give an object back
+*/
+void slab_put(Slab *s, void *obj) {
+    unsigned i = slab_handle(s, obj) + 1;
+    uint64_t head = atomic_load(&s->head), next;
+    do {
+        atomic_store_explicit(&s->next[i - 1], (unsigned) head, memory_order_relaxed);
+        next = (((head >> 32) + 1) << 32) | i;
+    } while (!atomic_compare_exchange_weak(&s->head, &head, next));
+}
+
+/*
+ * Handle (index) of an object
+*/
+unsigned slab_handle(Slab *s, void *obj) {
+    return ((char *) obj - s->base) / s->size;
+}
+
+/*
+ * Object of a handle
+*/
+void *slab_at(Slab *s, unsigned handle) {
+    return s->base + (size_t) handle * s->size;
+}
+
 /*
  * Initialize the server
 */
@@ -156,20 +1188,40 @@ int _init_server() {
     action.sa_handler = sigchld_handler;
     sigemptyset(&action.sa_mask);
     action.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &action, NULL) < 0) fprintf(stderr, "%s/sigaction/CHLD: %s\n", __func__, strerror(errno));
+    if (!reactor && sigaction(SIGCHLD, &action, NULL) < 0) fprintf(stderr, "%s/sigaction/CHLD: %s\n", __func__, strerror(errno));
+    action.sa_handler = restart_handler;
+    if (sigaction(SIGUSR2, &action, NULL) < 0) fprintf(stderr, "%s/sigaction/USR2: %s\n", __func__, strerror(errno));
+    // Prevent processes from shutting down by writting on closed socket, dropped clients show up as read() == 0 instead
+    signal(SIGPIPE, SIG_IGN);
+    init_pools();
     // Lists
     registerlist = NULL; // Lists
     matchingclient = NULL;
     matchedclient = NULL;
     battlelist = NULL;
+    char *inherit = getenv(HANDOFF_ENV);
+    if (inherit) { // Started by a hot restart, the listener comes from the predecessor
+        handoff_soc = atoi(inherit);
+        unsetenv(HANDOFF_ENV);
+        return -1;
+    }
     // Socket
-    int listen_soc = socket(AF_INET, SOCK_STREAM, 0);
+    listeners[nlisten++] = open_listener();
+    return listeners[0];
+}
+
+/*
+ * Open a listening socket on the port, one more of the shared port with -r
+*/
+int open_listener() {
+    int listen_soc = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (listen_soc == -1) fprintf(stderr, "%s/socket: %s\n", __func__, strerror(errno));
     int yes = 1;
     if ((setsockopt(listen_soc, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) fprintf(stderr, "%s/setsockopt: %s\n", __func__, strerror(errno));
-    struct sockaddr_in r = {.sin_family = AF_INET, .sin_port = htons(PORT), .sin_addr = {.s_addr = INADDR_ANY}};
+    if (spread && setsockopt(listen_soc, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) fprintf(stderr, "%s/setsockopt/REUSEPORT: %s\n", __func__, strerror(errno));
+    struct sockaddr_in r = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr = {.s_addr = INADDR_ANY}};
     if (bind(listen_soc, (struct sockaddr *) &r, sizeof(r))) fprintf(stderr, "%s/bind: %s\n", __func__, strerror(errno));
-    if (listen(listen_soc, MAX_PARTIAL)) fprintf(stderr, "%s/listen: %s\n", __func__, strerror(errno));
+    if (listen(listen_soc, LISTEN_BACKLOG)) fprintf(stderr, "%s/listen: %s\n", __func__, strerror(errno));
     return listen_soc;
 }
 
@@ -179,6 +1231,7 @@ int _init_server() {
 int getname(Clientptr client) {
     int got = read(client->soc, client->name + client->hp, MAX_NAME - client->hp); // Should not eceed MAX_NAME
     if (got > 0) { // Got something
+        STAT_ADD(bytes_in, got);
         client->hp += got;
         if (client->name[client->hp - 1] == '\n') { // newline
             client->name[client->hp -= 1] = '\0';
@@ -197,23 +1250,218 @@ int getname(Clientptr client) {
  * Welcome a registered client
 */
 void welcome_client(Clientptr client) {
-    char msg[client->hp + 24];
-    if (snprintf(msg, sizeof(msg), "**%s enters the arena**\r\n", client->name) < 0) fprintf(stderr, "%s/snprintf: %s\n", __func__, strerror(errno));
-    notify_all(msg, sizeof(msg));
-    matchingclient = add_client(matchingclient, client);
-    if (write(client->soc, WAIT_MSG, WAIT_MSG_LEN) == -1) fprintf(stderr, "%s/write: %s\n", __func__, strerror(errno));
+    if (reactor) announce(&entering, client->name); // Merged with other arrivals
+    else {
+        char msg[client->hp + 24];
+        if (snprintf(msg, sizeof(msg), "**%s enters the arena**\r\n", client->name) < 0) fprintf(stderr, "%s/snprintf: %s\n", __func__, strerror(errno));
+        notify_all(msg, sizeof(msg), NULL, 0, 0);
+    }
+    client->player = find_player(client->name, &client->rating);
+    memset(client->recent, 0, sizeof(client->recent));
+    client->recentpos = 0;
+    queue_client(client);
+    tell(client, WAIT_MSG, WAIT_MSG_LEN, F_WAIT, NULL, 0);
 }
 
 /*
- * Create a new client
+ * Create a new client, NULL if there is no slot left for it
 */
 Clientptr init_client(int soc) {
-    Clientptr client = malloc(sizeof(Client));
+    if (soc < 0 || soc >= maxfd) return NULL;
+    Clientptr client = slab_get(&clientslab);
+    if (!client) return NULL;
+    fdtab[soc] = client;
     client->soc = soc;
     client->hp = 0;
+    client->state = C_REGISTER;
+    client->gone = 0;
+    client->timer.armed = 0;
+    client->hello = client->binary = 0;
+    client->adopted = 0;
+    client->peer = 0;
+    client->named = 0;
+    client->chat.at = 0; // Full
+    client->battle = NULL;
+    client->offered = client->relay = 0;
+    client->link = NULL;
+    client->fedkey = 0;
+    client->outhead = client->outn = 0;
+    client->outoff = client->outlen = 0;
+    client->dirty = 0;
+    client->inhead = client->inlen = client->inscan = 0;
+    client->hup = client->eof = 0;
+    return client;
+}
+
+/*
+ * Let a new connection in as a client, or shed it when the server is full or it comes too fast
+ * NULL when shed, its socket closed
+*/
+Clientptr admit(int soc, struct sockaddr_in *addr) {
+    long long now = now_ms();
+    short share = reactor ? nshard:1, reason = SH_FULL;
+    int peer = 0;
+    Clientptr client = NULL;
+    if (!reactor && soc >= FD_SETSIZE); // select() can not watch it
+    else if (!take_token(&admitbucket, (double) ADMIT_RATE / share, fmax(1, (double) ADMIT_BURST / share), now)) reason = SH_RATE;
+    else if ((peer = enter_peer(addr, now)) < 0) reason = SH_PEER;
+    else if (!(client = init_client(soc))) leave_peer(peer); // Out of client slots
+    if (!client) {
+        shed(soc, reason);
+        return NULL;
+    }
+    client->peer = peer;
     return client;
 }
 
+/*
+ * Take a token from a bucket, 0 if it is empty
+*/
+short take_token(Bucket *b, double rate, double burst, long long now) {
+    b->tokens = b->at ? fmin(burst, b->tokens + (now - b->at) * rate / 1000):burst;
+    b->at = now;
+    if (b->tokens < 1) return 0;
+    b->tokens -= 1;
+    return 1;
+}
+
+/*
+ * Count a new connection from its address, return the peer slot + 1 (0 if not counted)
+ * or -1 if the address is over its rate or cap
+*/
+int enter_peer(struct sockaddr_in *addr, long long now) {
+    uint32_t ip = addr->sin_addr.s_addr, h = (ip * 2654435761u) >> 16;
+    if ((ntohl(ip) >> 24) == 127) return 0; // Loopback, load generators and local proxies
+    Peer *p = NULL, *spare = NULL;
+    int slot = 0;
+    pthread_mutex_lock(&peerlock);
+    for (short i = 0; i < PEER_PROBE && !p; i++) {
+        Peer *q = &peers[(h + i) & (PEER_SLOTS - 1)];
+        if (q->addr == ip) p = q;
+        // Free, or idle for long enough that a fresh entry would be the same
+        else if (!spare && !q->live && (!q->addr || q->bucket.tokens + (now - q->bucket.at) * PEER_RATE / 1000.0 >= PEER_BURST)) spare = q;
+    }
+    if (!p && spare) {
+        p = spare;
+        p->addr = ip;
+        p->bucket.at = 0;
+    }
+    if (p && (p->live >= PEER_MAX || !take_token(&p->bucket, PEER_RATE, PEER_BURST, now))) slot = -1;
+    else if (p) {
+        p->live++;
+        slot = p - peers + 1;
+    }
+    pthread_mutex_unlock(&peerlock);
+    return slot;
+}
+
+/*
+ * Uncount a connection counted by enter_peer()
+*/
+void leave_peer(unsigned peer) {
+    if (!peer) return;
+    pthread_mutex_lock(&peerlock);
+    peers[peer - 1].live--;
+    pthread_mutex_unlock(&peerlock);
+}
+
+/*
+ * FNV-1a of a name
+*/
+uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const char *c = name; *c; c++) h = (h ^ (unsigned char) *c) * 16777619u;
+    return h;
+}
+
+/*
+ * Register a client's name, return 0 if someone online has it (or the table is full)
+*/
+short claim_name(Clientptr client) {
+    uint32_t h = hash_name(client->name);
+    short claimed = 0;
+    pthread_mutex_lock(&namelock);
+    for (unsigned i = h & namemask, probes = 0; probes <= namemask; i = (i + 1) & namemask, probes++) {
+        Name *e = &names[i];
+        if (e->client && (e->hash != h || strcmp(e->name, client->name))) continue;
+        if (!e->client) {
+            memcpy(e->name, client->name, sizeof(e->name));
+            e->hash = h;
+            e->client = client;
+            e->home = reactor ? shard->id:0;
+            client->named = i + 1;
+            claimed = 1;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&namelock);
+    return claimed;
+}
+
+/*
+ * Unregister a client's name, shifting later names of the run back so lookups never need tombstones
+*/
+void release_name(Clientptr client) {
+    if (!client->named) return;
+    pthread_mutex_lock(&namelock);
+    unsigned hole = client->named - 1;
+    names[hole].client = NULL;
+    client->named = 0;
+    for (unsigned i = (hole + 1) & namemask; names[i].client; i = (i + 1) & namemask) {
+        if (((i - names[i].hash) & namemask) < ((i - hole) & namemask)) continue; // Would move before its slot
+        names[hole] = names[i];
+        names[hole].client->named = hole + 1;
+        names[i].client = NULL;
+        hole = i;
+    }
+    pthread_mutex_unlock(&namelock);
+}
+
+/*
+ * Note the shard a registered client is on
+*/
+void move_name(Clientptr client, short home) {
+    if (!client->named) return;
+    pthread_mutex_lock(&namelock);
+    names[client->named - 1].home = home;
+    pthread_mutex_unlock(&namelock);
+}
+
+/*
+ * The client registered under a name and its shard, NULL if nobody online has it
+ * Only the client's shard may look at it
+*/
+Clientptr find_name(const char *name, short *home) {
+    uint32_t h = hash_name(name);
+    Clientptr found = NULL;
+    pthread_mutex_lock(&namelock);
+    for (unsigned i = h & namemask; names[i].client; i = (i + 1) & namemask) {
+        if (names[i].hash != h || strcmp(names[i].name, name)) continue;
+        found = names[i].client;
+        *home = names[i].home;
+        break;
+    }
+    pthread_mutex_unlock(&namelock);
+    return found;
+}
+
+/*
+ * Prompt a client for another name, its choice is taken
+*/
+void name_taken(Clientptr client) {
+    tell(client, TAKEN_MSG, TAKEN_MSG_LEN, F_NOTICE, &(char) {N_TAKEN}, 1);
+    tell(client, NAME_MSG, NAME_MSG_LEN, F_NAME, NULL, 0);
+}
+
+/*
+ * Turn a new connection away with a notice, instead of taking in more than can be served
+*/
+void shed(int soc, short reason) {
+    if (send(soc, FULL_MSG, FULL_MSG_LEN, MSG_DONTWAIT) > 0) STAT_ADD(bytes_out, FULL_MSG_LEN);
+    close(soc);
+    STAT_ADD(shed[reason], 1);
+}
+
 /*
  * add a client to the top of a list
 */
@@ -235,171 +1483,704 @@ Battle *add_battle(Battle *list, Battle *node) {
 }
 
 /*
- * Try matching the two clients
+ * Try matching the clients queued since the last pass
 */
 void _match() {
-    while (matchingclient && matchingclient->next) {
-        Clientptr c1 = matchingclient;
-        if (!client_connection(c1)) { // Clear zombie client
-            matchingclient = poll_client(matchingclient, c1);
-            remove_client(c1, 1);
-            continue;
-        }
-        Clientptr c2 = (c1->next->next) ? c1->next->next:c1->next; // Prioritize matcching clients exit from different battles
-        if (!client_connection(c2)) { // Clear zombie client
-            matchingclient = poll_client(matchingclient, c2);
-            remove_client(c2, 1);
-            continue;
+    match_pass(0);
+}
+
+/*
+ * Pair waiting clients up by rating, all of them or only the fresh ones
+*/
+void match_pass(short all) {
+    if (atomic_load_explicit(&handing, memory_order_relaxed)) return; // The successor matches
+    if (matching) { // Called back from a battle started by the pass
+        matching = 2;
+        return;
+    }
+    TRACE_BEGIN(matched);
+    long long now = now_ms();
+    Clientptr next;
+    memset(wanted, 0, sizeof(wanted));
+    do {
+        matching = 1;
+        for (Clientptr c1 = matchingclient; c1 && (all || ladder.fresh); c1 = next) {
+            next = c1->next;
+            if (!c1->fresh && !all) continue;
+            if (c1->fresh) {
+                c1->fresh = 0;
+                ladder.fresh--;
+            }
+            Clientptr c2 = partner(c1, now);
+            if (matching == 2) { // A zombie was cleared, next might be gone
+                c1->fresh = 1;
+                ladder.fresh++;
+                break;
+            }
+            if (!c2) {
+                if (nshard > 1 && share_waiter(c1, now)) continue; // Another shard has some in its window
+                if (fedsoc != -1 && !c1->offered && now - c1->queued_at >= FED_SHARE) fed_offer(c1); // Maybe another node has one
+                continue;
+            }
+            if (!client_connection(c1)) { // Clear zombie client
+                unqueue_client(c1);
+                remove_client(c1, 1);
+                continue;
+            }
+            if (next == c2) next = c2->next;
+            pair_clients(c1, c2, now);
+            if (matching == 2) break;
         }
-        // Put matched clients in a battle
-        matchingclient = poll_client(matchingclient, c1);
-        matchedclient = add_client(matchedclient, c1);
-        matchingclient = poll_client(matchingclient, c2);
-        matchedclient = add_client(matchedclient, c2);
-        _start_battle(c1, c2);
+    } while (matching == 2);
+    matching = 0;
+    TRACE_END(matched, SP_MATCH);
+    if (nshard > 1) publish_waiting(all);
+}
+
+/*
+ * Put two waiting clients in a battle
+*/
+void pair_clients(Clientptr c1, Clientptr c2, long long now) {
+    for (short i = 0; i < 2; i++) {
+        Clientptr c = i ? c2:c1;
+        hist_add(&stats->queue_wait, (now - c->queued_at) * 1000);
+        c->recent[c->recentpos++ % MM_RECENT] = i ? c1->player:c2->player;
+        unqueue_client(c);
+        matchedclient = add_client(matchedclient, c);
     }
+    _start_battle(c1, c2);
 }
 
 /*
- * Prepare for and start a new battle given two matched clients
+ * Retry every waiting client, their windows widened since
 */
-void _start_battle(Clientptr c1, Clientptr c2) {
-    pid_t pid = fork();
-    if (pid != 0) {
-        if (pid < 0) { // Fatal error
-            fprintf(stderr, "%s/fork: %s\n", __func__, strerror(errno));
-            exit(1);
+void match_tick(Timer *timer) {
+    match_pass(1);
+    if (ladder.count && !matchtimer.armed) timer_arm(&matchtimer, MM_TICK, match_tick);
+}
+
+/*
+ * Find the closest rated opponent within the client's window, clearing zombies on the way
+ * Buckets are visited by distance, through the bitmap of nonempty ones
+*/
+Clientptr partner(Clientptr client, long long now) {
+    long long waited = now - client->queued_at;
+    int reach = window(client, now);
+    int home = rung(client->rating);
+    int lo = rung(client->rating - reach), hi = rung(client->rating + reach);
+    int up = busy_above(home, hi), down = busy_below(home - 1, lo);
+    while (up != -1 || down != -1) {
+        int b;
+        if (down == -1 || (up != -1 && up - home <= home - down)) {
+            b = up;
+            up = busy_above(up + 1, hi);
+        }
+        else {
+            b = down;
+            down = busy_below(down - 1, lo);
+        }
+        short n = 0;
+        for (Client *c = ladder.head[b]; c && n < MM_SCAN; c = c->rungnext, n++) {
+            if (c == client || abs(c->rating - client->rating) > reach) continue;
+            if (waited < MM_REMATCH && met(client, c)) continue;
+            if (client_connection(c)) return c;
+            unqueue_client(c); // Clear zombie client
+            remove_client(c, 1);
+            matching = 2;
+            return NULL;
         }
-        else battlelist = add_battle(battlelist, init_battle(pid, c1, c2));
-        return;
     }
-    init_battler(c1);
-    init_battler(c2);
-    battle(c1, c2); // Battle start
+    return NULL;
 }
 
 /*
- * End a battle, should only be called by SIGCHLD_handler
+ * Rating difference a waiting client accepts, widened with its wait
 */
-void _end_battle(pid_t battlepid) {
-    for (Battle *b = battlelist; b; b = b->next) { // Find ended battle
-        if (b->pid != battlepid) continue; // By pid
-        // Resume clients waiting for next battle
-        matchedclient = poll_client(matchedclient, b->c1);
-        if (client_connection(b->c1)) matchingclient = add_client(matchingclient, b->c1);
-        else remove_client(b->c1, 1);
-        matchedclient = poll_client(matchedclient, b->c2);
-        if (client_connection(b->c2)) matchingclient = add_client(matchingclient, b->c2);
-        else remove_client(b->c2, 1);
-        // Remove the battle
-        battlelist = poll_battle(battlelist, b);
-        break;
+int window(Clientptr client, long long now) {
+    return MM_WINDOW + (now - client->queued_at) / 1000 * MM_WIDEN;
+}
+
+/*
+ * Check if two clients fought each other lately
+*/
+short met(Clientptr c1, Clientptr c2) {
+    if (!c1->player || !c2->player) return 0;
+    for (short i = 0; i < MM_RECENT; i++) {
+        if (c1->recent[i] == c2->player || c2->recent[i] == c1->player) return 1;
     }
+    return 0;
 }
 
 /*
- * Initialize a battleS
+ * Put a client in the lobby, waiting for match
 */
-Battle *init_battle(pid_t pid, Clientptr client1, Clientptr client2) {
-    Battle *battle = malloc(sizeof(Battle));
-    battle->pid = pid;
-    battle->c1 = client1;
-    battle->c2 = client2;
-    return battle;
+void queue_client(Clientptr client) {
+    short b = rung(client->rating);
+    matchingclient = add_client(matchingclient, client);
+    client->queued_at = now_ms();
+    client->fresh = 1;
+    ladder.fresh++;
+    client->rungnext = NULL;
+    client->rungprev = ladder.tail[b];
+    if (ladder.tail[b]) ladder.tail[b]->rungnext = client;
+    else ladder.head[b] = client;
+    ladder.tail[b] = client;
+    ladder.busy[b / 64] |= 1ULL << (b % 64);
+    ladder.count++;
+    STAT_ADD(clients[S_LOBBY], 1);
+    if (!matchtimer.armed) timer_arm(&matchtimer, MM_TICK, match_tick);
+    timer_arm(&client->timer, IDLE_TIMEOUT, idle_timeout);
+    if (!reactor) FD_SET(client->soc, &regiset); // Watched for hang ups until matched
 }
 
 /*
- * Initialize battle stats for a client
- * Notice these stats only exist in a battle (child process)
+ * Take a client out of the lobby
 */
-void init_battler(Clientptr client) {
-    client->hp = MAX_HP;
-    client->pow = MAX_POW;
-    client->blc = MAX_BLC;
+void unqueue_client(Clientptr client) {
+    short b = rung(client->rating);
+    matchingclient = poll_client(matchingclient, client);
+    if (client->fresh) {
+        client->fresh = 0;
+        ladder.fresh--;
+    }
+    if (client->rungprev) client->rungprev->rungnext = client->rungnext;
+    else ladder.head[b] = client->rungnext;
+    if (client->rungnext) client->rungnext->rungprev = client->rungprev;
+    else ladder.tail[b] = client->rungprev;
+    if (!ladder.head[b]) ladder.busy[b / 64] &= ~(1ULL << (b % 64));
+    ladder.count--;
+    STAT_ADD(clients[S_LOBBY], -1);
+    timer_cancel(&client->timer);
+    if (!reactor) FD_CLR(client->soc, &regiset);
+    if (client->offered) { // Not for the federation anymore
+        client->offered = 0;
+        fed_send("withdraw %s\n", client->name);
+    }
 }
 
 /*
- * Hold a battle
+ * Bucket of a rating
 */
-void battle(Clientptr c1, Clientptr c2) {
-    char buf[MAX_LINE + 1]; // Buffer used throughout
-    // Opening
-    short n, max = (c1->soc > c2->soc) ? c1->soc:c2->soc;;
-    if ((n = sprintf(buf, "You engage %s!", c2->name)) < 0) fprintf(stderr, "%s/snprintf/c1: %s\n", __func__, strerror(errno));
-    write(c1->soc, buf, n + 1);
-    if ((n = sprintf(buf, "You engage %s!", c1->name)) < 0) fprintf(stderr, "%s/snprintf/c2: %s\n", __func__, strerror(errno));
-    write(c2->soc, buf, n + 1);
-    // Set of both clients (for select)
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(c1->soc, &set);
-    FD_SET(c2->soc, &set);
-    // Play turns until one client die
-    while (c1->hp > 0 && c2->hp >0) play_turn(c1, c2, buf, max, set);
-    // Evaluate battle result and settle
-    evaluate(c1, c2, buf);
-    // Bypass dynamically allocated space (malloc) handling
-    execlp("/bin/true", "true", (char *) NULL);
+short rung(int rating) {
+    if (rating < 0) return 0;
+    return (rating / MM_BUCKET < MM_BUCKETS) ? rating / MM_BUCKET:MM_BUCKETS - 1;
 }
 
 /*
- * playe a turn until 1. both clients have picked the move or 2. either clients drops
+ * First nonempty bucket in [b, hi], -1 if none
 */
-void play_turn(Clientptr c1, Clientptr c2, char buf[], short max, fd_set set) { // max: max fd
-    // Clear prior garbage
-    if (recv(c1->soc, buf, MAX_LINE + 1, MSG_DONTWAIT) > MAX_LINE) {
-        c1->hp = 0;
-        write(c1->soc, NO_SPAM, NO_SPAM_LEN);
-        return;
+int busy_above(int b, int hi) {
+    for (; b <= hi; b = (b | 63) + 1) {
+        uint64_t w = ladder.busy[b / 64] >> (b % 64);
+        if (!w) continue;
+        b += __builtin_ctzll(w);
+        return (b <= hi) ? b:-1;
     }
-    if (recv(c2->soc, buf, MAX_LINE + 1, MSG_DONTWAIT) > MAX_LINE) {
-        c2->hp = 0;
-        write(c2->soc, NO_SPAM, NO_SPAM_LEN);
-        return;
+    return -1;
+}
+
+/*
+ * Last nonempty bucket in [lo, b], -1 if none
+*/
+int busy_below(int b, int lo) {
+    for (; b >= lo; b = (b & ~63) - 1) {
+        uint64_t w = ladder.busy[b / 64] << (63 - b % 64);
+        if (!w) continue;
+        b -= __builtin_clzll(w);
+        return (b >= lo) ? b:-1;
     }
-    // Turn info
-    int n;
-    if ((n = sprintf(buf, "\r\n\r\nYour hitpoints:%d\r\nYour powermoves:%d\r\nYour block:%d\r\n\r\n%s's hitpoints: %d\r\n", c1->hp, c1->pow, c2->blc, c2->name, c2->hp))) fprintf(stderr, "%s/snprintf/c1: %s\n", __func__, strerror(errno));;
-    write(c1->soc, buf, n + 1);
-    if ((n = sprintf(buf, "\r\n\r\nYour hitpoints:%d\r\nYour powermoves:%d\r\nYour block:%d\r\n\r\n%s's hitpoints: %d\r\n", c2->hp, c2->pow, c2->blc, c1->name, c1->hp))) fprintf(stderr, "%s/snprintf/c2: %s\n", __func__, strerror(errno));;
-    write(c2->soc, buf, n + 1);
-    // Move list
-    write(c1->soc, MOV_MSG, MOV_MSG_LEN);
-    write(c2->soc, MOV_MSG, MOV_MSG_LEN);
-    // damages & moves c1/c2 perform in this turn
-    short dmg1 = -1, dmg2 = -1;
-    char mov1 = '\0', mov2 = '\0';
-    // Loop until one of two conditions meet
-    while (select(max + 1, &set, NULL, NULL, NULL) > 0) {
+    return -1;
+}
+
+/*
+ * Slot + 1 of a player in the table, added with the starting rating if new, 0 if the table is full
+ * The probe takes no lock, a new record is claimed by its slot state and found once it is written
+*/
+unsigned find_player(char *name, int *rating) {
+    uint32_t h = hash_name(name);
+    unsigned mask = store->capacity - 1;
+    *rating = ELO_START;
+    for (unsigned i = 0; i <= mask; i++) {
+        unsigned slot = (h + i) & mask;
+        Player *p = &players[slot];
+        char used = atomic_load(&p->used);
+        if (used == P_FREE && atomic_compare_exchange_strong(&p->used, &used, P_NEW)) {
+            strcpy(p->name, name);
+            p->rating = ELO_START;
+            p->wins = p->losses = p->ties = 0;
+            p->seen = time(NULL);
+            atomic_store(&p->used, P_USED);
+            pthread_mutex_lock(&playerlock);
+            store->count++;
+            rank_player(slot);
+            pthread_mutex_unlock(&playerlock);
+            return slot + 1;
+        }
+        if (used != P_USED || strcmp(p->name, name)) continue; // Someone else, or a record being written (online names are unique)
+        pthread_mutex_lock(&recordlocks[slot & (PLAYER_STRIPES - 1)]);
+        p->seen = time(NULL);
+        *rating = p->rating;
+        pthread_mutex_unlock(&recordlocks[slot & (PLAYER_STRIPES - 1)]);
+        return slot + 1;
+    }
+    return 0;
+}
+
+/*
+ * Map the player store, creating it if needed, records are used in place so startup does not read them
+ * Pages are written back by the kernel, no update waits on the disk
+*/
+void open_players(char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "%s/open: %s: %s\n", __func__, path, strerror(errno));
+        exit(1);
+    }
+    size_t size = STORE_HEAD + sizeof(Player) * MAX_PLAYERS;
+    short fresh = (st.st_size == 0);
+    if (fresh && ftruncate(fd, size) == -1) { // Sparse, records take room once used
+        fprintf(stderr, "%s/ftruncate: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    if (!fresh) { // Sized by its own head
+        Store head;
+        if (pread(fd, &head, sizeof(head), 0) != sizeof(head) || memcmp(head.magic, PLAYER_MAGIC, 8) || (head.capacity & (head.capacity - 1)) ||
+            (size = STORE_HEAD + sizeof(Player) * (size_t) head.capacity) > (size_t) st.st_size) {
+            fprintf(stderr, "%s: %s is not a player store\n", __func__, path);
+            exit(1);
+        }
+    }
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s/mmap: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    store = (Store *) map;
+    players = (Player *) (map + STORE_HEAD);
+    if (fresh) {
+        store->capacity = MAX_PLAYERS;
+        store->floor = INT_MIN;
+        memcpy(store->magic, PLAYER_MAGIC, 8); // Last, a store cut short at creation is not taken
+    }
+    else madvise(map, size, MADV_WILLNEED); // Read ahead in the background
+    for (short i = 0; i < PLAYER_STRIPES; i++) pthread_mutex_init(&recordlocks[i], NULL);
+    if (store->leaders < LEADERS && store->count > (unsigned) store->leaders) start_rescan(); // Left short by the former run
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old); // Signals are for the server's threads
+    pthread_t tid;
+    if ((errno = pthread_create(&tid, NULL, rescan_loop, NULL))) {
+        fprintf(stderr, "%s/pthread_create: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Place a player whose rating changed on the leaderboard, with the lock held
+ * Everyone off the board is rated floor or less, so the board is the exact top of the store
+*/
+void rank_player(unsigned slot) {
+    int rating = players[slot].rating, at;
+    if (rescan.on) drop_candidate(slot); // Offered again if it stays off
+    for (at = 0; at < store->leaders && store->board[at] != slot; at++);
+    if (at == store->leaders) { // Off the board
+        if (rating <= store->floor) {
+            off_board(slot);
+            return;
+        }
+        if (store->leaders == LEADER_KEEP) { // Whoever ends up last gets off
+            unsigned last = store->board[LEADER_KEEP - 1];
+            if (players[last].rating >= rating) {
+                store->floor = rating;
+                off_board(slot);
+                return;
+            }
+            if (players[last].rating > store->floor) store->floor = players[last].rating;
+            at = --store->leaders;
+            off_board(last);
+        }
+        store->leaders++;
+    }
+    else if (rating < store->floor) { // Someone off the board could be better now
+        memmove(store->board + at, store->board + at + 1, (store->leaders - at - 1) * sizeof(unsigned));
+        store->leaders--;
+        off_board(slot);
+        if (store->leaders < LEADERS && store->count > (unsigned) store->leaders && !rescan.on) start_rescan();
+        return;
+    }
+    while (at > 0 && players[store->board[at - 1]].rating < rating) { // Up
+        store->board[at] = store->board[at - 1];
+        at--;
+    }
+    while (at + 1 < store->leaders && players[store->board[at + 1]].rating > rating) { // Down
+        store->board[at] = store->board[at + 1];
+        at++;
+    }
+    store->board[at] = slot;
+}
+
+/*
+ * A player left off the board, a candidate if the rescan already went past it
+*/
+void off_board(unsigned slot) {
+    if (rescan.on && slot < rescan.at) candidate(slot);
+}
+
+/*
+ * Keep a player off the board among the best candidates of the rescan, or raise their floor
+*/
+void candidate(unsigned slot) {
+    int rating = players[slot].rating, at = rescan.n;
+    if (rating <= rescan.floor) return; // Someone left out could be better
+    if (rescan.n == LEADER_KEEP) {
+        unsigned last = rescan.slot[LEADER_KEEP - 1];
+        if (players[last].rating >= rating) {
+            rescan.floor = rating;
+            return;
+        }
+        rescan.floor = players[last].rating;
+        at = --rescan.n;
+    }
+    rescan.n++;
+    while (at > 0 && players[rescan.slot[at - 1]].rating < rating) {
+        rescan.slot[at] = rescan.slot[at - 1];
+        at--;
+    }
+    rescan.slot[at] = slot;
+}
+
+void drop_candidate(unsigned slot) {
+    for (int i = 0; i < rescan.n; i++) {
+        if (rescan.slot[i] != slot) continue;
+        memmove(rescan.slot + i, rescan.slot + i + 1, (rescan.n - i - 1) * sizeof(unsigned));
+        rescan.n--;
+        return;
+    }
+}
+
+/*
+ * Have the rescan thread refill the board, with the lock held
+*/
+void start_rescan() {
+    rescan.on = 1;
+    rescan.at = rescan.n = 0;
+    rescan.floor = INT_MIN;
+    pthread_cond_signal(&rescancond);
+}
+
+/*
+ * Look at every player off the board for the best candidates, a chunk per hold of the lock
+ * The event loops only ever wait for a chunk, they keep ranking meanwhile
+*/
+void *rescan_loop(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&playerlock);
+    while (1) {
+        while (!rescan.on) pthread_cond_wait(&rescancond, &playerlock);
+        unsigned end = (store->capacity - rescan.at > RESCAN_CHUNK) ? rescan.at + RESCAN_CHUNK:store->capacity;
+        for (; rescan.at < end; rescan.at++) {
+            Player *p = &players[rescan.at];
+            if (atomic_load(&p->used) != P_USED || p->rating > store->floor) continue; // Those above the floor are on the board
+            short on = 0;
+            for (int i = 0; i < store->leaders && p->rating == store->floor && !on; i++) on = (store->board[i] == rescan.at);
+            if (!on) candidate(rescan.at);
+        }
+        if (rescan.at == store->capacity) merge_candidates();
+        pthread_mutex_unlock(&playerlock);
+        sched_yield(); // The event loops take the lock first
+        pthread_mutex_lock(&playerlock);
+    }
+    return NULL;
+}
+
+/*
+ * Put the candidates found on the board, with the lock held
+*/
+void merge_candidates() {
+    unsigned board[LEADER_KEEP];
+    int n = 0, b = 0, c = 0;
+    int floor = rescan.floor;
+    while (b < store->leaders || c < rescan.n) { // Both best first
+        unsigned slot = (c == rescan.n || (b < store->leaders && players[store->board[b]].rating >= players[rescan.slot[c]].rating)) ? store->board[b++]:rescan.slot[c++];
+        if (n < LEADER_KEEP) board[n++] = slot;
+        else if (players[slot].rating > floor) floor = players[slot].rating;
+    }
+    memcpy(store->board, board, n * sizeof(unsigned));
+    store->leaders = n;
+    store->floor = floor;
+    rescan.on = 0;
+    if (store->leaders < LEADERS && floor != INT_MIN) start_rescan(); // Candidates that fell meanwhile left better players out
+}
+
+/*
+ * Copy the best players, return how many
+*/
+short leaders(Player top[], short max) {
+    pthread_mutex_lock(&playerlock);
+    short n = (store->leaders < max) ? store->leaders:max;
+    for (short i = 0; i < n; i++) { // Ratings and results, the rest changes under the record locks
+        Player *p = &players[store->board[i]];
+        memcpy(top[i].name, p->name, sizeof(top[i].name));
+        top[i].rating = p->rating;
+        top[i].wins = p->wins;
+        top[i].losses = p->losses;
+        top[i].ties = p->ties;
+    }
+    pthread_mutex_unlock(&playerlock);
+    return n;
+}
+
+/*
+ * Update both players' Elo rating with the battle result (0 tie, 1 c1 won, 2 c2 won)
+*/
+void rate_battle(Clientptr c1, Clientptr c2, short result) {
+    double expect = 1 / (1 + pow(10, (c2->rating - c1->rating) / 400.0)); // c1's expected score
+    double score = (result == 1) ? 1:((result == 2) ? 0:0.5);
+    int delta = lround(ELO_K * (score - expect));
+    c1->rating += delta;
+    c2->rating -= delta;
+    record_player(c1, !result ? R_TIE:((result == 1) ? R_WIN:R_LOSS));
+    record_player(c2, !result ? R_TIE:((result == 2) ? R_WIN:R_LOSS));
+}
+
+/*
+ * Store a rated client's new rating and its R_* result, unless it is unrated (not a player of this node)
+*/
+void record_player(Clientptr client, char outcome) {
+    if (!client->player) return;
+    pthread_mutex_lock(&recordlocks[(client->player - 1) & (PLAYER_STRIPES - 1)]);
+    pthread_mutex_lock(&playerlock); // The board reads ratings under its lock alone
+    Player *p = &players[client->player - 1];
+    p->rating = client->rating;
+    if (outcome == R_TIE) p->ties++;
+    else if (outcome == R_WIN) p->wins++;
+    else p->losses++;
+    p->seen = time(NULL);
+    rank_player(client->player - 1);
+    pthread_mutex_unlock(&playerlock);
+    pthread_mutex_unlock(&recordlocks[(client->player - 1) & (PLAYER_STRIPES - 1)]);
+}
+
+/*
+ * Prepare for and start a new battle given two matched clients
+*/
+void _start_battle(Clientptr c1, Clientptr c2) {
+    Msg *msg = (reactor && nshard > 1) ? slab_get(&msgslab):NULL;
+    if (msg) { // Queue it where any idle shard can steal it
+        msg->type = M_MATCH;
+        msg->c1 = c1;
+        msg->c2 = c2;
+        matchedclient = poll_client(matchedclient, c1);
+        matchedclient = poll_client(matchedclient, c2);
+        detach(c1);
+        detach(c2);
+        msg->next = outbox;
+        outbox = msg;
+        return;
+    }
+    if (reactor) { // No child, the reactor drives the battle (here if the message pool ran out)
+        open_battle(c1, c2);
+        return;
+    }
+    c1->inhead = c1->inlen = c1->inscan = 0; // A lobby line left unfinished is not a move nor a speech
+    c2->inhead = c2->inlen = c2->inscan = 0;
+    if (nworker && pool_battle(c1, c2)) return; // Forked as usual if no worker took it
+    Battle *b = init_battle(0, c1, c2); // Before the fork, the child leaves the chat buckets under its handle
+    Bucket *left = chatback[slab_handle(&battleslab, b)];
+    left[0] = c1->chat; // Taken back as they are if the child dies first
+    left[1] = c2->chat;
+    TRACE_BEGIN(forked);
+    pid_t pid = fork();
+    if (pid != 0) {
+        TRACE_END(forked, SP_FORK);
+        if (pid < 0) { // Fatal error
+            fprintf(stderr, "%s/fork: %s\n", __func__, strerror(errno));
+            exit(1);
+        }
+        else {
+            b->pid = pid;
+            battlelist = add_battle(battlelist, b);
+            STAT_ADD(battles, 1);
+            STAT_ADD(clients[S_BATTLE], 2);
+            pidtab[pid] = slab_handle(&battleslab, b) + 1;
+        }
+        return;
+    }
+#ifdef TRACE
+    trace_thread(0); // Spans of the battle go under its own pid
+#endif
+    chatleft = left;
+    init_battler(c1);
+    init_battler(c2);
+    battle(c1, c2); // Battle start
+}
+
+/*
+ * End a battle, should only be called by SIGCHLD_handler
+*/
+void _end_battle(pid_t battlepid, int status) {
+    if (battlepid >= maxpid || !pidtab[battlepid]) return; // Not a battle
+    Battle *b = slab_at(&battleslab, pidtab[battlepid] - 1); // Find ended battle by pid
+    b->c1->chat = chatback[pidtab[battlepid] - 1][0];
+    b->c2->chat = chatback[pidtab[battlepid] - 1][1];
+    pidtab[battlepid] = 0;
+    finish_battle(b, WIFEXITED(status) ? WEXITSTATUS(status):-1); // The battle exits with its result and who dropped
+}
+
+/*
+ * Rate a battle of a child or worker from its outcome (result | GONE_* bits, -1 if it died) and resume its battlers
+*/
+void finish_battle(Battle *b, short outcome) {
+    short result = (outcome >= 0) ? outcome & 3:-1;
+    if (outcome >= 0) {
+        if (!handing) rate_battle(b->c1, b->c2, result);
+        b->c1->gone = (outcome & GONE_C1) != 0;
+        b->c2->gone = (outcome & GONE_C2) != 0;
+    }
+    // Resume clients waiting for next battle
+    _resume_client(b->c1);
+    _resume_client(b->c2);
+    if (handing) hand_over(b->c1, b->c2, result); // Rated by the successor
+    // Remove the battle
+    battlelist = poll_battle(battlelist, b);
+    STAT_ADD(battles, -1);
+    STAT_ADD(clients[S_BATTLE], -2);
+    slab_put(&battleslab, b);
+}
+
+/*
+ * Move a client out of an ended battle, back to matching if still connected
+*/
+void _resume_client(Clientptr client) {
+    matchedclient = poll_client(matchedclient, client);
+    client->battle = NULL;
+    if (client->relay) { // Hung up once the rest is sent, the relaying node takes its player back
+        client->state = C_FED;
+        timer_arm(&client->timer, FED_WAIT, fed_timeout);
+        mark_dirty(client);
+        return;
+    }
+    if (atomic_load_explicit(&handing, memory_order_relaxed)) return; // The caller hands it over
+    if (client_connection(client)) {
+        client->state = C_LOBBY;
+        queue_client(client);
+    }
+    else remove_client(client, 1);
+}
+
+/*
+ * Initialize a battleS
+*/
+Battle *init_battle(pid_t pid, Clientptr client1, Clientptr client2) {
+    Battle *battle = slab_get(&battleslab); // Never exhausted, every battle holds two clients
+    battle->pid = pid;
+    battle->c1 = client1;
+    battle->c2 = client2;
+    battle->timer.armed = 0;
+    atomic_store_explicit(&battle->id, 0, memory_order_relaxed);
+    atomic_store_explicit(&battle->watching, 0, memory_order_relaxed);
+    battle->watchers = NULL;
+    return battle;
+}
+
+/*
+ * Initialize battle stats for a client
+ * Notice these stats only exist in a battle (child process)
+*/
+void init_battler(Clientptr client) {
+    client->hp = MAX_HP;
+    client->pow = MAX_POW;
+    client->blc = MAX_BLC;
+    client->missed = 0;
+    client->speaking = 0;
+    for (short i = 0; i < 4; i++) client->shown[i] = -1; // All of it in the first turn frame
+}
+
+/*
+ * Hold a battle
+*/
+void battle(Clientptr c1, Clientptr c2) {
+    char buf[MAX_LINE + 1]; // Buffer used throughout
+    // Opening
+    short max = (c1->soc > c2->soc) ? c1->soc:c2->soc;;
+    engage(c1, c2, buf);
+    // Set of both clients (for select)
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(c1->soc, &set);
+    FD_SET(c2->soc, &set);
+    // Play turns until one client die
+    while (c1->hp > 0 && c2->hp >0) play_turn(c1, c2, buf, max, set);
+    // Evaluate battle result and settle, the server rates it from the exit status
+    // Bypass dynamically allocated space (malloc) handling
+    TRACE_BEGIN(settled);
+    short result = evaluate(c1, c2, buf);
+    TRACE_END(settled, SP_SETTLE);
+    chatleft[0] = c1->chat; // The rate limit goes on in the lobby
+    chatleft[1] = c2->chat;
+    _exit(result | (c1->gone ? GONE_C1:0) | (c2->gone ? GONE_C2:0));
+}
+
+/*
+ * playe a turn until 1. both clients have picked the move or 2. either clients drops
+*/
+void play_turn(Clientptr c1, Clientptr c2, char buf[], short max, fd_set set) { // max: max fd
+    // Clear prior garbage
+    if (clear_garbage(c1, buf) || clear_garbage(c2, buf)) return;
+    short late = 0;
+    // Turn info
+    int n;
+    TRACE_BEGIN(shown);
+    turn_info(c1, c2, buf);
+    turn_info(c2, c1, buf);
+    TRACE_END(shown, SP_TURN_INFO);
+    // moves c1/c2 perform in this turn
+    char mov1 = '\0', mov2 = '\0';
+    // Loop until one of two conditions meet, or the move deadline (Linux select() counts it down)
+    int ready;
+    struct timeval left = {.tv_sec = MOVE_TIMEOUT / 1000, .tv_usec = MOVE_TIMEOUT % 1000 * 1000};
+    while (1) {
+        TRACE_BEGIN(waited);
+        ready = select(max + 1, &set, NULL, NULL, &left);
+        TRACE_END(waited, SP_WAIT);
+        if (ready == -1 && errno == EINTR) continue; // A signal meant for the server, the sets and the time left are kept
+        if (ready == -1) { // The turn is played again, not resolved with moves nobody made
+            fprintf(stderr, "%s/select: %s\n", __func__, strerror(errno));
+            return;
+        }
+        if (!ready) break;
+        woke_us = now_us();
         if (!mov1) { // c1 has not picked a move
             if (FD_ISSET(c1->soc, &set)) { // c1 sent something
                 n = read(c1->soc, buf, 1); // Read one char
-                if (n == 0) { // c1 disconnected
+                if (n > 0) STAT_ADD(bytes_in, n);
+                if (n == 0 || (n == -1 && (errno == ECONNRESET || errno == ETIMEDOUT))) { // c1 disconnected
                     c1->hp = 0;
+                    c1->gone = 1;
                     return;
                 }
                 if (n == -1) { // Error
                     fprintf(stderr, "%s/read: %s\n", __func__, strerror(errno));
                     buf[0] = 'a';
                 }
-                mov1 = move(c1, buf[0]); // Parse c1 move
-                if (mov1) { // A legal move
+                if (c1->speaking) speech_char(c1, c2, buf[0]); // A byte of a speech, c2 plays on meanwhile
+                else if ((mov1 = move(c1, buf[0]))) { // Parse c1 move, a legal one
+                    c1->missed = 0;
                     if (mov1 != 's') { // A battle move, no speaking from c1 anymore
                         FD_CLR(c1->soc, &set);
                         // notify c2 that c1 moved
                         if ((n = sprintf(buf, "\r\n%s has made a choice\r\n", c1->name)) < 0) fprintf(stderr, "%s/snprintf/c1: %s\n", __func__, strerror(errno));
-                        write(c2->soc, buf, n + 1);
-                        // Calculate Damage
-                        if (dmg1 < 0) dmg1 = dmg(mov1); // damage is not blocked
-                        if (mov1 == 'b') dmg2 = 0; // block c2 damage
+                        send_client(c2, buf, n + 1);
                         if (mov2) break; // Both clients moved
                         else max = c2->soc; // Wait for c2
                     }
-                    else if (!speak(buf, c1, c2)) { // c1 disconnects during speaking
-                        c1->hp = 0;
-                        return;
+                    else { // Not a battle move
+                        open_speech(c1);
+                        mov1 = '\0';
                     }
-                    else mov1 = '\0'; // Unintelligible move
                 }
             }
             else FD_SET(c1->soc, &set); // Resume listening c1
@@ -407,94 +2188,186 @@ void play_turn(Clientptr c1, Clientptr c2, char buf[], short max, fd_set set) {
         if (!mov2) { // c2 has not picked a move
             if (FD_ISSET(c2->soc, &set)) { // c2 sent something
                 n = read(c2->soc, buf, 1); // Read one char
-                if (n == 0) { // c2 disconnected
+                if (n > 0) STAT_ADD(bytes_in, n);
+                if (n == 0 || (n == -1 && (errno == ECONNRESET || errno == ETIMEDOUT))) { // c2 disconnected
                     c2->hp = 0;
+                    c2->gone = 1;
                     return;
                 }
                 if (n == -1) { // Error
                     fprintf(stderr, "%s/read: %s\n", __func__, strerror(errno));
                     buf[0] = 'a';
                 }
-                mov2 = move(c2, buf[0]); // Parse c2 move
-                if (mov2) { // A legal move
+                if (c2->speaking) speech_char(c2, c1, buf[0]); // A byte of a speech, c1 plays on meanwhile
+                else if ((mov2 = move(c2, buf[0]))) { // Parse c2 move, a legal one
+                    c2->missed = 0;
                     if (mov2 != 's') { // A battle move, no speaking from c2 anymore
                         FD_CLR(c2->soc, &set);
                         // notify c1 that c2 moved
                         if ((n = sprintf(buf, "\r\n%s has made a choice\r\n", c2->name)) < 0) fprintf(stderr, "%s/snprintf/c2: %s\n", __func__, strerror(errno));;
-                        write(c1->soc, buf, n + 1);
-                        // Calculate Damage
-                        if (dmg2 < 0) dmg2 = dmg(mov2); // damage is not blocked
-                        if (mov2 == 'b') dmg1 = 0; // block c1 damage
+                        send_client(c1, buf, n + 1);
                         if (mov1) break; // Both clients moved
                         else max = c1->soc; // Wait for c1
                     }
-                    else if (!speak(buf, c2, c1)) { // c2 disconnects during speaking
-                        c2->hp = 0;
-                        return;
+                    else { // Not a battle move
+                        open_speech(c2);
+                        mov2 = '\0';
                     }
-                    else mov2 = '\0'; // Unintelligible move
                 }
             }
             else FD_SET(c2->soc, &set); // Resume listening c2
         }
     }
+    if (!ready) { // Out of time, the late ones attack, or forfeit after missing too many turns
+        if (!mov1 && ++c1->missed >= MOVE_MISSES) c1->hp = 0;
+        if (!mov2 && ++c2->missed >= MOVE_MISSES) c2->hp = 0;
+        if (c1->hp < 1 || c2->hp < 1) return;
+        woke_us = now_us();
+        c1->speaking = c2->speaking = c1->inlen = c2->inlen = 0; // Speeches not done are cut
+        late = (!mov1 ? J_LATE_C1:0) | (!mov2 ? J_LATE_C2:0);
+        if (!mov1) {
+            tell(c1, TIME_MSG, TIME_MSG_LEN, F_NOTICE, &(char) {N_TIME}, 1);
+            mov1 = 'a';
+        }
+        if (!mov2) {
+            tell(c2, TIME_MSG, TIME_MSG_LEN, F_NOTICE, &(char) {N_TIME}, 1);
+            mov2 = 'a';
+        }
+    }
     // Evaluate damgages
-    c1->hp -= dmg2;
-    c2->hp -= dmg1;
+    TRACE_BEGIN(resolved);
+    rule_turn(&c1->hp, &c2->hp, mov1, mov2);
+    journal_turn(c1, c2, mov1, mov2, late);
+    TRACE_END(resolved, SP_RESOLVE);
+    hist_add(&stats->turn, now_us() - woke_us);
 }
 
 /*
- * Return a client move in char, or NULL if the client inputted move is unintelligible 
+ * Announce the opponents to each other at the start of a battle
 */
-char move(Clientptr client, char mov) {
-    if (mov == 'a' || mov == 's') return mov; // Attack/Speak
-    if (mov == 'p') { // Power move
-        if (client->pow < 1) return '\0'; // Not pp left
-        client->pow -= 1; // Deduct pp
-        return mov;
+void engage(Clientptr c1, Clientptr c2, char buf[]) {
+    short n;
+    c1->side = 0;
+    c2->side = 1;
+    c1->battleid = c2->battleid = journal ? journal_id():atomic_fetch_add_explicit(&nextbattle, 1, memory_order_relaxed);
+    journal_start(c1, c2);
+    if ((n = sprintf(buf, "You engage %s!", c2->name)) < 0) fprintf(stderr, "%s/snprintf/c1: %s\n", __func__, strerror(errno));
+    tell(c1, buf, n + 1, F_ENGAGE, c2->name, strlen(c2->name));
+    if ((n = sprintf(buf, "You engage %s!", c1->name)) < 0) fprintf(stderr, "%s/snprintf/c2: %s\n", __func__, strerror(errno));
+    tell(c2, buf, n + 1, F_ENGAGE, c1->name, strlen(c1->name));
+}
+
+/*
+ * Send a battler its turn info and the move list
+*/
+void turn_info(Clientptr client, Clientptr opponent, char buf[]) {
+    int n;
+    if (client->binary) { // Only what changed
+        short now[4] = {client->hp, client->pow, client->blc, opponent->hp};
+        char delta[5] = {0};
+        n = 1;
+        for (short i = 0; i < 4; i++) {
+            if (now[i] == client->shown[i]) continue;
+            delta[0] |= 1 << i;
+            delta[n++] = now[i];
+            client->shown[i] = now[i];
+        }
+        send_client(client, buf, frame(buf, F_TURN, delta, n));
+        return;
+    }
+    if ((n = sprintf(buf, "\r\n\r\nYour hitpoints:%d\r\nYour powermoves:%d\r\nYour block:%d\r\n\r\n%s's hitpoints: %d\r\n", client->hp, client->pow, client->blc, opponent->name, opponent->hp)) < 0) fprintf(stderr, "%s/snprintf: %s\n", __func__, strerror(errno));
+    send_client(client, buf, n + 1);
+    send_client(client, MOV_MSG, MOV_MSG_LEN);
+}
+
+/*
+ * Clear input sent before the turn, return 1 if the client spammed (and lost)
+ * The reactor keeps typed ahead moves and only clears spam
+*/
+int clear_garbage(Clientptr client, char buf[]) {
+    if (reactor) {
+        fill_input(client);
+        if (client->inlen <= MAX_LINE) return 0;
+        client->inhead = client->inlen = client->inscan = 0;
     }
-    if (mov == 'b') {
-        if (client->blc < 1) return '\0'; // No bp left
-        client->blc -= 1; // Decuct bp
-        return mov;
+    else {
+        int n = recv(client->soc, buf, MAX_LINE + 1, MSG_DONTWAIT);
+        if (n > 0) STAT_ADD(bytes_in, n);
+        if (n <= MAX_LINE) return 0;
     }
-    return '\0'; // Unintelligible move
+    STAT_ADD(spam, 1);
+    journal_spam(client);
+    client->hp = 0;
+    tell(client, NO_SPAM, NO_SPAM_LEN, F_NOTICE, &(char) {N_SPAM}, 1);
+    return 1;
 }
 
 /*
- * Return the damage of a move
+ * Return a client move in char, or NULL if the client inputted move is unintelligible 
 */
-short dmg(char c) {
-    if (c == 'a') return A_DMG;
-    if (c == 'p') return P_DMG;
-    if (c == 'b') return B_DMG;
-    return 0;
+char move(Clientptr client, char mov) {
+    return rule_move(&client->pow, &client->blc, mov);
+}
+
+/*
+ * Let a battler type a speech, the battle goes on meanwhile
+*/
+void open_speech(Clientptr client) {
+    client->speaking = 1;
+    tell(client, SPEAK, sizeof(SPEAK), F_SPEAK, &(char) {0}, 1);
+}
+
+/*
+ * Add a byte to a speech being typed (forking server), say it once the line is complete
+*/
+void speech_char(Clientptr speaker, Clientptr listener, char c) {
+    speaker->in[speaker->inlen++] = c;
+    if (c != '\n' && speaker->inlen <= MAX_LINE) return;
+    say(speaker, listener, speaker->in, speaker->inlen);
+    speaker->inlen = 0;
+}
+
+/*
+ * Pass a finished speech on to the listener and spectators, unless the speaker is over its chat rate
+*/
+void say(Clientptr speaker, Clientptr listener, char line[], short n) {
+    char buf[MAX_NAME + 40];
+    short len = n, i;
+    speaker->speaking = 0;
+    if (!chat_token(speaker)) return;
+    TRACE_BEGIN(said);
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--; // Frames carry no line end
+    journal_chat(speaker, line, n);
+    if ((i = sprintf(buf, "\r\n%s takes a break to tell you:\r\n", speaker->name)) < 0) fprintf(stderr, "%s/snprintf: %s\n", __func__, strerror(errno));
+    tell(listener, buf, i + 1, F_SPEAK, &(char) {1}, 1);
+    tell(listener, line, n, F_CHAT, line, len);
+    if (speaker->battle) watch_chat(speaker->battle, speaker, line, len);
+    TRACE_END(said, SP_SPEAK);
 }
 
 /*
- * One client speak to the other, neither clients perform any action during the speach
+ * Take a line from a client's chat bucket, 0 (and a notice) if it said too much lately
 */
-int speak(char buf[], Clientptr speaker, Clientptr listener) {
-    short i;
-    if ((i = sprintf(buf, SPEAK)) < 0) fprintf(stderr, "%s/snprintf/speaker: %s\n", __func__, strerror(errno));
-    write(speaker->soc, buf, i + 1);
-    if ((i = sprintf(buf, "\r\n%s takes a break to tell you:\r\n", speaker->name)) < 0) fprintf(stderr, "%s/snprintf/listener: %s\n", __func__, strerror(errno));;
-    write(listener->soc, buf, i + 1);
-    for (i = 0; i <= MAX_LINE; i++) {
-        if (read(speaker->soc, buf + i, 1) == 0) return 0;
-        if (buf[i] == '\n') break;
+short chat_token(Clientptr client) {
+    if (take_token(&client->chat, CHAT_RATE, CHAT_BURST, now_ms())) {
+        STAT_ADD(chat[0], 1);
+        return 1;
     }
-    write(listener->soc, buf, i + 1);
-    return 1;
+    STAT_ADD(chat[1], 1);
+    tell(client, HUSH_MSG, HUSH_MSG_LEN, F_NOTICE, &(char) {N_HUSH}, 1);
+    return 0;
 }
 
 /*
- * Evaluate the battle result and settle
+ * Evaluate the battle result and settle, return 0 for a tie or the winner (1 for c1, 2 for c2)
 */
-void evaluate(Clientptr c1, Clientptr c2, char buf[]) {
-    if (c1->hp < 1 && c2->hp < 1) settle(c1, c2, 1, buf); // Tie
-    else if (c1->hp < 1) settle(c2, c1, 0, buf); // c2 win
+short evaluate(Clientptr c1, Clientptr c2, char buf[]) {
+    short result = rule_outcome(c1->hp, c2->hp);
+    journal_end(c1, c2, result);
+    if (!result) settle(c1, c2, 1, buf); // Tie
+    else if (result == 2) settle(c2, c1, 0, buf); // c2 win
     else settle(c1, c2, 0, buf); // c1 win
+    return result;
 }
 
 /*
@@ -502,57 +2375,114 @@ void evaluate(Clientptr c1, Clientptr c2, char buf[]) {
 */
 void settle(Clientptr winner, Clientptr loser, short tie, char buf[]) {
     if (tie) { // Tie
-        write(winner->soc, TIE_MSG, TIE_MSG_LEN);
-        write(loser->soc, TIE_MSG, TIE_MSG_LEN);
-        write(winner->soc, WAIT_MSG, WAIT_MSG_LEN);
-        write(loser->soc, WAIT_MSG, WAIT_MSG_LEN);
+        tell(winner, TIE_MSG, TIE_MSG_LEN, F_RESULT, &(char) {R_TIE}, 1);
+        tell(loser, TIE_MSG, TIE_MSG_LEN, F_RESULT, &(char) {R_TIE}, 1);
+        tell(winner, WAIT_MSG, WAIT_MSG_LEN, F_WAIT, NULL, 0);
+        tell(loser, WAIT_MSG, WAIT_MSG_LEN, F_WAIT, NULL, 0);
         return;
     }
     // Notify battle victory/defeat
     short n;
+    char won = R_DROP;
     if (!client_connection(loser)) {
         if ((n = sprintf(buf, "\r\n--%s dropped. You win!\r\n\r\n", loser->name)) < 0) fprintf(stderr, "%s/snprintf/drop: %s\n", __func__, strerror(errno));
     }
     else {
         if ((n = sprintf(buf, "\r\nYou are no match for %s...You scurry away...\r\n\r\n", winner->name)) < 0) fprintf(stderr, "%s/snprintf/loser: %s\n", __func__, strerror(errno));;
-        write(loser->soc, buf, n + 1);
-        write(loser->soc, WAIT_MSG, WAIT_MSG_LEN);
+        tell(loser, buf, n + 1, F_RESULT, &(char) {R_LOSS}, 1);
+        tell(loser, WAIT_MSG, WAIT_MSG_LEN, F_WAIT, NULL, 0);
         if ((n = sprintf(buf, "\r\n%s gives up. You win!\r\n\r\n", loser->name)) < 0) fprintf(stderr, "%s/snprintf/winner: %s\n", __func__, strerror(errno));;
+        won = R_WIN;
     }
     if (!client_connection(winner)) return;
-    write(winner->soc, buf, n + 1);
-    write(winner->soc, WAIT_MSG, WAIT_MSG_LEN);
+    tell(winner, buf, n + 1, F_RESULT, &won, 1);
+    tell(winner, WAIT_MSG, WAIT_MSG_LEN, F_WAIT, NULL, 0);
 }
 
 /*
  * Notify everyone somethign 
 */
-void notify_all(char *msg, int msglen) {
-    for (Clientptr c = registerlist; c; c = c->next) write(c->soc, msg, msglen);
-    for (Clientptr c = matchedclient; c; c = c->next) write(c->soc, msg, msglen);
-    for (Clientptr c = matchingclient; c; c = c->next) write(c->soc, msg, msglen);
+void notify_all(char *msg, int msglen, char *bin, int binlen, short lobby) {
+    if (!reactor) {
+        notify_local(msg, msglen, lobby);
+        return;
+    }
+    // Rendered once (and framed once), every queue (on every shard) holds a reference to the same chunk
+    Outbuf *buf = slab_get(&chunkslab), *framed = bin ? slab_get(&chunkslab):NULL;
+    if (!buf) {
+        if (framed) slab_put(&chunkslab, framed);
+        return;
+    }
+    Outbuf *chunks[2] = {buf, framed};
+    char *data[2] = {msg, bin};
+    int lens[2] = {msglen, binlen};
+    for (short i = 0; i < 2 && chunks[i]; i++) {
+        chunks[i]->shared = 1;
+        chunks[i]->len = (lens[i] < OUT_CHUNK) ? lens[i]:OUT_CHUNK;
+        memcpy(chunks[i]->data, data[i], chunks[i]->len);
+        atomic_init(&chunks[i]->refs, nshard);
+    }
+    for (short i = 0; i < nshard; i++) {
+        if (&shards[i] == shard) continue;
+        Msg *m = slab_get(&msgslab);
+        if (!m) { // Pool empty, that shard misses it
+            release_chunk(buf);
+            if (framed) release_chunk(framed);
+            continue;
+        }
+        m->type = M_BCAST;
+        m->buf = buf;
+        m->bin = framed;
+        m->lobby = lobby;
+        post(&shards[i], m);
+    }
+    fan_out(buf, framed, lobby);
+    release_chunk(buf);
+    if (framed) release_chunk(framed);
+}
+
+/*
+ * Notify everyone of this shard (or process) something
+*/
+void notify_local(char *msg, int msglen, short lobby) {
+    TRACE_BEGIN(told);
+    for (Clientptr c = lobby ? NULL:registerlist; c; c = c->next) send_client(c, msg, msglen);
+    for (Clientptr c = lobby ? NULL:matchedclient; c; c = c->next) send_client(c, msg, msglen);
+    for (Clientptr c = matchingclient; c; c = c->next) send_client(c, msg, msglen);
+    TRACE_END(told, SP_BROADCAST);
 }
 
 /*
- * Check if a client is still connected
+ * Check if a client is still connected, as last seen by the event loop (or the battle)
 */
 int client_connection(Clientptr client) {
-    if (recv(client->soc, &e, 1, MSG_NOSIGNAL | MSG_PEEK | MSG_DONTWAIT)) return 1;
-    if (close(client->soc) == -1) fprintf(stderr, "%s/close: %s\n", __func__, strerror(errno));
-    return 0;
+    return !client->gone;
 }
 
 /*
  * Permenantly clear a (disconnected) client
 */
 void remove_client(Clientptr client, int notify) {
-    close(client->soc);
-    if (notify) { // Notify everyone
+    timer_cancel(&client->timer);
+    release_name(client); // Free for whoever comes next
+    if (!reactor) close(client->soc);
+    if (notify && reactor) announce(&leaving, client->name); // Merged with other departures
+    else if (notify) { // Notify everyone
         char msg[MAX_NAME + 14];
-        if (sprintf(msg, "**%s leaves**\r\n", client->name) < 0) fprintf(stderr, "%s/snprintf: %s\n", __func__, strerror(errno));
-        notify_all(msg, sizeof(msg));
+        int n;
+        if ((n = sprintf(msg, "**%s leaves**\r\n", client->name)) < 0) fprintf(stderr, "%s/snprintf: %s\n", __func__, strerror(errno));
+        notify_all(msg, n + 1, NULL, 0, 0); // Not the rest of the buffer
+    }
+    if (!reactor) {
+        fdtab[client->soc] = NULL;
+        leave_peer(client->peer);
+        slab_put(&clientslab, client);
+        return;
     }
-    free(client);
+    // Events for the client may still be pending in this reactor iteration, closed by bury()
+    drop_output(client);
+    client->state = C_DEAD;
+    deadclient = add_client(deadclient, client);
 }
 
 /*
@@ -573,11 +2503,10 @@ Clientptr poll_client(Clientptr list, Clientptr client) {
 }
 
 /*
- * Permenantly clear an (ended) battle
+ * Retrieve and remove a battle from a list
 */
 Battle *poll_battle(Battle *list, Battle *battle) {
     Battle *next = battle->next, *prev = battle->prev;
-    free(battle);
     if (next) next->prev = prev;
     if (prev) prev->next = next;
     else return next;
@@ -589,8 +2518,3054 @@ Battle *poll_battle(Battle *list, Battle *battle) {
 */
 void sigchld_handler(int sig) {
     pid_t pid;
-    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) { // A battle just finished
-        _end_battle(pid); // End the battle
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) { // A battle just finished
+        TRACE_BEGIN(reaped);
+        _end_battle(pid, status); // End the battle
+        TRACE_END(reaped, SP_REAP);
         _match(); // An ended battle implies a new match
     }
 }
+
+/*
+ * Run every socket and battle on edge-triggered epoll reactors, one per thread
+*/
+void run_reactor(short threads) {
+    nshard = threads;
+    while (spread && nlisten < nshard && nlisten < MAX_LISTENERS) { // A predecessor may have handed over fewer
+        int soc = open_listener();
+        if (soc == -1) break;
+        listeners[nlisten++] = soc;
+    }
+    for (short j = 0; j < nlisten; j++) {
+        if (fcntl(listeners[j], F_SETFL, O_NONBLOCK) == -1) fprintf(stderr, "%s/fcntl: %s\n", __func__, strerror(errno));
+    }
+    if (!(shards = aligned_alloc(64, sizeof(Shard) * nshard))) {
+        fprintf(stderr, "%s/aligned_alloc: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    for (short i = 0; i < nshard; i++) {
+        Shard *s = &shards[i];
+        s->id = i;
+        atomic_init(&s->idle, 0);
+        atomic_init(&s->inbox, NULL);
+        atomic_init(&s->head, 0);
+        atomic_init(&s->tail, 0);
+        atomic_init(&s->rematch, 0);
+        for (short w = 0; w < (MM_BUCKETS + 63) / 64; w++) atomic_init(&s->waiting[w], 0);
+        for (size_t j = 0; j < MATCH_RING; j++) atomic_init(&s->ring[j].seq, j);
+        if ((s->epfd = epoll_create1(0)) == -1 || (s->evfd = eventfd(0, EFD_NONBLOCK)) == -1) {
+            fprintf(stderr, "%s/epoll_create1: %s\n", __func__, strerror(errno));
+            exit(1);
+        }
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.fd = s->evfd};
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->evfd, &ev) == -1) fprintf(stderr, "%s/epoll_ctl/eventfd: %s\n", __func__, strerror(errno));
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = handoff_soc}; // The predecessor's clients land on shard 0
+    if (handoff_soc != -1 && epoll_ctl(shards[0].epfd, EPOLL_CTL_ADD, handoff_soc, &ev) == -1) fprintf(stderr, "%s/epoll_ctl/handoff: %s\n", __func__, strerror(errno));
+    ev.data.fd = fedsoc; // So does the coordinator
+    if (fedsoc != -1 && epoll_ctl(shards[0].epfd, EPOLL_CTL_ADD, fedsoc, &ev) == -1) fprintf(stderr, "%s/epoll_ctl/coordinator: %s\n", __func__, strerror(errno));
+    accepting(1);
+    for (short i = 1; i < nshard; i++) {
+        if ((errno = pthread_create(&shards[i].tid, NULL, shard_loop, &shards[i]))) {
+            fprintf(stderr, "%s/pthread_create: %s\n", __func__, strerror(errno));
+            exit(1);
+        }
+    }
+    shards[0].tid = pthread_self();
+    shard_loop(&shards[0]);
+}
+
+/*
+ * Event loop of a shard
+*/
+void *shard_loop(void *arg) {
+    shard = arg;
+    epfd = shard->epfd;
+    stats = &statslots[shard->id % STAT_SLOTS];
+#ifdef TRACE
+    trace_thread(shard->id);
+#endif
+    wheel_init();
+    struct epoll_event evs[MAX_EVENTS];
+    while (1) {
+        // Matches queued last iteration are left for idle shards to steal until the next one
+        short pending = atomic_load(&shard->head) != atomic_load(&shard->tail);
+        atomic_store(&shard->idle, !battlelist && !pending);
+        TRACE_BEGIN(waited);
+        int n = epoll_wait(epfd, evs, MAX_EVENTS, pending ? 0:wheel_timeout());
+        TRACE_END(waited, SP_WAIT);
+        atomic_store(&shard->idle, 0);
+        woke_us = now_us();
+        if (restart && !shard->id) restart_server();
+        TRACE_DUMP();
+        if (n == -1) {
+            if (errno != EINTR) fprintf(stderr, "%s/epoll_wait: %s\n", __func__, strerror(errno));
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = evs[i].data.fd;
+            if (fd < 0) accept_clients(LISTEN_TAG(fd));
+            else if (fd == shard->evfd) take_inbox();
+            else if (!shard->id && fd == handoff_soc) take_handoff();
+            else if (!shard->id && fd == fedsoc) fed_read();
+            else {
+                Clientptr c = fdtab[fd]; // Sockets are only closed by bury(), it is still ours
+                if (c->state == C_DEAD || c->state == C_MOVING) continue;
+                if (evs[i].events & EPOLLOUT) mark_dirty(c); // Writable again
+                if (evs[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) c->hup = c->gone = 1;
+                if (evs[i].events & EPOLLIN || c->hup) client_input(c);
+            }
+        }
+        if (atomic_load_explicit(&shard->rematch, memory_order_relaxed) && atomic_exchange(&shard->rematch, 0)) match_pass(1); // Offer ours to a lower shard
+        take_matches();
+        wheel_run();
+        TRACE_BEGIN(flushed);
+        flush_dirty(); // Before leaving clients are shipped to other shards
+        TRACE_END(flushed, SP_FLUSH);
+        ship();
+        bury();
+    }
+    return NULL;
+}
+
+/*
+ * Accept a batch of pending connections, the listening socket is level triggered
+*/
+void accept_clients(int listen_soc) {
+    if (atomic_load_explicit(&handing, memory_order_relaxed)) return; // Left to the successor
+    TRACE_BEGIN(accepted);
+    for (short i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int new_soc = accept4(listen_soc, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_soc == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) fprintf(stderr, "%s/accept4: %s\n", __func__, strerror(errno));
+            break;
+        }
+        Clientptr client = admit(new_soc, &addr);
+        if (!client) continue; // Shed
+        keep_alive(new_soc);
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = new_soc};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_soc, &ev) == -1) {
+            fprintf(stderr, "%s/epoll_ctl: %s\n", __func__, strerror(errno));
+            fdtab[new_soc] = NULL;
+            close(new_soc);
+            leave_peer(client->peer);
+            slab_put(&clientslab, client);
+            continue;
+        }
+        registerlist = add_client(registerlist, client);
+        STAT_ADD(accepts, 1);
+        STAT_ADD(clients[S_REGISTER], 1);
+        client->hello = 1; // Until its first bytes settle the protocol
+        timer_arm(&client->timer, REGISTER_TIMEOUT, register_timeout);
+        send_client(client, NAME_MSG, NAME_MSG_LEN);
+    }
+    TRACE_END(accepted, SP_ACCEPT);
+}
+
+/*
+ * Take a registering client's name once it has been sent
+*/
+void register_client(Clientptr client) {
+    if (atomic_load_explicit(&handing, memory_order_relaxed)) return; // Input kept for the successor
+    if (client->hello && !negotiate(client)) return;
+    if (client->relay) {
+        relay_guest(client);
+        return;
+    }
+    short n, len;
+    while (1) {
+        n = take_line(client, client->name, MAX_NAME);
+        if (!n && !client->eof) return; // Haven't finished the name yet
+        for (len = n; len && (client->name[len - 1] == '\n' || client->name[len - 1] == '\r'); len--); // Telnet sends \r\n
+        client->name[len] = '\0';
+        if (!n || claim_name(client)) break;
+        name_taken(client); // Someone online goes by it
+    }
+    registerlist = poll_client(registerlist, client);
+    STAT_ADD(clients[S_REGISTER], -1);
+    if (!n) { // Got nothing, indicating disconnected client (or error)
+        remove_client(client, 0);
+        return;
+    }
+    client->hp = len; // Name length, like getname()
+    client->state = C_LOBBY;
+    welcome_client(client);
+    if (client->inlen) lobby_input(client); // Typed ahead, a watch must come before matching
+    _match(); // Registered client inidcating potential match
+}
+
+/*
+ * Settle the protocol of a new client from its first bytes, return 0 while they could still be HELLO
+*/
+short negotiate(Clientptr client) {
+    short i, j = 0;
+    if (client->eof) return 1; // Gone, registration drops it
+    for (i = 0; i < client->inlen && i < HELLO_LEN; i++) if (client->in[(client->inhead + i) & (IN_RING - 1)] != HELLO[i]) break;
+    while (fedsoc != -1 && j < client->inlen && j < HELLO_LEN && client->in[(client->inhead + j) & (IN_RING - 1)] == FED_HELLO[j]) j++;
+    if (i < client->inlen && i < HELLO_LEN && j < client->inlen && j < HELLO_LEN) client->hello = 0; // A text client, prompted already
+    else if (i < HELLO_LEN && j < HELLO_LEN) return 0;
+    else {
+        client->inhead = (client->inhead + HELLO_LEN) & (IN_RING - 1);
+        client->inlen -= HELLO_LEN;
+        if (i == HELLO_LEN) greet(client);
+        else { // Another node relaying one of its players, no prompt
+            client->hello = 0;
+            client->relay = RL_GUEST;
+            timer_arm(&client->timer, REGISTER_TIMEOUT, register_timeout);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Switch a new client that sent HELLO to the binary protocol and prompt it again in frames
+*/
+void greet(Clientptr client) {
+    client->hello = 0;
+    client->binary = 1;
+    timer_arm(&client->timer, REGISTER_TIMEOUT, register_timeout);
+    char out[8];
+    send_client(client, out, frame(out, F_HELLO, &(char) {1}, 1));
+    send_client(client, out, frame(out, F_NAME, NULL, 0));
+}
+
+/*
+ * Start a battle between two matched clients inside the reactor
+*/
+Battle *open_battle(Clientptr c1, Clientptr c2) {
+    char buf[MAX_LINE + 1];
+    Battle *b = init_battle(0, c1, c2);
+    battlelist = add_battle(battlelist, b);
+    if (poolsoc == -1) { // The server counts those of its workers
+        STAT_ADD(battles, 1);
+        STAT_ADD(clients[S_BATTLE], 2);
+    }
+    c1->battle = c2->battle = b;
+    c1->state = c2->state = C_BATTLE;
+    init_battler(c1);
+    init_battler(c2);
+    engage(c1, c2, buf);
+    // Findable by spectators from now on
+    b->home = shard->id;
+    for (short i = 0; i < 2; i++) {
+        Clientptr c = i ? c2:c1;
+        b->rating[i] = c->rating;
+        memcpy(b->names[i], c->name, sizeof(b->names[i]));
+    }
+    atomic_store_explicit(&b->id, c1->battleid, memory_order_release);
+    unsigned top = atomic_load(&battletop), h = slab_handle(&battleslab, b) + 1;
+    while (top < h && !atomic_compare_exchange_weak(&battletop, &top, h));
+    begin_turn(b);
+    return b;
+}
+
+/*
+ * Start a new turn, both battlers pick again
+*/
+void begin_turn(Battle *b) {
+    char buf[MAX_LINE + 1];
+    b->state = B_MOVES;
+    b->mov[0] = b->mov[1] = '\0';
+    b->late = 0;
+    if (clear_garbage(b->c1, buf) || clear_garbage(b->c2, buf)) {
+        close_battle(b);
+        return;
+    }
+    TRACE_BEGIN(shown);
+    turn_info(b->c1, b->c2, buf);
+    turn_info(b->c2, b->c1, buf);
+    TRACE_END(shown, SP_TURN_INFO);
+    timer_arm(&b->timer, MOVE_TIMEOUT, move_timeout);
+    // Edges seen while a battler had already moved were not read, catch up on them
+    battle_input(b, b->c1);
+    if (b->state != B_SETTLE) battle_input(b, b->c2);
+}
+
+/*
+ * Feed a battler's pending input to its battle, moves are single chars and speeches lines
+*/
+void battle_input(Battle *b, Clientptr client) {
+    short i = (client == b->c1) ? 0:1, n;
+    char line[MAX_LINE + 1];
+    while (b->state != B_SETTLE && client->battle == b) {
+        if (client->speaking) n = take_line(client, line, MAX_LINE + 1); // Whatever the opponent does meanwhile
+        else if (b->mov[i]) return; // Already moved, the rest is for next turn
+        else n = take_char(client, line);
+        if (n) {
+            client->missed = 0;
+            if (client->speaking) say(client, i ? b->c1:b->c2, line, n);
+            else pick(b, i, line[0]);
+            continue;
+        }
+        if (client->eof) { // client disconnected
+            client->hp = 0;
+            close_battle(b);
+        }
+        return;
+    }
+}
+
+/*
+ * Take a battler's move for this turn (i: 0 for c1, 1 for c2)
+*/
+void pick(Battle *b, short i, char c) {
+    char buf[MAX_LINE + 1];
+    Clientptr client = i ? b->c2:b->c1, opponent = i ? b->c1:b->c2;
+    char mov = move(client, c);
+    if (!mov) return; // Unintelligible move
+    if (mov == 's') { // Not a move, the turn goes on while the line is typed
+        open_speech(client);
+        return;
+    }
+    b->mov[i] = mov;
+    // notify opponent that client moved
+    short n;
+    if ((n = sprintf(buf, "\r\n%s has made a choice\r\n", client->name)) < 0) fprintf(stderr, "%s/snprintf: %s\n", __func__, strerror(errno));
+    tell(opponent, buf, n + 1, F_MOVED, NULL, 0);
+    if (b->mov[!i]) resolve_turn(b); // Both clients moved
+}
+
+/*
+ * Evaluate damages once both battlers moved
+*/
+void resolve_turn(Battle *b) {
+    TRACE_BEGIN(resolved);
+    rule_turn(&b->c1->hp, &b->c2->hp, b->mov[0], b->mov[1]);
+    journal_turn(b->c1, b->c2, b->mov[0], b->mov[1], b->late);
+    watch_turn(b);
+    TRACE_END(resolved, SP_RESOLVE);
+    if (b->c1->hp > 0 && b->c2->hp > 0) begin_turn(b);
+    else close_battle(b);
+    hist_add(&stats->turn, now_us() - woke_us);
+}
+
+/*
+ * Settle a battle and put its clients back to matching
+*/
+void close_battle(Battle *b) {
+    char buf[MAX_LINE + 1];
+    b->state = B_SETTLE;
+    timer_cancel(&b->timer);
+    atomic_store(&b->id, 0); // No new spectators
+    TRACE_BEGIN(settled);
+    short result = evaluate(b->c1, b->c2, buf);
+    Clientptr guest = b->c1->relay ? b->c1:(b->c2->relay ? b->c2:NULL); // Player of another node
+    watch_end(b, result);
+    if (poolsoc != -1) { // A worker's, reported to the server once its battlers got the rest
+        TRACE_END(settled, SP_SETTLE);
+        battlelist = poll_battle(battlelist, b);
+        b->result = result;
+        reportlist = add_battle(reportlist, b);
+        timer_arm(&b->timer, REPORT_DRAIN, drain_timeout);
+        return;
+    }
+    if (!handing || guest) rate_battle(b->c1, b->c2, result); // A successor would not know the guest
+    if (guest) relay_rated(guest, !result ? R_TIE:((result == (guest == b->c1 ? 1:2)) ? R_WIN:R_LOSS));
+    TRACE_END(settled, SP_SETTLE);
+    battlelist = poll_battle(battlelist, b);
+    STAT_ADD(battles, -1);
+    STAT_ADD(clients[S_BATTLE], -2);
+    endedbattle = add_battle(endedbattle, b); // Might still be on the stack
+    _resume_client(b->c1);
+    _resume_client(b->c2);
+    if (handing && guest) { // Rated already, ours goes on as a lobby client
+        Clientptr ours = (guest == b->c1) ? b->c2:b->c1;
+        ours->state = C_LOBBY;
+        hand_over(ours, NULL, -1);
+    }
+    else if (handing) hand_over(b->c1, b->c2, result); // Rated by the successor
+    _match(); // An ended battle implies a new match
+}
+
+/*
+ * Free clients and battles that ended during this reactor iteration
+*/
+void bury() {
+    while (deadclient) {
+        Clientptr c = deadclient;
+        deadclient = poll_client(deadclient, c);
+        fdtab[c->soc] = NULL; // Before the number can be reused by another shard's accept
+        if (c->adopted) epoll_ctl(epfd, EPOLL_CTL_DEL, c->soc, NULL); // Closing our copy alone would leave it registered
+        if (close(c->soc) == -1) fprintf(stderr, "%s/close: %s\n", __func__, strerror(errno));
+        leave_peer(c->peer);
+        slab_put(&clientslab, c);
+    }
+    while (endedbattle) {
+        Battle *b = endedbattle;
+        endedbattle = poll_battle(endedbattle, b);
+        slab_put(&battleslab, b);
+    }
+}
+
+/*
+ * Take the messages other shards left for this one
+*/
+void take_inbox() {
+    uint64_t count;
+    if (read(shard->evfd, &count, sizeof(count)) == -1 && errno != EAGAIN) fprintf(stderr, "%s/read: %s\n", __func__, strerror(errno));
+    Msg *msg = atomic_exchange(&shard->inbox, NULL), *fifo = NULL;
+    while (msg) { // Oldest first
+        Msg *next = msg->next;
+        msg->next = fifo;
+        fifo = msg;
+        msg = next;
+    }
+    while ((msg = fifo)) {
+        fifo = msg->next;
+        if (msg->type == M_BCAST) {
+            fan_out(msg->buf, msg->bin, msg->lobby);
+            release_chunk(msg->buf);
+            if (msg->bin) release_chunk(msg->bin);
+        }
+        else if (msg->type == M_DRAIN) drain_clients();
+        else if (msg->type == M_CHALLENGE && msg->c1->relay) { // A guest for a player kept for it
+            short home = -1;
+            Clientptr rival = find_name(msg->name, &home);
+            attach(msg->c1);
+            msg->c1->state = C_FED;
+            host_guest(msg->c1, (home == shard->id && !handing) ? rival:NULL);
+        }
+        else if ((msg->type == M_ADOPT || msg->type == M_WATCH || msg->type == M_CHALLENGE) && handing) hand_over(msg->c1, NULL, -1); // Too late to join
+        else if (msg->type == M_FED) fed_paired(msg);
+        else if (msg->type == M_CHALLENGE) { // The rival may have left the lobby meanwhile
+            short home = -1;
+            Clientptr rival = find_name(msg->name, &home);
+            attach(msg->c1);
+            msg->c1->state = C_LOBBY;
+            queue_client(msg->c1);
+            if (rival && home == shard->id && rival != msg->c1 && in_lobby(rival)) pair_clients(msg->c1, rival, now_ms());
+            else {
+                tell(msg->c1, AWAY_MSG, AWAY_MSG_LEN, F_NOTICE, &(char) {N_AWAY}, 1);
+                _match();
+            }
+        }
+        else if (msg->type == M_WATCH) { // A spectator for a battle that may have ended meanwhile
+            Battle *b = battlelist;
+            while (b && atomic_load_explicit(&b->id, memory_order_relaxed) != msg->battle) b = b->next;
+            attach(msg->c1);
+            msg->c1->state = C_LOBBY;
+            if (b) watch(msg->c1, b);
+            else {
+                tell(msg->c1, NO_BATTLE_MSG, NO_BATTLE_MSG_LEN, F_WATCH, &(char) {W_NONE}, 1);
+                rejoin(msg->c1);
+                _match();
+            }
+        }
+        else if (msg->type == M_ADOPT) { // A waiter joining ours in its window
+            long long since = msg->c1->queued_at; // Keeps its widened window
+            attach(msg->c1);
+            msg->c1->state = C_LOBBY;
+            queue_client(msg->c1);
+            msg->c1->queued_at = since;
+            _match();
+        }
+        if (msg != &shard->drain) slab_put(&msgslab, msg);
+    }
+}
+
+/*
+ * Leave a message to another shard
+*/
+void post(Shard *to, Msg *msg) {
+    msg->next = atomic_load(&to->inbox);
+    while (!atomic_compare_exchange_weak(&to->inbox, &msg->next, msg));
+    wake(to);
+}
+
+/*
+ * Wake a shard up from epoll_wait
+*/
+void wake(Shard *s) {
+    uint64_t one = 1;
+    if (write(s->evfd, &one, sizeof(one)) == -1) fprintf(stderr, "%s/write: %s\n", __func__, strerror(errno));
+}
+
+/*
+ * Register a client on this shard's epoll
+*/
+void attach(Clientptr client) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = client->soc};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client->soc, &ev) == -1) fprintf(stderr, "%s/epoll_ctl: %s\n", __func__, strerror(errno));
+    move_name(client, shard->id);
+    if (client->outn) mark_dirty(client); // Whatever the former shard could not send
+}
+
+/*
+ * Unregister a client leaving this shard, its events in this iteration are ignored
+*/
+void detach(Clientptr client) {
+    timer_cancel(&client->timer); // Timers belong to the shard's wheel
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, client->soc, NULL) == -1) fprintf(stderr, "%s/epoll_ctl: %s\n", __func__, strerror(errno));
+    move_name(client, -1); // Not to be challenged on the way
+    client->state = C_MOVING;
+}
+
+/*
+ * Move a waiting client nobody here matches to a lower shard with waiters in its window
+ * Moves only go down, the shards above are told to offer theirs (publish_waiting)
+*/
+short share_waiter(Clientptr client, long long now) {
+    int reach = window(client, now);
+    int lo = rung(client->rating - reach), hi = rung(client->rating + reach);
+    for (short w = lo / 64; w <= hi / 64; w++) wanted[w] |= span(w, lo, hi);
+    for (short i = 0; i < shard->id; i++) {
+        short w = lo / 64;
+        while (w <= hi / 64 && !(atomic_load_explicit(&shards[i].waiting[w], memory_order_relaxed) & span(w, lo, hi))) w++;
+        if (w > hi / 64) continue;
+        Msg *msg = slab_get(&msgslab);
+        if (!msg) return 0; // Pool empty, waits here
+        unqueue_client(client);
+        detach(client);
+        msg->type = M_ADOPT;
+        msg->to = i;
+        msg->c1 = client;
+        msg->next = outbox;
+        outbox = msg;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Publish the buckets still waiting after a pass, and wake the shards above with waiters this one would take
+*/
+void publish_waiting(short all) {
+    short grew = 0;
+    for (short w = 0; w < (MM_BUCKETS + 63) / 64; w++) {
+        uint64_t was = atomic_exchange_explicit(&shard->waiting[w], ladder.busy[w], memory_order_relaxed);
+        if (ladder.busy[w] & ~was) grew = 1;
+    }
+    if (!grew && !all) return; // Told already
+    for (short i = shard->id + 1; i < nshard; i++) {
+        Shard *s = &shards[i];
+        for (short w = 0; w < (MM_BUCKETS + 63) / 64; w++) {
+            if (!(atomic_load_explicit(&s->waiting[w], memory_order_relaxed) & wanted[w])) continue;
+            if (!atomic_exchange(&s->rematch, 1)) wake(s);
+            break;
+        }
+    }
+}
+
+/*
+ * Bits of bitmap word w in buckets [lo, hi]
+*/
+uint64_t span(short w, int lo, int hi) {
+    uint64_t bits = ~0ULL;
+    if (w == lo / 64) bits &= ~0ULL << (lo % 64);
+    if (w == hi / 64 && hi % 64 < 63) bits &= (1ULL << (hi % 64 + 1)) - 1;
+    return bits;
+}
+
+/*
+ * Send the clients leaving this shard, once none of their events are pending
+*/
+void ship() {
+    while (outbox) {
+        Msg *msg = outbox;
+        outbox = msg->next;
+        if (msg->type == M_ADOPT || msg->type == M_WATCH || msg->type == M_CHALLENGE) {
+            post(&shards[msg->to], msg);
+            continue;
+        }
+        if (!push_match(shard, msg->c1, msg->c2)) start_pair(msg->c1, msg->c2); // Ring full, battle here
+        else for (short i = 1; i < nshard; i++) { // Let an idle shard steal it
+            Shard *s = &shards[(shard->id + i) % nshard];
+            if (!atomic_exchange(&s->idle, 0)) continue;
+            wake(s);
+            break;
+        }
+        slab_put(&msgslab, msg);
+    }
+}
+
+/*
+ * Start the shard's pending matches, steal some from other shards when idle
+*/
+void take_matches() {
+    Clientptr c1, c2;
+    while (1) {
+        int got = pop_match(shard, &c1, &c2);
+        for (short i = 1; !got && !battlelist && i < nshard; i++) got = pop_match(&shards[(shard->id + i) % nshard], &c1, &c2);
+        if (!got) break;
+        start_pair(c1, c2);
+    }
+}
+
+/*
+ * Take over a matched pair and start its battle here
+*/
+void start_pair(Clientptr c1, Clientptr c2) {
+    attach(c1);
+    attach(c2);
+    matchedclient = add_client(matchedclient, c1);
+    matchedclient = add_client(matchedclient, c2);
+    open_battle(c1, c2);
+}
+
+/*
+ * Queue a pending match, return 0 if the ring is full
+*/
+int push_match(Shard *s, Clientptr c1, Clientptr c2) {
+    size_t pos = atomic_load_explicit(&s->tail, memory_order_relaxed);
+    Pending *p;
+    while (1) {
+        p = &s->ring[pos & (MATCH_RING - 1)];
+        intptr_t dif = (intptr_t) atomic_load_explicit(&p->seq, memory_order_acquire) - (intptr_t) pos;
+        if (dif < 0) return 0; // Full
+        if (dif > 0) pos = atomic_load_explicit(&s->tail, memory_order_relaxed); // Lost the slot, retry
+        else if (atomic_compare_exchange_weak_explicit(&s->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+    }
+    p->c1 = c1;
+    p->c2 = c2;
+    atomic_store_explicit(&p->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+/*
+ * Pop a pending match, return 0 if there is none
+*/
+int pop_match(Shard *s, Clientptr *c1, Clientptr *c2) {
+    size_t pos = atomic_load_explicit(&s->head, memory_order_relaxed);
+    Pending *p;
+    while (1) {
+        p = &s->ring[pos & (MATCH_RING - 1)];
+        intptr_t dif = (intptr_t) atomic_load_explicit(&p->seq, memory_order_acquire) - (intptr_t) (pos + 1);
+        if (dif < 0) return 0; // Empty
+        if (dif > 0) pos = atomic_load_explicit(&s->head, memory_order_relaxed); // Lost the slot, retry
+        else if (atomic_compare_exchange_weak_explicit(&s->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+    }
+    *c1 = p->c1;
+    *c2 = p->c2;
+    atomic_store_explicit(&p->seq, pos + MATCH_RING, memory_order_release);
+    return 1;
+}
+
+/*
+ * Queue a message to a client, or write it straight away in the forking server
+*/
+void send_client(Clientptr client, const char *msg, int len) {
+    if (!reactor) {
+        TRACE_BEGIN(wrote);
+        int n = write(client->soc, msg, len);
+        TRACE_END(wrote, SP_WRITE);
+        if (n > 0) STAT_ADD(bytes_out, n);
+        return;
+    }
+    if (client->relay == RL_GUEST) { // Framed for the node relaying it
+        char out[MAX_FRAME];
+        for (int at = 0; at < len; at += MAX_LINE) queue_output(client, out, frame(out, F_RELAY, msg + at, (len - at < MAX_LINE) ? len - at:MAX_LINE));
+        return;
+    }
+    queue_output(client, msg, len);
+}
+
+/*
+ * Append to a client's output queue, a client that cannot keep up is dropped
+*/
+void queue_output(Clientptr client, const char *msg, int len) {
+    if (client->state == C_DEAD) return;
+    while (len > 0) {
+        Outbuf *tail = client->outn ? client->out[(client->outhead + client->outn - 1) % OUT_SEGS]:NULL;
+        if (client->outlen + len > OUT_HIGH || (client->outn == OUT_SEGS && (tail->len == OUT_CHUNK || tail->shared))) {
+            drop_slow(client);
+            return;
+        }
+        if (!tail || tail->len == OUT_CHUNK || tail->shared) { // Start a new chunk
+            if (!(tail = slab_get(&chunkslab))) { // Out of chunks, whoever has most queued is the slowest
+                drop_slow(client);
+                return;
+            }
+            tail->len = 0;
+            tail->shared = 0;
+            atomic_init(&tail->refs, 1);
+            client->out[(client->outhead + client->outn++) % OUT_SEGS] = tail;
+        }
+        int n = (len < OUT_CHUNK - tail->len) ? len:OUT_CHUNK - tail->len;
+        memcpy(tail->data + tail->len, msg, n);
+        tail->len += n;
+        client->outlen += n;
+        msg += n;
+        len -= n;
+    }
+    mark_dirty(client);
+}
+
+/*
+ * Send a client the text of a message, or its frame if the client speaks the binary protocol
+*/
+void tell(Clientptr client, const char *text, int len, char type, const void *payload, short plen) {
+    if (!client->binary) {
+        send_client(client, text, len);
+        return;
+    }
+    char out[MAX_FRAME];
+    send_client(client, out, frame(out, type, payload, plen));
+}
+
+/*
+ * Frame a message of the binary protocol, return its length
+*/
+short frame(char out[], char type, const void *payload, short len) {
+    out[0] = (len + 1) >> 8;
+    out[1] = (len + 1) & 0xff;
+    out[2] = type;
+    if (len) memcpy(out + 3, payload, len);
+    return len + 3;
+}
+
+/*
+ * Put a client on the shard's list of clients to flush
+*/
+void mark_dirty(Clientptr client) {
+    if (client->dirty) return;
+    client->dirty = 1;
+    client->dirtynext = dirtylist;
+    dirtylist = client;
+}
+
+/*
+ * Write as much of a client's queue as the socket takes, in one writev() per round
+*/
+void flush_client(Clientptr client) {
+    struct iovec iov[OUT_SEGS];
+    while (client->outn) {
+        for (short i = 0; i < client->outn; i++) {
+            Outbuf *chunk = client->out[(client->outhead + i) % OUT_SEGS];
+            iov[i].iov_base = chunk->data + (i ? 0:client->outoff);
+            iov[i].iov_len = chunk->len - (i ? 0:client->outoff);
+        }
+        ssize_t n = writev(client->soc, iov, client->outn);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) { // Gone, the reader will notice
+                client->gone = 1;
+                drop_output(client);
+            }
+            return; // Otherwise wait for EPOLLOUT
+        }
+        STAT_ADD(bytes_out, n);
+        client->outlen -= n;
+        n += client->outoff;
+        while (client->outn && n >= client->out[client->outhead]->len) { // Fully sent chunks
+            n -= client->out[client->outhead]->len;
+            release_chunk(client->out[client->outhead]);
+            client->outhead = (client->outhead + 1) % OUT_SEGS;
+            client->outn--;
+        }
+        client->outoff = n;
+    }
+    client->outhead = client->outoff = 0;
+    if (client->relay == RL_GUEST && client->state == C_FED) shutdown(client->soc, SHUT_WR); // All sent, the relay is over
+    else if (client->relay == RL_LINK && client->link && client->link->eof) shutdown(client->soc, SHUT_WR); // The host sees its player go
+}
+
+/*
+ * Flush every client that got output in this iteration
+*/
+void flush_dirty() {
+    while (dirtylist) {
+        Client *c = dirtylist;
+        dirtylist = c->dirtynext;
+        c->dirty = 0;
+        if (c->state != C_DEAD) flush_client(c);
+    }
+}
+
+/*
+ * Slow consumer, drop it rather than stalling everyone
+*/
+void drop_slow(Clientptr client) {
+    if (!client->gone) STAT_ADD(dropped[D_SLOW], 1);
+    client->gone = 1;
+    drop_output(client);
+    shutdown(client->soc, SHUT_RDWR); // Seen as a disconnect by whoever reads it next
+}
+
+/*
+ * Throw away a client's queued output
+*/
+void drop_output(Clientptr client) {
+    while (client->outn) {
+        release_chunk(client->out[client->outhead]);
+        client->outhead = (client->outhead + 1) % OUT_SEGS;
+        client->outn--;
+    }
+    client->outhead = client->outoff = client->outlen = 0;
+}
+
+/*
+ * Read a client and hand its input to whatever it is doing
+*/
+void client_input(Clientptr client) {
+    fill_input(client);
+    if (client->state == C_REGISTER) {
+        TRACE_BEGIN(registered);
+        register_client(client);
+        TRACE_END(registered, SP_REGISTER);
+    }
+    else if (client->state == C_BATTLE) battle_input(client->battle, client);
+    else if (client->state == C_LOBBY || client->state == C_WATCH) lobby_input(client);
+    else if (client->state == C_FED) fed_input(client);
+}
+
+/*
+ * Fill a client's input ring with as few reads as the socket allows
+*/
+void fill_input(Clientptr client) {
+    while (client->inlen < IN_RING && !client->eof) {
+        short tail = (client->inhead + client->inlen) & (IN_RING - 1);
+        struct iovec iov[2] = { // Free space, wrapping around
+            {.iov_base = client->in + tail, .iov_len = (tail >= client->inhead) ? IN_RING - tail:client->inhead - tail},
+            {.iov_base = client->in, .iov_len = (tail >= client->inhead) ? client->inhead:0}
+        };
+        ssize_t n = readv(client->soc, iov, 2);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) { // client disconnected
+            if (n == -1 && errno != ECONNRESET && errno != ETIMEDOUT) fprintf(stderr, "%s/readv: %s\n", __func__, strerror(errno));
+            client->eof = client->gone = 1;
+            return;
+        }
+        client->inlen += n;
+        STAT_ADD(bytes_in, n);
+        // A short read drained the socket, the next edge tells about more unless the peer hung up
+        if ((size_t) n < iov[0].iov_len + iov[1].iov_len && !client->hup) return;
+    }
+}
+
+/*
+ * Take a single char of input, return 0 if there is none
+*/
+short take_char(Clientptr client, char *c) {
+    if (client->binary) return take_frame(client, c, 1) ? 1:0;
+    if (!client->inlen) fill_input(client);
+    if (!client->inlen) return 0;
+    *c = client->in[client->inhead];
+    client->inhead = (client->inhead + 1) & (IN_RING - 1);
+    client->inlen--;
+    client->inscan = 0;
+    return 1;
+}
+
+/*
+ * Take a line of input including its newline, or max chars if no newline comes before
+ * Return its length, 0 if the line is not complete yet
+*/
+short take_line(Clientptr client, char line[], short max) {
+    short n;
+    if (client->binary) return take_frame(client, line, max);
+    while (!(n = cut_line(client, line, max))) {
+        short had = client->inlen;
+        fill_input(client);
+        if (client->inlen == had) return 0;
+    }
+    return n;
+}
+
+/*
+ * Take a line out of what is in the input ring already, without reading the socket
+*/
+short cut_line(Clientptr client, char line[], short max) {
+    short n = 0;
+    for (short i = client->inscan; i < client->inlen && i < max; i++) {
+        if (client->in[(client->inhead + i) & (IN_RING - 1)] != '\n') continue;
+        n = i + 1;
+        break;
+    }
+    if (!n && client->inlen >= max) n = max; // Too long, cut it
+    if (!n) {
+        client->inscan = client->inlen; // Scanned already
+        return 0;
+    }
+    for (short i = 0; i < n; i++) line[i] = client->in[(client->inhead + i) & (IN_RING - 1)];
+    client->inhead = (client->inhead + n) & (IN_RING - 1);
+    client->inlen -= n;
+    client->inscan = 0;
+    return n;
+}
+
+/*
+ * Take the next frame of a binary client as the text it stands for, a move char or a line (names and speeches)
+ * Return its length, 0 if no whole frame is there yet
+*/
+short take_frame(Clientptr client, char out[], short max) {
+    unsigned char *in = (unsigned char *) client->in;
+    while (1) {
+        if (client->inlen < 3) fill_input(client);
+        if (client->inlen < 3) return 0;
+        short len = in[client->inhead] << 8 | in[(client->inhead + 1) & (IN_RING - 1)];
+        if (len < 1 || len > MAX_LINE + 1) { // Not a frame we would take, give up on the client
+            client->inhead = client->inlen = client->inscan = 0;
+            client->eof = client->gone = 1;
+            return 0;
+        }
+        if (client->inlen < len + 2) fill_input(client);
+        if (client->inlen < len + 2) return 0;
+        char type = in[(client->inhead + 2) & (IN_RING - 1)];
+        short n = 0, want = (type == F_MOVE) ? 1:max - 1; // Room for the newline of a line
+        for (short i = 0; i < len - 1 && n < want; i++) out[n++] = in[(client->inhead + 3 + i) & (IN_RING - 1)];
+        client->inhead = (client->inhead + len + 2) & (IN_RING - 1);
+        client->inlen -= len + 2;
+        client->inscan = 0;
+        if (type == F_MOVE && n) return n;
+        if (type == F_NAME || type == F_CHAT) {
+            out[n++] = '\n';
+            return n;
+        }
+        if (type == F_TOP && max > 4) return sprintf(out, "top\n");
+        if (type == F_WATCH && n == 1 && out[0] == '?' && max > 8) return sprintf(out, "battles\n");
+        if (type == F_SAY && n && n <= max - 5) { // A line for the lobby
+            memmove(out + 4, out, n);
+            memcpy(out, "say ", 4);
+            out[n + 4] = '\n';
+            return n + 5;
+        }
+        if (type == F_CHALLENGE && n && n <= max - 11) { // The name challenged
+            memmove(out + 10, out, n);
+            memcpy(out, "challenge ", 10);
+            out[n + 10] = '\n';
+            return n + 11;
+        }
+        if (type == F_WATCH && n <= max - 7) { // What follows the command
+            memmove(out + 6, out, n);
+            memcpy(out, "watch ", 6);
+            out[n + 6] = '\n';
+            return n + 7;
+        }
+        // Anything else is skipped
+    }
+}
+
+/*
+ * Take lines sent from the lobby, commands or chatter
+*/
+void lobby_input(Clientptr client) {
+    char line[MAX_LINE + 1];
+    short n;
+    while ((client->state == C_LOBBY || client->state == C_WATCH) && (n = take_line(client, line, MAX_LINE + 1))) {
+        if (client->state == C_LOBBY) timer_arm(&client->timer, IDLE_TIMEOUT, idle_timeout); // Still around
+        lobby_command(client, line, n);
+    }
+    if (!client->eof || client->state == C_MOVING) return; // A moving client is read again where it lands
+    if (client->state == C_WATCH) unwatch(client); // Disconnected client
+    else unqueue_client(client);
+    remove_client(client, 1);
+}
+
+/*
+ * Act on the lines a lobby client of the forking server sent, a line not finished waits in the input ring for the rest
+*/
+void lobby_lines(Clientptr client, char buf[], ssize_t got) {
+    char line[MAX_LINE + 1];
+    short n;
+    timer_arm(&client->timer, IDLE_TIMEOUT, idle_timeout);
+    for (ssize_t at = 0; at < got && in_lobby(client);) {
+        while (at < got && client->inlen < IN_RING) client->in[(client->inhead + client->inlen++) & (IN_RING - 1)] = buf[at++];
+        while (in_lobby(client) && (n = cut_line(client, line, MAX_LINE + 1))) lobby_command(client, line, n);
+    }
+}
+
+/*
+ * Act on a line typed in the lobby
+*/
+void lobby_command(Clientptr client, char line[], short n) {
+    while (n && (line[n - 1] == '\n' || line[n - 1] == '\r' || line[n - 1] == ' ')) n--;
+    if (n == 3 && !memcmp(line, "top", 3)) show_top(client);
+    else if (n == 7 && !memcmp(line, "battles", 7)) list_battles(client);
+    else if (n == 4 && !memcmp(line, "stop", 4)) watch_command(client, "stop");
+    else if (n > 4 && !memcmp(line, "say ", 4)) lobby_say(client, line + 4, n - 4);
+    else if (n > 10 && !memcmp(line, "challenge ", 10)) {
+        char name[MAX_NAME + 1];
+        snprintf(name, sizeof(name), "%.*s", n - 10, line + 10);
+        challenge_command(client, name);
+    }
+    else if (n >= 5 && !memcmp(line, "watch", 5) && (n == 5 || line[5] == ' ')) {
+        char arg[24];
+        snprintf(arg, sizeof(arg), "%.*s", n - 5, line + 5);
+        watch_command(client, arg);
+    }
+}
+
+/*
+ * Send the leaderboard
+*/
+void show_top(Clientptr client) {
+    Player top[LEADERS];
+    short count = leaders(top, LEADERS), n = 0;
+    char buf[LEADERS * (MAX_NAME + 64) + 32];
+    if (client->binary) {
+        char payload[LEADERS * (MAX_NAME + 15) + 1] = {count};
+        short len = 1;
+        for (short i = 0; i < count; i++) {
+            uint32_t wlt[3] = {htonl(top[i].wins), htonl(top[i].losses), htonl(top[i].ties)};
+            payload[len] = strlen(top[i].name);
+            memcpy(payload + len + 1, top[i].name, payload[len]);
+            len += payload[len] + 1;
+            payload[len++] = top[i].rating >> 8;
+            payload[len++] = top[i].rating & 0xff;
+            memcpy(payload + len, wlt, sizeof(wlt));
+            len += sizeof(wlt);
+        }
+        send_client(client, buf, frame(buf, F_TOP, payload, len));
+        return;
+    }
+    n += sprintf(buf, "\r\nTop players:\r\n");
+    for (short i = 0; i < count; i++) {
+        n += sprintf(buf + n, "%2d. %s %d (%u-%u-%u)\r\n", i + 1, top[i].name, top[i].rating, top[i].wins, top[i].losses, top[i].ties);
+    }
+    send_client(client, buf, n + 1);
+}
+
+/*
+ * Say a line to everyone in the lobby, on every shard
+*/
+void lobby_say(Clientptr client, char text[], short n) {
+    while (n && (text[n - 1] == '\n' || text[n - 1] == '\r')) n--;
+    if (!n || !chat_token(client)) return;
+    char msg[MAX_NAME + MAX_LINE + 8], bin[MAX_NAME + MAX_LINE + 8], payload[MAX_NAME + MAX_LINE + 1];
+    short len = sprintf(msg, "%s: %.*s\r\n", client->name, n, text);
+    payload[0] = strlen(client->name);
+    memcpy(payload + 1, client->name, payload[0]);
+    memcpy(payload + 1 + payload[0], text, n);
+    notify_all(msg, len, bin, frame(bin, F_SAY, payload, 1 + payload[0] + n), 1);
+}
+
+/*
+ * Battle a player of the lobby right away, without waiting to be matched
+*/
+void challenge_command(Clientptr client, char *name) {
+    short home = 0;
+    while (*name == ' ') name++;
+    name[strcspn(name, "\r\n")] = '\0';
+    Clientptr rival = find_name(name, &home);
+    if (!rival || rival == client || home == -1 || (!reactor && !in_lobby(rival))) {
+        tell(client, AWAY_MSG, AWAY_MSG_LEN, F_NOTICE, &(char) {N_AWAY}, 1);
+        return;
+    }
+    if (reactor && home != shard->id) { // Only its shard can take the rival out of the lobby
+        Msg *msg = slab_get(&msgslab);
+        if (!msg) { // Pool empty, as good as away
+            tell(client, AWAY_MSG, AWAY_MSG_LEN, F_NOTICE, &(char) {N_AWAY}, 1);
+            return;
+        }
+        if (client->state == C_WATCH) unwatch(client);
+        else unqueue_client(client);
+        detach(client);
+        msg->type = M_CHALLENGE;
+        msg->to = home;
+        msg->c1 = client;
+        snprintf(msg->name, sizeof(msg->name), "%s", name); // The rival is not ours to read
+        msg->next = outbox;
+        outbox = msg;
+        return;
+    }
+    if (!in_lobby(rival)) {
+        tell(client, AWAY_MSG, AWAY_MSG_LEN, F_NOTICE, &(char) {N_AWAY}, 1);
+        return;
+    }
+    if (client->state == C_WATCH) {
+        unwatch(client);
+        queue_client(client);
+    }
+    pair_clients(client, rival, now_ms());
+}
+
+/*
+ * Whether a client waits in the lobby queue
+ * Matched clients of the forking server stay C_LOBBY, their idle timer is off
+*/
+short in_lobby(Clientptr client) {
+    return client->state == C_LOBBY && client->timer.armed;
+}
+
+/*
+ * Start watching a battle, by id or the featured one (the best rated) without, or stop with "stop"
+*/
+void watch_command(Clientptr client, char *arg) {
+    while (*arg == ' ' || *arg == '#') arg++;
+    if (!reactor) {
+        send_client(client, NO_WATCH_MSG, NO_WATCH_MSG_LEN);
+        return;
+    }
+    if (!strcmp(arg, "stop")) {
+        if (client->state != C_WATCH) return;
+        unwatch(client);
+        rejoin(client);
+        _match();
+        return;
+    }
+    Summary s;
+    Battle *b = find_battle(strtoull(arg, NULL, 10), &s);
+    if (!b) {
+        tell(client, NO_BATTLE_MSG, NO_BATTLE_MSG_LEN, F_WATCH, &(char) {W_NONE}, 1);
+        return;
+    }
+    if (client->state == C_WATCH && client->battle == b) return;
+    Msg *msg = (s.home == shard->id) ? NULL:slab_get(&msgslab);
+    if (s.home != shard->id && !msg) { // Pool empty, as good as ended
+        tell(client, NO_BATTLE_MSG, NO_BATTLE_MSG_LEN, F_WATCH, &(char) {W_NONE}, 1);
+        return;
+    }
+    if (client->state == C_WATCH) unwatch(client);
+    else unqueue_client(client);
+    if (!msg) {
+        watch(client, b);
+        return;
+    }
+    // Spectators live on the battle's shard, the events are shared there
+    detach(client);
+    msg->type = M_WATCH;
+    msg->to = s.home;
+    msg->c1 = client;
+    msg->battle = s.id;
+    msg->next = outbox;
+    outbox = msg;
+}
+
+/*
+ * Add a spectator to a battle of this shard, telling it how the battle stands
+*/
+void watch(Clientptr client, Battle *b) {
+    char buf[MAX_LINE + 1], payload[2 * MAX_NAME + 13] = {W_START};
+    short n = 1;
+    client->state = C_WATCH;
+    client->battle = b;
+    client->skipped = 0;
+    b->watchers = add_client(b->watchers, client);
+    atomic_fetch_add_explicit(&b->watching, 1, memory_order_relaxed);
+    STAT_ADD(clients[S_WATCH], 1);
+    if (!client->binary) {
+        n = sprintf(buf, "\r\nWatching #%llu, %s (%d hp) vs %s (%d hp), stop to leave\r\n", (unsigned long long) b->c1->battleid,
+            b->c1->name, (b->c1->hp > 0) ? b->c1->hp:0, b->c2->name, (b->c2->hp > 0) ? b->c2->hp:0);
+        send_client(client, buf, n);
+        return;
+    }
+    for (short i = 0; i < 8; i++) payload[n++] = b->c1->battleid >> (56 - 8 * i);
+    for (short i = 0; i < 2; i++) {
+        Clientptr c = i ? b->c2:b->c1;
+        payload[n] = strlen(c->name);
+        memcpy(payload + n + 1, c->name, payload[n]);
+        n += payload[n] + 1;
+    }
+    payload[n++] = (b->c1->hp > 0) ? b->c1->hp:0;
+    payload[n++] = (b->c2->hp > 0) ? b->c2->hp:0;
+    send_client(client, buf, frame(buf, F_WATCH, payload, n));
+}
+
+/*
+ * Take a spectator off its battle
+*/
+void unwatch(Clientptr client) {
+    Battle *b = client->battle;
+    b->watchers = poll_client(b->watchers, client);
+    atomic_fetch_sub_explicit(&b->watching, 1, memory_order_relaxed);
+    STAT_ADD(clients[S_WATCH], -1);
+    client->battle = NULL;
+    client->state = C_LOBBY;
+}
+
+/*
+ * Queue a former spectator for a match again
+*/
+void rejoin(Clientptr client) {
+    queue_client(client);
+    tell(client, WAIT_MSG, WAIT_MSG_LEN, F_WAIT, NULL, 0);
+}
+
+/*
+ * Copy what other shards may know of a battle, 0 if it is not running (or changed while copied)
+*/
+short summarize(Battle *b, Summary *s) {
+    s->id = atomic_load_explicit(&b->id, memory_order_acquire);
+    if (!s->id) return 0;
+    s->home = b->home;
+    memcpy(s->rating, b->rating, sizeof(s->rating));
+    memcpy(s->names, b->names, sizeof(s->names));
+    s->names[0][MAX_NAME] = s->names[1][MAX_NAME] = '\0';
+    s->watching = atomic_load_explicit(&b->watching, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&b->id, memory_order_relaxed) == s->id;
+}
+
+/*
+ * Find a running battle on any shard by id, or the best rated one for id 0
+ * NULL if there is none, s is what it looked like otherwise
+*/
+Battle *find_battle(uint64_t id, Summary *s) {
+    Battle *found = NULL;
+    Summary seen;
+    unsigned top = atomic_load(&battletop);
+    for (unsigned h = 0; h < top; h++) {
+        Battle *b = slab_at(&battleslab, h);
+        if (!summarize(b, &seen) || (id && seen.id != id)) continue;
+        if (found && seen.rating[0] + seen.rating[1] <= s->rating[0] + s->rating[1]) continue;
+        found = b;
+        *s = seen;
+        if (id) break;
+    }
+    return found;
+}
+
+/*
+ * Send the best rated running battles
+*/
+void list_battles(Clientptr client) {
+    if (!reactor) { // Battles run in their own processes
+        send_client(client, NO_WATCH_MSG, NO_WATCH_MSG_LEN);
+        return;
+    }
+    Summary best[WATCH_LIST], seen;
+    short count = 0, n = 0;
+    unsigned top = atomic_load(&battletop);
+    for (unsigned h = 0; h < top; h++) {
+        if (!summarize(slab_at(&battleslab, h), &seen)) continue;
+        short at = (count < WATCH_LIST) ? count++:WATCH_LIST; // Insertion, best first
+        while (at > 0 && best[at - 1].rating[0] + best[at - 1].rating[1] < seen.rating[0] + seen.rating[1]) {
+            if (at < WATCH_LIST) best[at] = best[at - 1];
+            at--;
+        }
+        if (at < WATCH_LIST) best[at] = seen;
+    }
+    char buf[WATCH_LIST * (2 * MAX_NAME + 64) + 32];
+    if (client->binary) {
+        char payload[WATCH_LIST * (2 * MAX_NAME + 16) + 2] = {W_LIST, count};
+        short len = 2;
+        for (short i = 0; i < count; i++) {
+            for (short j = 0; j < 8; j++) payload[len++] = best[i].id >> (56 - 8 * j);
+            for (short j = 0; j < 2; j++) {
+                payload[len] = strlen(best[i].names[j]);
+                memcpy(payload + len + 1, best[i].names[j], payload[len]);
+                len += payload[len] + 1;
+                payload[len++] = best[i].rating[j] >> 8;
+                payload[len++] = best[i].rating[j] & 0xff;
+            }
+            payload[len++] = best[i].watching >> 8;
+            payload[len++] = best[i].watching & 0xff;
+        }
+        send_client(client, buf, frame(buf, F_WATCH, payload, len));
+        return;
+    }
+    n += sprintf(buf, count ? "\r\nLive battles (watch <id>):\r\n":"\r\nNo battle running\r\n");
+    for (short i = 0; i < count; i++) {
+        n += sprintf(buf + n, "#%llu %s (%d) vs %s (%d), %d watching\r\n", (unsigned long long) best[i].id,
+            best[i].names[0], best[i].rating[0], best[i].names[1], best[i].rating[1], best[i].watching);
+    }
+    send_client(client, buf, n);
+}
+
+/*
+ * Queue an event of a battle to its spectators, rendered and framed once and shared by their queues
+ * A spectator that is behind skips events, dropped once it skipped WATCH_SKIPS in a row
+*/
+void spectate(Battle *b, const char *text, short tlen, const char *bin, short blen) {
+    Outbuf *chunks[2] = {NULL, NULL};
+    const char *data[2] = {text, bin};
+    short lens[2] = {tlen, blen};
+    for (Clientptr c = b->watchers; c; c = c->next) {
+        short i = c->binary ? 1:0;
+        if (c->gone) continue;
+        if (c->outlen >= WATCH_LAG) {
+            if (++c->skipped >= WATCH_SKIPS) drop_slow(c); // Read as a hang up
+            continue;
+        }
+        c->skipped = 0;
+        if (!chunks[i] && (chunks[i] = slab_get(&chunkslab))) {
+            chunks[i]->shared = 1;
+            chunks[i]->len = lens[i];
+            memcpy(chunks[i]->data, data[i], lens[i]);
+            atomic_init(&chunks[i]->refs, 1);
+        }
+        if (chunks[i]) send_shared(c, chunks[i]); // Skipped when out of chunks
+    }
+    for (short i = 0; i < 2; i++) {
+        if (chunks[i]) release_chunk(chunks[i]);
+    }
+}
+
+/*
+ * Show spectators the moves of a resolved turn and the hp left
+*/
+void watch_turn(Battle *b) {
+    static const char *verbs[128] = {['a'] = "attacks", ['p'] = "power moves", ['b'] = "blocks"};
+    if (!b->watchers) return;
+    char text[2 * MAX_NAME + 96], bin[8];
+    short hp1 = (b->c1->hp > 0) ? b->c1->hp:0, hp2 = (b->c2->hp > 0) ? b->c2->hp:0;
+    const char *v1 = verbs[b->mov[0] & 127], *v2 = verbs[b->mov[1] & 127];
+    short n = sprintf(text, "#%llu: %s %s, %s %s (%d hp, %d hp)\r\n", (unsigned long long) b->c1->battleid,
+        b->c1->name, v1 ? v1:"waits", b->c2->name, v2 ? v2:"waits", hp1, hp2);
+    char payload[5] = {W_TURN, b->mov[0], b->mov[1], hp1, hp2};
+    spectate(b, text, n, bin, frame(bin, F_WATCH, payload, 5));
+}
+
+/*
+ * Pass a speech on to spectators
+*/
+void watch_chat(Battle *b, Clientptr speaker, char line[], short n) {
+    if (!b->watchers) return;
+    char text[MAX_NAME + MAX_LINE + 48], bin[MAX_LINE + 8], payload[MAX_LINE + 2] = {W_CHAT, speaker->side};
+    if (n > MAX_LINE) n = MAX_LINE;
+    short len = sprintf(text, "#%llu: %s says: %.*s\r\n", (unsigned long long) b->c1->battleid, speaker->name, n, line);
+    memcpy(payload + 2, line, n);
+    spectate(b, text, len, bin, frame(bin, F_WATCH, payload, n + 2));
+}
+
+/*
+ * Tell spectators how a battle ended and send them back to the lobby
+*/
+void watch_end(Battle *b, short result) {
+    if (!b->watchers) return;
+    char text[2 * MAX_NAME + 64], bin[8];
+    char payload[3] = {W_END, result, (b->c1->gone ? J_GONE_C1:0) | (b->c2->gone ? J_GONE_C2:0)};
+    Clientptr winner = (result == 1) ? b->c1:b->c2, loser = (result == 1) ? b->c2:b->c1;
+    short n = sprintf(text, "#%llu: ", (unsigned long long) b->c1->battleid);
+    if (!result) n += sprintf(text + n, "a tie\r\n");
+    else n += sprintf(text + n, "%s wins%s%s%s\r\n", winner->name, loser->gone ? " (":"", loser->gone ? loser->name:"", loser->gone ? " left)":"");
+    spectate(b, text, n, bin, frame(bin, F_WATCH, payload, 3));
+    while (b->watchers) {
+        Clientptr c = b->watchers;
+        unwatch(c);
+        if (handing) hand_over(c, NULL, -1);
+        else if (c->gone) remove_client(c, 1);
+        else rejoin(c);
+    }
+}
+
+/*
+ * Queue a broadcast chunk to every client of this shard
+*/
+void fan_out(Outbuf *buf, Outbuf *bin, short lobby) {
+    TRACE_BEGIN(told);
+    Clientptr lists[3] = {matchingclient, registerlist, matchedclient};
+    for (short i = 0; i < (lobby ? 1:3); i++) {
+        for (Clientptr c = lists[i]; c; c = c->next) {
+            if (c->hello || c->relay) continue; // Protocol not settled yet, or a player of another node
+            if (!c->binary) send_shared(c, buf);
+            else if (bin) send_shared(c, bin);
+        }
+    }
+    TRACE_END(told, SP_BROADCAST);
+}
+
+/*
+ * Queue a shared chunk without copying it, unless the client's queue is getting long
+*/
+void send_shared(Clientptr client, Outbuf *buf) {
+    if (client->state == C_DEAD) return;
+    if (client->outn >= OUT_SEGS / 2) { // Copies pack into fewer chunks
+        send_client(client, buf->data, buf->len);
+        return;
+    }
+    if (client->outlen + buf->len > OUT_HIGH) {
+        drop_slow(client);
+        return;
+    }
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    client->out[(client->outhead + client->outn++) % OUT_SEGS] = buf;
+    client->outlen += buf->len;
+    mark_dirty(client);
+}
+
+/*
+ * Drop a reference to a chunk, freeing it with the last one
+*/
+void release_chunk(Outbuf *buf) {
+    if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) slab_put(&chunkslab, buf);
+}
+
+/*
+ * Hold an arrival or departure to be announced with the others of the window
+*/
+void announce(Crowd *crowd, char *name) {
+    if (crowd->count < BCAST_NAMES) strcpy(crowd->names[crowd->count], name);
+    crowd->count++;
+    if (!heraldtimer.armed) timer_arm(&heraldtimer, BCAST_WINDOW, herald);
+}
+
+/*
+ * Send the announcements held during the window
+*/
+void herald(Timer *timer) {
+    char msg[BCAST_NAMES * (MAX_NAME + 2) + 64];
+    char bin[BCAST_NAMES * (MAX_NAME + 1) + 8];
+    if (entering.count) notify_all(msg, render_crowd(&entering, "enter the arena", msg), bin, frame_crowd(&entering, 0, bin), 0);
+    if (leaving.count) notify_all(msg, render_crowd(&leaving, "leave", msg), bin, frame_crowd(&leaving, 1, bin), 0);
+    entering.count = leaving.count = 0;
+}
+
+/*
+ * Render an announcement such as "**alice, bob and 37 others enter the arena**"
+*/
+short render_crowd(Crowd *crowd, char *verb, char msg[]) {
+    short n = sprintf(msg, "**");
+    short named = (crowd->count < BCAST_NAMES) ? crowd->count:BCAST_NAMES;
+    if (crowd->count > BCAST_NAMES) named--; // Room for "and N others"
+    for (short i = 0; i < named; i++) {
+        n += sprintf(msg + n, "%s%s", crowd->names[i], (i + 1 == named) ? "":((i + 2 == named && named == crowd->count) ? " and ":", "));
+    }
+    if (crowd->count > named) n += sprintf(msg + n, " and %d others", crowd->count - named);
+    if (crowd->count == 1) { // Same as the forking server
+        if (!strcmp(verb, "leave")) return n + sprintf(msg + n, " leaves**\r\n");
+        return n + sprintf(msg + n, " enters the arena**\r\n");
+    }
+    return n + sprintf(msg + n, " %s**\r\n", verb);
+}
+
+/*
+ * Frame an announcement for binary clients, kind 0 for arrivals and 1 for departures
+*/
+short frame_crowd(Crowd *crowd, char kind, char out[]) {
+    char payload[BCAST_NAMES * (MAX_NAME + 1) + 3] = {kind, crowd->count >> 8, crowd->count & 0xff};
+    short n = 3, named = (crowd->count < BCAST_NAMES) ? crowd->count:BCAST_NAMES;
+    for (short i = 0; i < named; i++) {
+        payload[n] = strlen(crowd->names[i]);
+        memcpy(payload + n + 1, crowd->names[i], payload[n]);
+        n += payload[n] + 1;
+    }
+    return frame(out, F_LOBBY, payload, n);
+}
+
+/*
+ * Monotonic clock in milliseconds
+*/
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Start the thread's timing wheel at the current tick
+*/
+void wheel_init() {
+    wheel.now = now_ms() / TIMER_TICK;
+    for (short l = 0; l < WHEEL_LEVELS; l++) {
+        for (short i = 0; i < WHEEL_SLOTS; i++) wheel.slot[l][i].prev = wheel.slot[l][i].next = &wheel.slot[l][i];
+    }
+}
+
+/*
+ * Link a timer in the slot of the lowest level spanning its due tick
+*/
+void wheel_place(Timer *timer) {
+    long long delta = timer->due - wheel.now;
+    short level = 0;
+    if (delta < 0) timer->due = wheel.now; // Late, runs with the next tick
+    if (delta >= 1LL << (WHEEL_BITS * WHEEL_LEVELS)) timer->due = wheel.now + (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1; // Too far, clamped
+    while (level < WHEEL_LEVELS - 1 && delta >= 1LL << (WHEEL_BITS * (level + 1))) level++;
+    Timer *head = &wheel.slot[level][(timer->due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/*
+ * Arm (or rearm) a timer to fire in ms
+*/
+void timer_arm(Timer *timer, int ms, void (*fire)(Timer *timer)) {
+    timer_cancel(timer);
+    timer->due = (now_ms() + ms + TIMER_TICK - 1) / TIMER_TICK;
+    timer->fire = fire;
+    timer->armed = 1;
+    wheel.count++;
+    wheel_place(timer);
+}
+
+/*
+ * Disarm a timer, if armed
+*/
+void timer_cancel(Timer *timer) {
+    if (!timer->armed) return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->armed = 0;
+    wheel.count--;
+}
+
+/*
+ * Run every tick up to now, firing the timers due
+*/
+void wheel_run() {
+    long long target = now_ms() / TIMER_TICK;
+    if (!wheel.count) { // Nothing to go through
+        wheel.now = target + 1;
+        return;
+    }
+    while (wheel.now <= target) {
+        short idx = wheel.now & (WHEEL_SLOTS - 1);
+        for (short l = 1; !idx && l < WHEEL_LEVELS; l++) { // Bring the next span of the level above down
+            idx = (wheel.now >> (WHEEL_BITS * l)) & (WHEEL_SLOTS - 1);
+            Timer *head = &wheel.slot[l][idx], *t = head->next;
+            head->prev = head->next = head;
+            while (t != head) {
+                Timer *next = t->next;
+                wheel_place(t);
+                t = next;
+            }
+        }
+        Timer *head = &wheel.slot[0][wheel.now & (WHEEL_SLOTS - 1)];
+        wheel.now++; // Timers armed while firing land on the next tick at the earliest
+        while (head->next != head) {
+            Timer *t = head->next;
+            timer_cancel(t);
+            t->fire(t);
+        }
+    }
+}
+
+/*
+ * ms until the next tick with timers to fire (or to bring down), -1 if none is armed
+*/
+int wheel_timeout() {
+    if (!wheel.count) return -1;
+    long long tick = wheel.now;
+    do {
+        Timer *head = &wheel.slot[0][tick & (WHEEL_SLOTS - 1)];
+        if (head->next != head) break;
+    } while (++tick & (WHEEL_SLOTS - 1));
+    long long ms = tick * TIMER_TICK - now_ms();
+    return (ms > 0) ? ms:0;
+}
+
+/*
+ * A registering client did not send its name in time
+*/
+void register_timeout(Timer *timer) {
+    Clientptr client = OWNER(timer, Client);
+    registerlist = poll_client(registerlist, client);
+    if (!reactor) FD_CLR(client->soc, &regiset);
+    STAT_ADD(clients[S_REGISTER], -1);
+    STAT_ADD(dropped[D_LOGIN], 1);
+    remove_client(client, 0);
+}
+
+/*
+ * A lobby client stayed silent for too long
+*/
+void idle_timeout(Timer *timer) {
+    Clientptr client = OWNER(timer, Client);
+    unqueue_client(client);
+    STAT_ADD(dropped[D_IDLE], 1);
+    tell(client, IDLE_MSG, IDLE_MSG_LEN, F_NOTICE, &(char) {N_IDLE}, 1);
+    if (reactor) flush_client(client); // Before the queue is dropped
+    remove_client(client, 1);
+}
+
+/*
+ * The turn is over, the late battlers attack, or forfeit after missing too many turns
+*/
+void move_timeout(Timer *timer) {
+    Battle *b = OWNER(timer, Battle);
+    for (short i = 0; i < 2; i++) { // Cut speeches short
+        Clientptr c = i ? b->c2:b->c1;
+        if (!c->speaking) continue;
+        c->speaking = 0;
+        c->inhead = c->inlen = c->inscan = 0; // Not moves
+    }
+    short late[2] = {!b->mov[0], !b->mov[1]};
+    if (late[0] && ++b->c1->missed >= MOVE_MISSES) b->c1->hp = 0;
+    if (late[1] && ++b->c2->missed >= MOVE_MISSES) b->c2->hp = 0;
+    if (b->c1->hp < 1 || b->c2->hp < 1) {
+        close_battle(b);
+        return;
+    }
+    for (short i = 0; i < 2; i++) {
+        if (!late[i]) continue;
+        b->late |= i ? J_LATE_C2:J_LATE_C1;
+        tell(i ? b->c2:b->c1, TIME_MSG, TIME_MSG_LEN, F_NOTICE, &(char) {N_TIME}, 1);
+        pick(b, i, 'a');
+    }
+}
+
+/*
+ * Probe an idle connection, so a peer that vanished shows up as an error instead of silence
+*/
+void keep_alive(int soc) {
+    int yes = 1, idle = KEEP_IDLE, intvl = KEEP_INTVL, cnt = KEEP_CNT;
+    unsigned timeout = (KEEP_IDLE + KEEP_INTVL * KEEP_CNT) * 1000; // Unacknowledged output, same bound
+    if (setsockopt(soc, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) == -1 ||
+        setsockopt(soc, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == -1 ||
+        setsockopt(soc, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) == -1 ||
+        setsockopt(soc, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) == -1 ||
+        setsockopt(soc, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) == -1) fprintf(stderr, "%s/setsockopt: %s\n", __func__, strerror(errno));
+}
+
+/*
+ * Serve the metrics on a unix socket, from a thread of their own
+*/
+void serve_stats(char *path) {
+    static int soc;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", __func__);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path); // Left by a former run
+    if ((soc = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 || bind(soc, (struct sockaddr *) &addr, sizeof(addr)) || listen(soc, 16)) {
+        fprintf(stderr, "%s/socket: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old); // Signals are for the server's threads
+    pthread_t tid;
+    if ((errno = pthread_create(&tid, NULL, stats_loop, &soc))) fprintf(stderr, "%s/pthread_create: %s\n", __func__, strerror(errno));
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Dump the metrics to every connection, then close it
+*/
+void *stats_loop(void *arg) {
+    int soc = *(int *) arg;
+    static char out[STATS_MAX];
+    while (1) {
+        int c = accept(soc, NULL, NULL);
+        if (c == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) fprintf(stderr, "%s/accept: %s\n", __func__, strerror(errno));
+            continue;
+        }
+        int n = render_stats(out, sizeof(out)), sent = 0, k;
+        while (sent < n && (k = write(c, out + sent, n - sent)) > 0) sent += k;
+        close(c);
+    }
+    return NULL;
+}
+
+/*
+ * Render the metrics summed over the slots, in the Prometheus text format
+*/
+int render_stats(char out[], int max) {
+    static Stats sum; // Only the stats thread renders
+    memset(&sum, 0, sizeof(sum));
+    for (short i = 0; i < STAT_SLOTS; i++) {
+        Stats *s = &statslots[i];
+        sum.accepts += atomic_load_explicit(&s->accepts, memory_order_relaxed);
+        sum.bytes_in += atomic_load_explicit(&s->bytes_in, memory_order_relaxed);
+        sum.bytes_out += atomic_load_explicit(&s->bytes_out, memory_order_relaxed);
+        sum.spam += atomic_load_explicit(&s->spam, memory_order_relaxed);
+        sum.battles += atomic_load_explicit(&s->battles, memory_order_relaxed);
+        for (short j = 0; j < 3; j++) {
+            sum.dropped[j] += atomic_load_explicit(&s->dropped[j], memory_order_relaxed);
+            sum.shed[j] += atomic_load_explicit(&s->shed[j], memory_order_relaxed);
+            if (j < 2) sum.chat[j] += atomic_load_explicit(&s->chat[j], memory_order_relaxed);
+            sum.clients[j] += atomic_load_explicit(&s->clients[j], memory_order_relaxed);
+        }
+        sum.clients[S_WATCH] += atomic_load_explicit(&s->clients[S_WATCH], memory_order_relaxed);
+        for (short j = 0; j < HIST_BUCKETS; j++) {
+            sum.queue_wait.count[j] += atomic_load_explicit(&s->queue_wait.count[j], memory_order_relaxed);
+            sum.turn.count[j] += atomic_load_explicit(&s->turn.count[j], memory_order_relaxed);
+        }
+        sum.queue_wait.sum += atomic_load_explicit(&s->queue_wait.sum, memory_order_relaxed);
+        sum.turn.sum += atomic_load_explicit(&s->turn.sum, memory_order_relaxed);
+    }
+    int n = snprintf(out, max,
+        "# HELP battle_accepts_total Connections accepted.\n# TYPE battle_accepts_total counter\nbattle_accepts_total %llu\n"
+        "# HELP battle_clients Connected clients by state.\n# TYPE battle_clients gauge\n"
+        "battle_clients{state=\"registering\"} %lld\nbattle_clients{state=\"queued\"} %lld\nbattle_clients{state=\"battle\"} %lld\nbattle_clients{state=\"watching\"} %lld\n"
+        "# HELP battle_battles Battles running.\n# TYPE battle_battles gauge\nbattle_battles %lld\n"
+        "# HELP battle_bytes_total Bytes read from and written to clients.\n# TYPE battle_bytes_total counter\n"
+        "battle_bytes_total{direction=\"in\"} %llu\nbattle_bytes_total{direction=\"out\"} %llu\n"
+        "# HELP battle_dropped_total Clients dropped by the server.\n# TYPE battle_dropped_total counter\n"
+        "battle_dropped_total{reason=\"slow\"} %llu\nbattle_dropped_total{reason=\"idle\"} %llu\nbattle_dropped_total{reason=\"login_timeout\"} %llu\n"
+        "# HELP battle_spam_kicked_total Battlers that lost for spamming.\n# TYPE battle_spam_kicked_total counter\nbattle_spam_kicked_total %llu\n"
+        "# HELP battle_connections_shed_total New connections turned away.\n# TYPE battle_connections_shed_total counter\n"
+        "battle_connections_shed_total{reason=\"full\"} %llu\nbattle_connections_shed_total{reason=\"rate\"} %llu\nbattle_connections_shed_total{reason=\"peer\"} %llu\n"
+        "# HELP battle_chat_lines_total Chat lines, said or dropped for the chat rate.\n# TYPE battle_chat_lines_total counter\n"
+        "battle_chat_lines_total{outcome=\"said\"} %llu\nbattle_chat_lines_total{outcome=\"limited\"} %llu\n",
+        (unsigned long long) sum.accepts, (long long) sum.clients[S_REGISTER], (long long) sum.clients[S_LOBBY], (long long) sum.clients[S_BATTLE], (long long) sum.clients[S_WATCH],
+        (long long) sum.battles, (unsigned long long) sum.bytes_in, (unsigned long long) sum.bytes_out,
+        (unsigned long long) sum.dropped[D_SLOW], (unsigned long long) sum.dropped[D_IDLE], (unsigned long long) sum.dropped[D_LOGIN], (unsigned long long) sum.spam,
+        (unsigned long long) sum.shed[SH_FULL], (unsigned long long) sum.shed[SH_RATE], (unsigned long long) sum.shed[SH_PEER],
+        (unsigned long long) sum.chat[0], (unsigned long long) sum.chat[1]);
+    if (n >= max) return max;
+    n += render_hist(out + n, max - n, "battle_queue_wait_seconds", "Time matched clients waited in the queue.", &sum.queue_wait);
+    if (n >= max) return max;
+    n += render_hist(out + n, max - n, "battle_turn_latency_seconds", "Time from the event deciding a turn to the turn resolved.", &sum.turn);
+    if (journal && n < max) {
+        n += snprintf(out + n, max - n, "# HELP battle_journal_records_total Battle records by fate.\n# TYPE battle_journal_records_total counter\n"
+            "battle_journal_records_total{fate=\"written\"} %llu\nbattle_journal_records_total{fate=\"dropped\"} %llu\n"
+            "battle_journal_records_total{fate=\"failed\"} %llu\n",
+            (unsigned long long) atomic_load(&journal->written), (unsigned long long) atomic_load(&journal->dropped),
+            (unsigned long long) atomic_load(&journal->failed));
+    }
+    return (n < max) ? n:max;
+}
+
+/*
+ * Render a histogram, a bucket for the upper bound of each nonempty one
+*/
+int render_hist(char out[], int max, char *name, char *help, Hist *h) {
+    int n = snprintf(out, max, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    unsigned long long total = 0;
+    for (short i = 0; i < HIST_BUCKETS && n < max; i++) {
+        if (!h->count[i]) continue;
+        total += h->count[i];
+        long long top = (i < 1 << HIST_SUB) ? i:(((long long) (1 << HIST_SUB) + (i & ((1 << HIST_SUB) - 1)) + 1) << ((i >> HIST_SUB) - 1)) - 1;
+        n += snprintf(out + n, max - n, "%s_bucket{le=\"%.6f\"} %llu\n", name, top / 1e6, total);
+    }
+    if (n < max) n += snprintf(out + n, max - n, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n", name, total, name, h->sum / 1e6, name, total);
+    return n;
+}
+
+/*
+ * Count a value in a histogram, buckets are 2^HIST_SUB per power of 2
+*/
+void hist_add(Hist *h, long long us) {
+    if (us < 0) us = 0;
+    short i = us;
+    if (us >= 1 << HIST_SUB) {
+        short top = 63 - __builtin_clzll(us); // Power of 2
+        i = ((top - HIST_SUB + 1) << HIST_SUB) + ((us >> (top - HIST_SUB)) & ((1 << HIST_SUB) - 1));
+    }
+    if (i >= HIST_BUCKETS) i = HIST_BUCKETS - 1;
+    atomic_fetch_add_explicit(&h->count[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+}
+
+/*
+ * Monotonic clock in microseconds
+*/
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+#ifdef TRACE
+/*
+ * Map the trace rings and take the first TSC reading, SIGUSR1 dumps them from now on
+*/
+void open_trace() {
+    traces = mmap(NULL, sizeof(Trace) * TRACE_RINGS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (traces == MAP_FAILED) {
+        fprintf(stderr, "%s/mmap: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    tsc0_us = now_us();
+    tsc0 = tsc();
+    trace_thread(0);
+    struct sigaction action;
+    action.sa_handler = trace_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &action, NULL) < 0) fprintf(stderr, "%s/sigaction/USR1: %s\n", __func__, strerror(errno));
+}
+
+/*
+ * Give the running thread (or forked battle) its ring
+*/
+void trace_thread(short tid) {
+    trace = &traces[tid % TRACE_RINGS];
+    tracepid = getpid();
+    tracetid = tid;
+}
+
+/*
+ * Time stamp counter, the monotonic clock in ns where there is none
+ * Spans of different cores compare as long as the TSC is invariant (constant_tsc, nonstop_tsc)
+*/
+uint64_t tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Record a span from start to now in the thread's ring, overwriting the oldest
+ * The slot is marked in writing so a concurrent dump skips it
+*/
+void trace_span(uint64_t start, short what) {
+    uint64_t end = tsc();
+    if (!trace) return; // A thread that is not traced
+    uint64_t pos = atomic_fetch_add_explicit(&trace->head, 1, memory_order_relaxed); // Forked battles share the ring
+    Span *s = &trace->span[pos & (TRACE_SPANS - 1)];
+    atomic_store_explicit(&s->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->start = start;
+    s->ticks = end - start;
+    s->pid = tracepid;
+    s->tid = tracetid;
+    s->what = what;
+    atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+}
+
+/*
+ * Ask for a trace dump, done by the main loop (shard 0)
+*/
+void trace_handler(int sig) {
+    int saved = errno;
+    dumptrace = 1;
+    if (shards) wake(&shards[0]);
+    errno = saved;
+}
+
+/*
+ * Write the rings out from a thread of its own, the event loop goes on
+*/
+void dump_trace() {
+    dumptrace = 0;
+    if (atomic_exchange(&dumping, 1)) return; // One dump at a time
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old); // Signals are for the server's threads
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&tid, &attr, trace_loop, NULL); // errno is the event loop's
+    if (err) {
+        fprintf(stderr, "%s/pthread_create: %s\n", __func__, strerror(err));
+        atomic_store(&dumping, 0);
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Dump every span still in the rings to TRACE_FILE as Chrome trace (Perfetto) JSON, times in us
+*/
+void *trace_loop(void *arg) {
+    FILE *f = fopen(TRACE_FILE ".tmp", "w");
+    if (!f) {
+        fprintf(stderr, "%s/fopen: %s: %s\n", __func__, TRACE_FILE ".tmp", strerror(errno));
+        atomic_store(&dumping, 0);
+        return NULL;
+    }
+    static const char *what[] = {"wait", "accept", "register", "match", "fork", "reap", "turn_info", "resolve", "settle", "broadcast", "write", "flush", "speak"};
+    double rate = (double) (tsc() - tsc0) / (now_us() - tsc0_us); // Ticks per us, measured over the whole run
+    unsigned long long count = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (short r = 0; r < TRACE_RINGS; r++) {
+        Trace *t = &traces[r];
+        uint64_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+        for (uint64_t pos = (head > TRACE_SPANS) ? head - TRACE_SPANS:0; pos < head; pos++) {
+            Span *s = &t->span[pos & (TRACE_SPANS - 1)];
+            if (atomic_load_explicit(&s->seq, memory_order_acquire) != pos + 1) continue; // In writing, or overwritten already
+            Span copy = {.start = s->start, .ticks = s->ticks, .pid = s->pid, .tid = s->tid, .what = s->what};
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&s->seq, memory_order_relaxed) != pos + 1) continue; // Overwritten while copied
+            if (copy.what < 0 || copy.what >= (short) (sizeof(what) / sizeof(what[0]))) continue;
+            fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", count++ ? ",":"",
+                what[copy.what], copy.pid, copy.tid, (copy.start - tsc0) / rate, copy.ticks / rate);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) || rename(TRACE_FILE ".tmp", TRACE_FILE) == -1) fprintf(stderr, "%s/write: %s: %s\n", __func__, TRACE_FILE, strerror(errno));
+    else fprintf(stderr, "%s: %llu spans dumped to %s\n", __func__, count, TRACE_FILE);
+    atomic_store(&dumping, 0);
+    return NULL;
+}
+#endif
+
+/*
+ * Open the battle journal and start its writer, every battle from now on is recorded
+*/
+void open_journal(char *dir) {
+    char path[PATH_MAX];
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "%s/mkdir: %s: %s\n", __func__, dir, strerror(errno));
+        exit(1);
+    }
+    journal = mmap(NULL, sizeof(Journal), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (journal == MAP_FAILED) {
+        fprintf(stderr, "%s/mmap: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    for (unsigned i = 0; i < JOURNAL_RING; i++) atomic_init(&journal->slot[i].seq, i);
+    journaldir = dir;
+    // Ids go on from the last reservation, a crash skips the unused ones instead of reusing them
+    uint64_t next = 1;
+    snprintf(path, sizeof(path), "%s/%s", dir, JOURNAL_NEXT);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        if (read(fd, &next, sizeof(next)) != sizeof(next)) next = 1;
+        close(fd);
+    }
+    atomic_init(&journal->nextid, next);
+    reserve_ids(next + JOURNAL_IDS);
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old); // Signals are for the server's threads
+    pthread_t tid;
+    if ((errno = pthread_create(&tid, NULL, journal_loop, NULL))) {
+        fprintf(stderr, "%s/pthread_create: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Write out queued records, a batch at a time with one sync for all of it (group commit)
+*/
+void *journal_loop(void *arg) {
+    static char batch[JOURNAL_BATCH];
+    unsigned long long seg = 0;
+    long long segbytes = 0;
+    int fd = -1;
+    short failed = 0; // A batch was lost
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = JOURNAL_COMMIT * 1000000L};
+    while (1) {
+        uint64_t pos = atomic_load_explicit(&journal->head, memory_order_relaxed), taken = 0;
+        size_t n = 0;
+        while (n + JR_MAX <= JOURNAL_BATCH) { // Published records, in order
+            Jslot *slot = &journal->slot[pos & (JOURNAL_RING - 1)];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) break;
+            memcpy(batch + n, slot->rec, slot->len);
+            n += slot->len;
+            atomic_store_explicit(&slot->seq, pos + JOURNAL_RING, memory_order_release);
+            pos++;
+            taken++;
+        }
+        atomic_store_explicit(&journal->head, pos, memory_order_relaxed);
+        if (n) {
+            if (fd == -1 || segbytes + (long long) n > JOURNAL_SEGMENT) { // Records never span segments
+                if ((fd = next_segment(fd, &seg)) == -1) return NULL;
+                segbytes = JOURNAL_MAGIC_LEN;
+            }
+            size_t done = 0;
+            while (done < n) {
+                ssize_t k = write(fd, batch + done, n - done);
+                if (k == -1 && errno == EINTR) continue;
+                if (k == -1) {
+                    fprintf(stderr, "%s/write: %s\n", __func__, strerror(errno));
+                    break;
+                }
+                done += k;
+            }
+            if (done < n) { // No torn record for the next batch to follow
+                if (ftruncate(fd, segbytes) == -1) {
+                    fprintf(stderr, "%s/ftruncate: %s\n", __func__, strerror(errno));
+                    if ((fd = next_segment(fd, &seg)) == -1) return NULL;
+                    segbytes = JOURNAL_MAGIC_LEN;
+                }
+            }
+            else {
+                segbytes += n;
+                if (fdatasync(fd) == -1) fprintf(stderr, "%s/fdatasync: %s\n", __func__, strerror(errno));
+                else {
+                    atomic_fetch_add_explicit(&journal->written, taken, memory_order_relaxed);
+                    if (!failed) atomic_store_explicit(&journal->synced, pos, memory_order_release);
+                    taken = 0;
+                }
+            }
+            if (taken) { // Lost, whatever follows is not durable as a whole anymore
+                atomic_fetch_add_explicit(&journal->failed, taken, memory_order_relaxed);
+                failed = 1;
+            }
+        }
+        else if (!failed) atomic_store_explicit(&journal->synced, pos, memory_order_release);
+        uint64_t next = atomic_load_explicit(&journal->nextid, memory_order_relaxed);
+        if (next + JOURNAL_IDS / 2 > atomic_load_explicit(&journal->reserved, memory_order_relaxed)) reserve_ids(next + JOURNAL_IDS);
+        if (n + JR_MAX <= JOURNAL_BATCH) nanosleep(&pause, NULL); // Not a full batch, let more gather
+    }
+    return NULL;
+}
+
+/*
+ * Close a segment and start the next one, numbered after any in the directory, return its fd or -1
+*/
+int next_segment(int fd, unsigned long long *seg) {
+    char path[PATH_MAX];
+    if (fd != -1) close(fd); // Synced with its last batch
+    if (!*seg) { // First of this run, after those of former runs
+        DIR *dir = opendir(journaldir);
+        struct dirent *e;
+        while (dir && (e = readdir(dir))) {
+            unsigned long long n;
+            if (sscanf(e->d_name, "%llu.jnl", &n) == 1 && n > *seg) *seg = n;
+        }
+        if (dir) closedir(dir);
+    }
+    do snprintf(path, sizeof(path), "%s/%016llu.jnl", journaldir, ++*seg); // Taken by a successor writing alongside
+    while ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644)) == -1 && errno == EEXIST);
+    if (fd == -1 || write(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != JOURNAL_MAGIC_LEN) {
+        fprintf(stderr, "%s/open: %s: %s\n", __func__, path, strerror(errno));
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Record on disk that battle ids up to upto are taken
+*/
+void reserve_ids(uint64_t upto) {
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    snprintf(path, sizeof(path), "%s/%s", journaldir, JOURNAL_NEXT);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || write(fd, &upto, sizeof(upto)) != sizeof(upto) || fdatasync(fd) == -1 || rename(tmp, path) == -1) {
+        fprintf(stderr, "%s: %s: %s\n", __func__, path, strerror(errno));
+    }
+    if (fd != -1) close(fd);
+    atomic_store_explicit(&journal->reserved, upto, memory_order_relaxed);
+}
+
+/*
+ * Id of a new battle, 0 when not journaling
+*/
+uint64_t journal_id() {
+    if (!journal) return 0;
+    return atomic_fetch_add_explicit(&journal->nextid, 1, memory_order_relaxed);
+}
+
+/*
+ * Queue a record for the writer, it is lost rather than waited for if the queue is full
+*/
+void journal_put(char rec[], short len) {
+    uint64_t pos = atomic_load_explicit(&journal->tail, memory_order_relaxed);
+    Jslot *slot;
+    while (1) {
+        slot = &journal->slot[pos & (JOURNAL_RING - 1)];
+        int64_t dif = (int64_t) atomic_load_explicit(&slot->seq, memory_order_acquire) - (int64_t) pos;
+        if (dif < 0) { // Full
+            atomic_fetch_add_explicit(&journal->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        if (dif > 0) pos = atomic_load_explicit(&journal->tail, memory_order_relaxed); // Lost the slot, retry
+        else if (atomic_compare_exchange_weak_explicit(&journal->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+    }
+    memcpy(slot->rec, rec, len);
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/*
+ * Wall clock in microseconds, for records
+*/
+uint64_t journal_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Record who battles whom
+*/
+void journal_start(Clientptr c1, Clientptr c2) {
+    if (!journal) return;
+    char rec[JR_MAX];
+    short n = JR_HEAD, r1 = c1->rating, r2 = c2->rating;
+    Clientptr both[2] = {c1, c2};
+    for (short i = 0; i < 2; i++) {
+        rec[n] = strlen(both[i]->name);
+        memcpy(rec + n + 1, both[i]->name, rec[n]);
+        n += rec[n] + 1;
+    }
+    memcpy(rec + n, &r1, 2);
+    memcpy(rec + n + 2, &r2, 2);
+    n += 4;
+    jr_head(rec, n, J_START, c1->battleid, journal_us());
+    journal_put(rec, n);
+}
+
+/*
+ * Record a resolved turn
+*/
+void journal_turn(Clientptr c1, Clientptr c2, char mov1, char mov2, short late) {
+    if (!journal) return;
+    char rec[JR_HEAD + 11];
+    short n = jr_head(rec, sizeof(rec), J_TURN, c1->battleid, journal_us());
+    char turn[11] = {mov1, mov2, rule_dmg(mov1, mov2), rule_dmg(mov2, mov1), c1->hp, c2->hp, c1->pow, c1->blc, c2->pow, c2->blc, late};
+    memcpy(rec + n, turn, sizeof(turn));
+    journal_put(rec, sizeof(rec));
+}
+
+/*
+ * Record a speech
+*/
+void journal_chat(Clientptr speaker, char text[], short n) {
+    if (!journal) return;
+    char rec[JR_MAX];
+    if (n > JR_MAX - JR_HEAD - 1) n = JR_MAX - JR_HEAD - 1;
+    short at = jr_head(rec, JR_HEAD + 1 + n, J_CHAT, speaker->battleid, journal_us());
+    rec[at] = speaker->side;
+    memcpy(rec + at + 1, text, n);
+    journal_put(rec, JR_HEAD + 1 + n);
+}
+
+/*
+ * Record a battler losing for spamming
+*/
+void journal_spam(Clientptr spammer) {
+    if (!journal || !spammer->battleid) return;
+    char rec[JR_HEAD + 1];
+    rec[jr_head(rec, sizeof(rec), J_SPAM, spammer->battleid, journal_us())] = spammer->side;
+    journal_put(rec, sizeof(rec));
+}
+
+/*
+ * Record the outcome of a battle
+*/
+void journal_end(Clientptr c1, Clientptr c2, short result) {
+    if (!journal) return;
+    char rec[JR_HEAD + 2];
+    short n = jr_head(rec, sizeof(rec), J_END, c1->battleid, journal_us());
+    rec[n] = result;
+    rec[n + 1] = (c1->gone ? J_GONE_C1:0) | (c2->gone ? J_GONE_C2:0);
+    journal_put(rec, sizeof(rec));
+}
+
+/*
+ * Wait (a second at most) for the journal writer to have every queued record on disk
+*/
+void journal_settle() {
+    struct timespec ms = {.tv_sec = 0, .tv_nsec = 1000000L};
+    for (short i = 0; journal && i < 1000; i++) {
+        if (atomic_load_explicit(&journal->synced, memory_order_acquire) == atomic_load(&journal->tail)) return;
+        nanosleep(&ms, NULL);
+    }
+}
+
+/*
+ * Ask for a hot restart, done by the main loop (shard 0)
+*/
+void restart_handler(int sig) {
+    restart = 1;
+    if (shards) wake(&shards[0]);
+}
+
+/*
+ * Exec the server binary again and hand it the listeners and every client out of a battle
+ * Battles finish here, their battlers follow as they end, then this server exits
+*/
+void restart_server() {
+    restart = 0;
+    if (handing || handoff_soc != -1) { // One restart at a time
+        fprintf(stderr, "%s: a hot restart is under way\n", __func__);
+        return;
+    }
+    int pair[2], size = 2 * HANDOFF_MAX;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) {
+        fprintf(stderr, "%s/socketpair: %s\n", __func__, strerror(errno));
+        return;
+    }
+    if (setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1) fprintf(stderr, "%s/setsockopt: %s\n", __func__, strerror(errno));
+    // Built before forking, the child of a threaded server can only make async-signal-safe calls
+    extern char **environ;
+    int count = 0;
+    while (environ[count]) count++;
+    char **env = malloc(sizeof(char *) * (count + 2)), var[32];
+    memcpy(env, environ, sizeof(char *) * count);
+    snprintf(var, sizeof(var), "%s=%d", HANDOFF_ENV, pair[1]);
+    env[count] = var;
+    env[count + 1] = NULL;
+    pid_t pid = fork();
+    if (!pid) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL); // Kept across exec
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC); // Clients are passed explicitly
+        fcntl(pair[1], F_SETFD, 0);
+        execvpe(args[0], args, env);
+        _exit(127);
+    }
+    free(env);
+    close(pair[1]);
+    char ready = -1;
+    struct pollfd p = {.fd = pair[0], .events = POLLIN};
+    if (pid < 0 || poll(&p, 1, HANDOFF_WAIT) != 1 || recv(pair[0], &ready, 1, 0) != 1 || ready != H_READY) {
+        fprintf(stderr, "%s: successor did not start: %s\n", __func__, (pid < 0) ? strerror(errno):"not ready");
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        close(pair[0]);
+        return;
+    }
+    successor = pair[0];
+    atomic_store(&handing, 1);
+    accepting(0);
+    Handoff h = {.kind = H_LISTEN};
+    char ctl[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    struct iovec iov = {.iov_base = &h, .iov_len = sizeof(h)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = CMSG_SPACE(nlisten * sizeof(int))};
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(nlisten * sizeof(int));
+    memcpy(CMSG_DATA(cm), listeners, nlisten * sizeof(int));
+    if (sendmsg(successor, &msg, 0) == -1) { // Keep serving
+        fprintf(stderr, "%s/sendmsg: %s\n", __func__, strerror(errno));
+        atomic_store(&handing, 0);
+        accepting(1);
+        close(successor);
+        successor = -1;
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    if (!reactor) {
+        drain_clients();
+        return;
+    }
+    for (short i = 0; i < nshard; i++) { // Each shard hands over its own clients
+        shards[i].drain.type = M_DRAIN;
+        post(&shards[i], &shards[i].drain);
+    }
+}
+
+/*
+ * Start or stop accepting new clients, on every shard
+ * With -r listener j belongs to shard j % nshard, otherwise each listener is on every shard
+*/
+void accepting(short on) {
+    for (short j = 0; j < nlisten; j++) {
+        if (!reactor) {
+            if (on) FD_SET(listeners[j], &regiset);
+            else FD_CLR(listeners[j], &regiset);
+            continue;
+        }
+        // Level triggered, each wakeup accepts a batch and leaves the rest to the other shards
+        struct epoll_event ev = {.events = EPOLLIN | ((!spread && nshard > 1) ? EPOLLEXCLUSIVE:0), .data.fd = LISTEN_TAG(listeners[j])};
+        for (short i = 0; i < nshard; i++) {
+            if (spread && i != j % nshard) continue;
+            if (epoll_ctl(shards[i].epfd, on ? EPOLL_CTL_ADD:EPOLL_CTL_DEL, listeners[j], &ev) == -1) fprintf(stderr, "%s/epoll_ctl: %s\n", __func__, strerror(errno));
+        }
+    }
+}
+
+/*
+ * Hand the registering and lobby clients of this shard over, and exit once the battles end
+*/
+void drain_clients() {
+    while (registerlist) {
+        Clientptr c = registerlist;
+        registerlist = poll_client(registerlist, c);
+        if (!reactor) FD_CLR(c->soc, &regiset);
+        STAT_ADD(clients[S_REGISTER], -1);
+        if (c->relay) remove_client(c, 0); // The relaying node takes its player back
+        else hand_over(c, NULL, -1);
+    }
+    while (matchingclient) {
+        Clientptr c = matchingclient;
+        unqueue_client(c);
+        c->state = C_LOBBY; // Not kept up by the forking server
+        hand_over(c, NULL, -1);
+    }
+    for (Battle *b = battlelist; b; b = b->next) { // Spectators, the battles finish here
+        while (b->watchers) {
+            Clientptr c = b->watchers;
+            unwatch(c);
+            hand_over(c, NULL, -1);
+        }
+    }
+    timer_cancel(&matchtimer);
+    timer_arm(&draintimer, DRAIN_TICK, drain_tick);
+}
+
+/*
+ * Exit once no client is left here, nor on its way between shards
+*/
+void drain_tick(Timer *timer) {
+    long long live = 0;
+    for (short i = 0; i < STAT_SLOTS; i++) {
+        for (short j = 0; j < 4; j++) live += atomic_load_explicit(&statslots[i].clients[j], memory_order_relaxed);
+    }
+    for (short i = 0; i < nshard; i++) {
+        if (atomic_load(&shards[i].inbox) || atomic_load(&shards[i].head) != atomic_load(&shards[i].tail)) live++;
+    }
+    if (live > 0) {
+        timer_arm(timer, DRAIN_TICK, drain_tick);
+        return;
+    }
+    journal_settle();
+    exit(0);
+}
+
+/*
+ * Pass clients and their sockets to the successor, with the result of the battle they leave (-1 if none)
+ * They are gone from this server afterwards
+*/
+void hand_over(Clientptr c1, Clientptr c2, short result) {
+    char buf[HANDOFF_MAX], ctl[CMSG_SPACE(2 * sizeof(int))];
+    Handoff *h = (Handoff *) buf;
+    Clientptr both[2] = {c1, c2};
+    int fds[2];
+    size_t n = sizeof(Handoff);
+    memset(h, 0, sizeof(Handoff));
+    h->kind = H_CLIENTS;
+    h->result = result;
+    h->count = c2 ? 2:1;
+    for (short i = 0; i < h->count; i++) {
+        Clientptr c = both[i];
+        Handed *d = &h->c[i];
+        timer_cancel(&c->timer);
+        if (reactor && c->state != C_MOVING && epoll_ctl(epfd, EPOLL_CTL_DEL, c->soc, NULL) == -1) fprintf(stderr, "%s/epoll_ctl: %s\n", __func__, strerror(errno));
+        if (reactor) flush_client(c); // What the socket takes now needs no copy
+        memcpy(d->name, c->name, sizeof(d->name));
+        d->state = (result >= 0) ? C_BATTLE:((c->state == C_MOVING) ? C_LOBBY:c->state);
+        d->hp = c->hp;
+        d->hello = c->hello;
+        d->binary = c->binary;
+        d->gone = c->gone;
+        d->player = c->player;
+        d->rating = c->rating;
+        memcpy(d->recent, c->recent, sizeof(d->recent));
+        d->recentpos = c->recentpos;
+        d->queued_at = c->queued_at;
+        d->inlen = reactor ? c->inlen:0;
+        for (short j = 0; j < d->inlen; j++) d->in[j] = c->in[(c->inhead + j) & (IN_RING - 1)];
+        d->outlen = 0;
+        for (short j = 0; reactor && j < c->outn; j++) {
+            Outbuf *chunk = c->out[(c->outhead + j) % OUT_SEGS];
+            int off = j ? 0:c->outoff;
+            memcpy(buf + n, chunk->data + off, chunk->len - off);
+            n += chunk->len - off;
+            d->outlen += chunk->len - off;
+        }
+        fds[i] = c->soc;
+    }
+    struct iovec iov = {.iov_base = buf, .iov_len = n};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = CMSG_SPACE(h->count * sizeof(int))};
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(h->count * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, h->count * sizeof(int));
+    ssize_t sent;
+    while ((sent = sendmsg(successor, &msg, 0)) == -1 && errno == EINTR);
+    if (sent == -1) fprintf(stderr, "%s/sendmsg: %s\n", __func__, strerror(errno)); // Lost along with the successor
+    for (short i = 0; i < h->count; i++) remove_client(both[i], 0); // The successor announces departures
+}
+
+/*
+ * Tell the predecessor this server is ready and take its listening sockets, return the first
+*/
+int take_listener() {
+    Handoff h;
+    char ctl[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    struct iovec iov = {.iov_base = &h, .iov_len = sizeof(h)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl)};
+    if (send(handoff_soc, &(char) {H_READY}, 1, 0) != 1 || recvmsg(handoff_soc, &msg, 0) < (ssize_t) sizeof(short) || h.kind != H_LISTEN) {
+        fprintf(stderr, "%s: no listener from the predecessor: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm && cm->cmsg_type == SCM_RIGHTS) nlisten = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (nlisten < 1) {
+        fprintf(stderr, "%s: no listener from the predecessor\n", __func__);
+        exit(1);
+    }
+    memcpy(listeners, CMSG_DATA(cm), nlisten * sizeof(int));
+    return listeners[0];
+}
+
+/*
+ * Take the clients the predecessor handed over so far, return the highest socket taken
+*/
+int take_handoff() {
+    static char buf[HANDOFF_MAX]; // Only the main thread (shard 0) takes them
+    char ctl[CMSG_SPACE(2 * sizeof(int))];
+    Handoff *h = (Handoff *) buf;
+    int top = -1;
+    while (1) {
+        struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl)};
+        ssize_t n = recvmsg(handoff_soc, &msg, MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) return top;
+        if (n < (ssize_t) sizeof(Handoff)) { // The predecessor is done
+            if (n == -1) fprintf(stderr, "%s/recvmsg: %s\n", __func__, strerror(errno));
+            if (!reactor) FD_CLR(handoff_soc, &regiset);
+            int soc = handoff_soc;
+            handoff_soc = -1;
+            close(soc);
+            return top;
+        }
+        int fds[2] = {-1, -1};
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (cm && cm->cmsg_type == SCM_RIGHTS) memcpy(fds, CMSG_DATA(cm), cm->cmsg_len - CMSG_LEN(0));
+        Clientptr c[2] = {NULL, NULL};
+        char *out = buf + sizeof(Handoff);
+        for (short i = 0; i < h->count && i < 2; i++) {
+            if (fds[i] == -1) continue;
+            c[i] = adopt_client(fds[i], &h->c[i], out);
+            out += h->c[i].outlen;
+            if (fds[i] > top) top = fds[i];
+        }
+        if (h->result >= 0 && c[0] && c[1]) rate_battle(c[0], c[1], h->result);
+        for (short i = 0; i < h->count && i < 2; i++) {
+            if (!c[i] || h->c[i].state != C_BATTLE) continue;
+            if (c[i]->gone) remove_client(c[i], 1); // Left during the battle
+            else {
+                c[i]->state = C_LOBBY;
+                queue_client(c[i]);
+            }
+        }
+        _match();
+    }
+}
+
+/*
+ * Rebuild a client handed over by the predecessor, out its output not sent yet
+*/
+Clientptr adopt_client(int soc, Handed *h, char out[]) {
+    Clientptr client = (reactor || soc < FD_SETSIZE) ? init_client(soc):NULL; // Out of select()'s reach otherwise
+    if (!client) { // Out of client slots
+        close(soc);
+        return NULL;
+    }
+    memcpy(client->name, h->name, sizeof(client->name));
+    client->hp = h->hp;
+    client->hello = h->hello;
+    client->binary = h->binary;
+    client->gone = h->gone;
+    client->player = h->player;
+    client->rating = h->rating;
+    memcpy(client->recent, h->recent, sizeof(client->recent));
+    client->recentpos = h->recentpos;
+    client->adopted = 1;
+    memcpy(client->in, h->in, h->inlen);
+    client->inlen = h->inlen;
+    if (reactor) {
+        if (fcntl(soc, F_SETFL, O_NONBLOCK) == -1) fprintf(stderr, "%s/fcntl: %s\n", __func__, strerror(errno));
+        attach(client);
+    }
+    if (h->outlen) send_client(client, out, h->outlen);
+    if (h->state != C_REGISTER && !claim_name(client)) { // A newcomer registered the name meanwhile, another is asked for
+        h->state = C_REGISTER; // Not queued after its battle either
+        client->inhead = client->inlen = client->inscan = 0; // Lobby lines, not a name
+        name_taken(client);
+    }
+    if (h->state == C_REGISTER) {
+        registerlist = add_client(registerlist, client);
+        STAT_ADD(clients[S_REGISTER], 1);
+        if (!reactor) FD_SET(soc, &regiset);
+        timer_arm(&client->timer, REGISTER_TIMEOUT, register_timeout); // Prompted by the predecessor
+    }
+    else if (h->state == C_LOBBY) {
+        client->state = C_LOBBY;
+        queue_client(client);
+        client->queued_at = h->queued_at; // Keeps its widened window
+    }
+    if (reactor && h->state != C_BATTLE) client_input(client); // Input that came meanwhile, or was handed over
+    return client;
+}
+
+
+/*
+ * Join the federation, the coordinator is a unix socket path or an IPv4 address:port
+*/
+void open_federation(char *where) {
+    struct sockaddr_un un = {.sun_family = AF_UNIX};
+    struct sockaddr_in in = {.sin_family = AF_INET};
+    char host[64];
+    int at = 0, soc;
+    if (strchr(where, '/')) {
+        if (strlen(where) >= sizeof(un.sun_path)) {
+            fprintf(stderr, "%s: socket path too long\n", __func__);
+            exit(1);
+        }
+        strcpy(un.sun_path, where);
+    }
+    else if (sscanf(where, "%63[^:]:%d", host, &at) != 2 || inet_pton(AF_INET, host, &in.sin_addr) != 1) {
+        fprintf(stderr, "%s: %s is neither a socket path nor address:port\n", __func__, where);
+        exit(1);
+    }
+    in.sin_port = htons(at);
+    if ((soc = socket(un.sun_path[0] ? AF_UNIX:AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+        || connect(soc, un.sun_path[0] ? (struct sockaddr *) &un:(struct sockaddr *) &in, un.sun_path[0] ? sizeof(un):sizeof(in)) == -1) {
+        fprintf(stderr, "%s/connect: %s: %s\n", __func__, where, strerror(errno));
+        exit(1);
+    }
+    fedsoc = soc;
+    fed_send("node %s %d\n", fedaddr, port);
+}
+
+/*
+ * Send the coordinator a line, from any shard
+*/
+void fed_send(const char *fmt, ...) {
+    char line[FED_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap), sent = 0, k = 0;
+    va_end(ap);
+    if (n >= (int) sizeof(line)) return;
+    pthread_mutex_lock(&fedlock);
+    while (fedsoc != -1 && sent < n && ((k = write(fedsoc, line + sent, n - sent)) > 0 || errno == EINTR)) if (k > 0) sent += k;
+    pthread_mutex_unlock(&fedlock);
+}
+
+/*
+ * Offer a client nobody here matched to the other nodes, it stays in the lobby meanwhile
+*/
+void fed_offer(Clientptr client) {
+    client->offered = 1;
+    fed_send("offer %d %s\n", client->rating, client->name);
+}
+
+/*
+ * Take the lines the coordinator sent (shard 0)
+*/
+void fed_read() {
+    static char buf[FED_LINE * 4];
+    static int len;
+    ssize_t n = read(fedsoc, buf + len, sizeof(buf) - len);
+    if (n == -1 && errno == EINTR) return;
+    if (n <= 0) { // Alone from now on, the offers went with the connection
+        fprintf(stderr, "%s: %s, leaving the federation\n", __func__, n ? strerror(errno):"coordinator gone");
+        if (epoll_ctl(epfd, EPOLL_CTL_DEL, fedsoc, NULL) == -1) fprintf(stderr, "%s/epoll_ctl: %s\n", __func__, strerror(errno));
+        pthread_mutex_lock(&fedlock);
+        close(fedsoc);
+        fedsoc = -1;
+        pthread_mutex_unlock(&fedlock);
+        return;
+    }
+    len += n;
+    char *line = buf, *end;
+    while ((end = memchr(line, '\n', buf + len - line))) {
+        *end = '\0';
+        fed_command(line);
+        line = end + 1;
+    }
+    len -= line - buf;
+    memmove(buf, line, len);
+    if (len == sizeof(buf)) len = 0; // No line end in sight, drop it
+}
+
+/*
+ * Pass a pairing on to the shard of the player paired
+*/
+void fed_command(char *line) {
+    unsigned long long key;
+    int at = 0, n = 0;
+    char name[MAX_NAME + 1];
+    if (atomic_load_explicit(&handing, memory_order_relaxed)) return; // The other node gives up on its own
+    if (sscanf(line, "host %llu %n", &key, &at) == 1 && at) snprintf(name, sizeof(name), "%s", line + at);
+    else if (sscanf(line, "join %llu %*s %*d %d %n", &key, &n, &at) == 2 && at && n > 0 && n <= MAX_NAME && (int) strlen(line + at) > n) {
+        memcpy(name, line + at, n);
+        name[n] = '\0';
+    }
+    else {
+        fprintf(stderr, "%s: bad line from the coordinator: %.40s\n", __func__, line);
+        return;
+    }
+    short home = -1;
+    if (!find_name(name, &home) || home == -1) return; // Gone, or on its way to another shard and withdrawn
+    Msg *msg = slab_get(&msgslab);
+    if (!msg) return; // Pool empty, the other side times out
+    msg->type = M_FED;
+    msg->battle = key;
+    memcpy(msg->name, name, sizeof(msg->name));
+    snprintf(msg->line, sizeof(msg->line), "%s", line);
+    post(&shards[home], msg);
+}
+
+/*
+ * Take a client paired by the coordinator out of the lobby, to host the battle or relay it to the host
+*/
+void fed_paired(Msg *msg) {
+    short home = -1;
+    Clientptr client = find_name(msg->name, &home);
+    if (!client || home != shard->id || !in_lobby(client)) return; // Matched here meanwhile, the other side times out
+    client->offered = 0; // Off the coordinator's queue already
+    unqueue_client(client);
+    client->state = C_FED;
+    client->fedkey = msg->battle;
+    STAT_ADD(clients[S_BATTLE], 1);
+    timer_arm(&client->timer, FED_WAIT, fed_timeout);
+    if (msg->line[0] == 'j') open_relay(client, msg->line);
+}
+
+/*
+ * Connect to the hosting node and introduce the client there, its input goes through as is
+*/
+void open_relay(Clientptr client, char *line) {
+    char addr[64], hello[HELLO_LEN + FED_LINE];
+    int to = 0, n = 0, at = 0;
+    struct sockaddr_in host = {.sin_family = AF_INET};
+    sscanf(line, "join %*u %63s %d %d %n", addr, &to, &n, &at);
+    host.sin_port = htons(to);
+    int soc = (at && inet_pton(AF_INET, addr, &host.sin_addr) == 1) ? socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0):-1;
+    if (soc != -1 && connect(soc, (struct sockaddr *) &host, sizeof(host)) == -1 && errno != EINPROGRESS) {
+        fprintf(stderr, "%s/connect: %s:%d: %s\n", __func__, addr, to, strerror(errno));
+        close(soc);
+        soc = -1;
+    }
+    Clientptr link = (soc != -1) ? init_client(soc):NULL;
+    if (!link) {
+        if (soc != -1) close(soc);
+        fed_release(client);
+        return;
+    }
+    keep_alive(soc);
+    link->state = C_FED;
+    link->relay = RL_LINK;
+    link->hello = 1; // The host prompts it as text first, like any newcomer
+    link->link = client;
+    client->link = link;
+    attach(link); // Writable once connected
+    memcpy(hello, FED_HELLO, HELLO_LEN);
+    short len = snprintf(hello + HELLO_LEN, FED_LINE, "%llu %d %d %d %s%s\n", (unsigned long long) client->fedkey, client->binary, client->rating, (int) strlen(client->name), client->name, line + at + n);
+    send_client(link, hello, HELLO_LEN + len);
+}
+
+/*
+ * Introduce a relayed player of another node (its first line), then battle it against the player kept for it
+*/
+void relay_guest(Clientptr client) {
+    char line[MAX_LINE + 1];
+    unsigned long long key;
+    int binary, rating, len, at = 0;
+    short n = take_line(client, line, MAX_LINE);
+    if (!n && !client->eof) return;
+    registerlist = poll_client(registerlist, client);
+    STAT_ADD(clients[S_REGISTER], -1);
+    timer_cancel(&client->timer);
+    line[n] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!n || sscanf(line, "%llu %d %d %d %n", &key, &binary, &rating, &len, &at) != 4 || !at || len < 1 || len > MAX_NAME
+        || (int) strlen(line + at) <= len || strlen(line + at) - len > MAX_NAME) {
+        remove_client(client, 0);
+        return;
+    }
+    memcpy(client->name, line + at, len);
+    client->name[len] = '\0';
+    client->hp = len;
+    client->binary = binary != 0;
+    client->rating = rating;
+    client->player = 0; // Rated by its own node
+    client->fedkey = key;
+    memset(client->recent, 0, sizeof(client->recent));
+    client->recentpos = 0;
+    client->state = C_FED;
+    short home = -1;
+    Clientptr rival = find_name(line + at + len, &home);
+    if (rival && home != -1 && home != shard->id) { // Only its shard can take the player kept
+        Msg *msg = slab_get(&msgslab);
+        if (!msg) { // Pool empty, sent away
+            host_guest(client, NULL);
+            return;
+        }
+        detach(client);
+        msg->type = M_CHALLENGE;
+        msg->to = home;
+        msg->c1 = client;
+        snprintf(msg->name, sizeof(msg->name), "%s", line + at + len);
+        msg->next = outbox;
+        outbox = msg;
+        return;
+    }
+    host_guest(client, (home == shard->id) ? rival:NULL);
+}
+
+/*
+ * Start the battle of a guest and the player kept for its key, or send the guest away
+*/
+void host_guest(Clientptr guest, Clientptr rival) {
+    if (!rival || rival->state != C_FED || rival->relay || rival->link || rival->fedkey != guest->fedkey) {
+        remove_client(guest, 0); // Kept too long or gone, the relaying node takes its player back
+        return;
+    }
+    timer_cancel(&rival->timer);
+    rival->fedkey = 0;
+    STAT_ADD(clients[S_BATTLE], -1);
+    rival->state = guest->state = C_LOBBY;
+    queue_client(rival);
+    queue_client(guest);
+    pair_clients(guest, rival, now_ms());
+}
+
+/*
+ * Input of a client out of the lobby for the federation
+*/
+void fed_input(Clientptr client) {
+    if (client->relay == RL_LINK) {
+        relay_frames(client);
+        return;
+    }
+    if (client->relay == RL_GUEST) { // Battle over, only waiting for the hang up
+        client->inhead = client->inlen = client->inscan = 0;
+        if (client->eof) remove_client(client, 0);
+        return;
+    }
+    while (client->link && client->inlen) { // A relayed player's input goes to the host as is
+        short n = (client->inhead + client->inlen > IN_RING) ? IN_RING - client->inhead:client->inlen;
+        send_client(client->link, client->in + client->inhead, n);
+        client->inhead = (client->inhead + n) & (IN_RING - 1);
+        client->inlen -= n;
+        if (!client->inlen) fill_input(client);
+    }
+    if (!client->eof) return; // A player kept for a guest keeps its input for the battle
+    if (client->link && !client->timer.armed) { // Gone mid battle, the host settles it and still sends the result
+        timer_arm(&client->timer, MOVE_TIMEOUT + FED_WAIT, fed_timeout);
+        mark_dirty(client->link);
+        return;
+    }
+    if (client->link) { // Disconnected client, its battle is lost
+        client->link->link = NULL;
+        remove_client(client->link, 0);
+        client->link = NULL;
+    }
+    timer_cancel(&client->timer);
+    STAT_ADD(clients[S_BATTLE], -1);
+    remove_client(client, 1);
+}
+
+/*
+ * Pass the hosting node's output on to the relayed player, then its result
+*/
+void relay_frames(Clientptr link) {
+    unsigned char *in = (unsigned char *) link->in;
+    char payload[MAX_LINE + 1];
+    while (!link->eof || link->inlen) {
+        if (link->hello) { // The text prompt, before the frames
+            if (link->inlen < NAME_MSG_LEN) fill_input(link);
+            if (link->inlen < NAME_MSG_LEN) break;
+            link->inhead = (link->inhead + NAME_MSG_LEN) & (IN_RING - 1);
+            link->inlen -= NAME_MSG_LEN;
+            link->hello = 0;
+        }
+        if (link->inlen < 3) fill_input(link);
+        if (link->inlen < 3) break;
+        short len = in[link->inhead] << 8 | in[(link->inhead + 1) & (IN_RING - 1)];
+        if (len < 1 || len > MAX_LINE + 1) { // Not from a node
+            link->eof = 1;
+            break;
+        }
+        if (link->inlen < len + 2) fill_input(link);
+        if (link->inlen < len + 2) break;
+        char type = in[(link->inhead + 2) & (IN_RING - 1)];
+        for (short i = 0; i < len - 1; i++) payload[i] = in[(link->inhead + 3 + i) & (IN_RING - 1)];
+        link->inhead = (link->inhead + len + 2) & (IN_RING - 1);
+        link->inlen -= len + 2;
+        Clientptr player = link->link;
+        if (!player) continue;
+        if (type == F_RELAY && !player->eof) {
+            if (player->timer.armed) timer_cancel(&player->timer); // The battle started
+            send_client(player, payload, len - 1);
+        }
+        else if (type == F_RATED && len == 6) {
+            player->rating = (int32_t) ((uint32_t) (unsigned char) payload[1] << 24 | (unsigned char) payload[2] << 16 | (unsigned char) payload[3] << 8 | (unsigned char) payload[4]);
+            record_player(player, payload[0]);
+        }
+    }
+    if (link->eof) relay_end(link);
+}
+
+/*
+ * Close a relay, its player goes back to the lobby
+*/
+void relay_end(Clientptr link) {
+    Clientptr player = link->link;
+    link->link = NULL;
+    remove_client(link, 0);
+    if (!player) return;
+    player->link = NULL;
+    fed_release(player);
+}
+
+/*
+ * Put a player back in the lobby once out of the federation's battle (or its pairing fell through)
+*/
+void fed_release(Clientptr client) {
+    timer_cancel(&client->timer);
+    client->fedkey = 0;
+    client->state = C_LOBBY;
+    STAT_ADD(clients[S_BATTLE], -1);
+    if (client->eof) { // Left during the battle, rated now
+        remove_client(client, 1);
+        return;
+    }
+    if (atomic_load_explicit(&handing, memory_order_relaxed)) {
+        hand_over(client, NULL, -1);
+        return;
+    }
+    queue_client(client);
+    if (client->inlen) lobby_input(client); // Typed meanwhile
+    _match();
+}
+
+/*
+ * A pairing of the federation took too long, or a finished guest was not hung up on
+*/
+void fed_timeout(Timer *timer) {
+    Clientptr client = OWNER(timer, Client);
+    if (client->relay == RL_GUEST) {
+        remove_client(client, 0);
+        return;
+    }
+    if (client->link) { // The relay never got going
+        client->link->link = NULL;
+        remove_client(client->link, 0);
+        client->link = NULL;
+    }
+    fed_release(client);
+}
+
+/*
+ * Tell the relaying node how its player did, unwrapped, then hang up once sent
+*/
+void relay_rated(Clientptr guest, char outcome) {
+    char payload[5] = {outcome, guest->rating >> 24, guest->rating >> 16, guest->rating >> 8, guest->rating}, out[8];
+    queue_output(guest, out, frame(out, F_RATED, payload, sizeof(payload)));
+}
+
+
+/*
+ * Fork a battle worker of the pool, return its channel (-1 if none)
+ * Forked with the server's state at the time, it keeps none of its sockets
+*/
+int spawn_worker(Worker *w) {
+    int pair[2];
+    w->soc = -1;
+    w->battles = 0;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) {
+        fprintf(stderr, "%s/socketpair: %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    pid_t pid = fork();
+    if (!pid) worker_loop(pair[1]); // Never returns
+    close(pair[1]);
+    if (pid < 0) {
+        fprintf(stderr, "%s/fork: %s\n", __func__, strerror(errno));
+        close(pair[0]);
+        return -1;
+    }
+    w->pid = pid;
+    w->soc = pair[0];
+    FD_SET(w->soc, &regiset);
+    return w->soc;
+}
+
+/*
+ * Give a battle to the least busy worker with both sockets, return 0 if none took it
+*/
+short pool_battle(Clientptr c1, Clientptr c2) {
+    Worker *w = NULL;
+    for (short i = 0; i < nworker; i++) {
+        if (workers[i].soc != -1 && (!w || workers[i].battles < w->battles)) w = &workers[i];
+    }
+    if (!w) return 0;
+    Battle *b = init_battle(w->pid, c1, c2);
+    Job job;
+    Clientptr both[2] = {c1, c2};
+    int fds[2] = {c1->soc, c2->soc};
+    char ctl[CMSG_SPACE(2 * sizeof(int))];
+    memset(&job, 0, sizeof(job));
+    job.battle = slab_handle(&battleslab, b);
+    for (short i = 0; i < 2; i++) {
+        memcpy(job.c[i].name, both[i]->name, sizeof(job.c[i].name));
+        job.c[i].rating = both[i]->rating;
+        job.c[i].chat = both[i]->chat;
+    }
+    struct iovec iov = {.iov_base = &job, .iov_len = sizeof(job)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl)};
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    ssize_t sent;
+    while ((sent = sendmsg(w->soc, &msg, 0)) == -1 && errno == EINTR);
+    if (sent == -1) { // Its end is read next, as a lost worker
+        fprintf(stderr, "%s/sendmsg: %s\n", __func__, strerror(errno));
+        slab_put(&battleslab, b);
+        return 0;
+    }
+    battlelist = add_battle(battlelist, b);
+    STAT_ADD(battles, 1);
+    STAT_ADD(clients[S_BATTLE], 2);
+    w->battles++;
+    return 1;
+}
+
+/*
+ * Settle the battles a worker reported, return its new channel if it was lost and replaced
+*/
+int take_reports(Worker *w) {
+    static Report r; // Only the main thread reads the pool
+    while (1) {
+        ssize_t n = recv(w->soc, &r, sizeof(r), MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) return -1;
+        if (n < (ssize_t) sizeof(r)) { // Crashed, or killed
+            if (n == -1) fprintf(stderr, "%s/recv: %s\n", __func__, strerror(errno));
+            return lose_worker(w);
+        }
+        Battle *b = (r.battle < MAX_BATTLES) ? slab_at(&battleslab, r.battle):NULL;
+        if (!b || b->pid != w->pid) continue; // Not one it was given
+        Clientptr both[2] = {b->c1, b->c2};
+        w->battles--;
+        for (short i = 0; i < 2; i++) { // The worker made them nonblocking, the socket is shared
+            if (fcntl(both[i]->soc, F_SETFL, 0) == -1) fprintf(stderr, "%s/fcntl: %s\n", __func__, strerror(errno));
+            if (r.outcome >= 0) both[i]->chat = r.chat[i];
+        }
+        TRACE_BEGIN(reaped);
+        finish_battle(b, r.outcome);
+        TRACE_END(reaped, SP_REAP);
+        for (short i = 0; i < 2 && r.outcome >= 0 && !handing; i++) { // Back in the lobby, what it typed meanwhile is for it
+            if (!(r.outcome & (i ? GONE_C2:GONE_C1)) && r.inlen[i] > 0 && in_lobby(both[i])) lobby_lines(both[i], r.in[i], r.inlen[i]);
+        }
+        _match(); // An ended battle implies a new match
+    }
+}
+
+/*
+ * End the battles of a worker that died unrated, as a crashed battle child's, and fork another
+*/
+int lose_worker(Worker *w) {
+    FD_CLR(w->soc, &regiset);
+    close(w->soc);
+    w->soc = -1;
+    for (Battle *b = battlelist, *next; b; b = next) {
+        next = b->next;
+        if (b->pid != w->pid) continue;
+        if (fcntl(b->c1->soc, F_SETFL, 0) == -1 || fcntl(b->c2->soc, F_SETFL, 0) == -1) fprintf(stderr, "%s/fcntl: %s\n", __func__, strerror(errno));
+        finish_battle(b, -1);
+    }
+    _match();
+    fprintf(stderr, "%s: worker %d lost\n", __func__, w->pid);
+    if (atomic_load_explicit(&handing, memory_order_relaxed)) return -1; // The successor has a pool of its own
+    return spawn_worker(w);
+}
+
+/*
+ * Run the battles the server gives on a reactor of this worker, until the server is gone
+*/
+void worker_loop(int soc) {
+    static Shard one;
+    close_range(3, soc - 1, 0); // Clients and listeners stay the server's
+    close_range(soc + 1, ~0U, 0);
+    poolsoc = soc;
+    reactor = 1;
+    nshard = 1;
+    nworker = 0;
+    shards = shard = &one;
+    shard->id = 0;
+    shard->evfd = -1;
+    battlelist = endedbattle = reportlist = NULL;
+    registerlist = matchedclient = matchingclient = deadclient = dirtylist = NULL;
+    if ((epfd = shard->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        fprintf(stderr, "%s/epoll_create1: %s\n", __func__, strerror(errno));
+        _exit(1);
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = soc};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, soc, &ev) == -1) {
+        fprintf(stderr, "%s/epoll_ctl: %s\n", __func__, strerror(errno));
+        _exit(1);
+    }
+#ifdef TRACE
+    trace_thread(0); // Spans of its battles go under its own pid
+#endif
+    wheel_init();
+    struct epoll_event evs[MAX_EVENTS];
+    while (1) {
+        TRACE_BEGIN(waited);
+        int n = epoll_wait(epfd, evs, MAX_EVENTS, wheel_timeout());
+        TRACE_END(waited, SP_WAIT);
+        woke_us = now_us();
+        if (n == -1) {
+            if (errno != EINTR) fprintf(stderr, "%s/epoll_wait: %s\n", __func__, strerror(errno));
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = evs[i].data.fd;
+            if (fd == soc) {
+                take_jobs();
+                continue;
+            }
+            Clientptr c = fdtab[fd];
+            if (!c || c->state != C_BATTLE) continue; // Settled, its output is going
+            if (evs[i].events & EPOLLOUT) mark_dirty(c);
+            if (evs[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) c->hup = c->gone = 1;
+            if (evs[i].events & EPOLLIN || c->hup) client_input(c);
+        }
+        wheel_run();
+        TRACE_BEGIN(flushed);
+        flush_dirty();
+        TRACE_END(flushed, SP_FLUSH);
+        report_battles();
+    }
+}
+
+/*
+ * Start the battles the server sent, exit once it hung up
+*/
+void take_jobs() {
+    Job job;
+    char ctl[CMSG_SPACE(2 * sizeof(int))];
+    while (1) {
+        struct iovec iov = {.iov_base = &job, .iov_len = sizeof(job)};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl)};
+        ssize_t n = recvmsg(poolsoc, &msg, MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+        if (n < (ssize_t) sizeof(job)) _exit(0); // Exited, its battles ended first
+        int fds[2] = {-1, -1};
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (cm && cm->cmsg_type == SCM_RIGHTS) memcpy(fds, CMSG_DATA(cm), cm->cmsg_len - CMSG_LEN(0));
+        Clientptr c[2] = {NULL, NULL};
+        for (short i = 0; i < 2; i++) {
+            if (fds[i] == -1 || !(c[i] = init_client(fds[i]))) continue;
+            memcpy(c[i]->name, job.c[i].name, sizeof(c[i]->name));
+            c[i]->rating = job.c[i].rating;
+            c[i]->chat = job.c[i].chat;
+            if (fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1) fprintf(stderr, "%s/fcntl: %s\n", __func__, strerror(errno));
+            attach(c[i]);
+        }
+        if (c[0] && c[1]) {
+            open_battle(c[0], c[1])->ref = job.battle; // Reported at the end of the iteration at the soonest
+            continue;
+        }
+        Report r = {.battle = job.battle, .outcome = -1}; // Out of client slots, not played
+        for (short i = 0; i < 2; i++) {
+            if (c[i]) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fds[i], NULL);
+                fdtab[fds[i]] = NULL;
+                slab_put(&clientslab, c[i]);
+            }
+            if (fds[i] != -1) close(fds[i]);
+        }
+        if (send(poolsoc, &r, sizeof(r), 0) == -1) fprintf(stderr, "%s/send: %s\n", __func__, strerror(errno));
+    }
+}
+
+/*
+ * Give the server back the battles settled whose battlers got all of their output, with what they typed past the end
+*/
+void report_battles() {
+    static Report r;
+    for (Battle *b = reportlist, *next; b; b = next) {
+        next = b->next;
+        Clientptr both[2] = {b->c1, b->c2};
+        if ((b->c1->outn && !b->c1->gone) || (b->c2->outn && !b->c2->gone)) continue; // Sent once writable
+        r.battle = b->ref;
+        r.outcome = b->result | (b->c1->gone ? GONE_C1:0) | (b->c2->gone ? GONE_C2:0);
+        for (short i = 0; i < 2; i++) {
+            Clientptr c = both[i];
+            r.inlen[i] = c->gone ? 0:c->inlen;
+            r.chat[i] = c->chat;
+            for (short j = 0; j < r.inlen[i]; j++) r.in[i][j] = c->in[(c->inhead + j) & (IN_RING - 1)];
+            timer_cancel(&c->timer);
+            drop_output(c);
+            if (epoll_ctl(epfd, EPOLL_CTL_DEL, c->soc, NULL) == -1) fprintf(stderr, "%s/epoll_ctl: %s\n", __func__, strerror(errno));
+            fdtab[c->soc] = NULL;
+            close(c->soc); // Before the report, the server has the socket alone once it reads it
+            slab_put(&clientslab, c);
+        }
+        timer_cancel(&b->timer);
+        reportlist = poll_battle(reportlist, b);
+        slab_put(&battleslab, b);
+        ssize_t sent;
+        while ((sent = send(poolsoc, &r, sizeof(r), 0)) == -1 && errno == EINTR);
+        if (sent == -1) _exit(0); // The server is gone
+    }
+}
+
+/*
+ * A settled battle's output did not go in time, its stalled battlers are dropped so that it is reported
+*/
+void drain_timeout(Timer *timer) {
+    Battle *b = OWNER(timer, Battle);
+    if (b->c1->outn && !b->c1->gone) drop_slow(b->c1);
+    if (b->c2->outn && !b->c2->gone) drop_slow(b->c2);
+}
@@ -0,0 +1,62 @@
+/*
+ * Battle simulator command line:
+ * Plays every pairing of the given strategies (all built in ones by default)
+ * and prints how often the row strategy wins against the column one.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "sim.h"
+
+#define MAX_STRATEGIES 32
+
+int main(int argc, char *argv[]) {
+    int opt, threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t battles = 1000000, seed = 1;
+    while ((opt = getopt(argc, argv, "n:j:S:")) != -1) {
+        if (opt == 'n') battles = strtoull(optarg, NULL, 10); // Per pairing
+        else if (opt == 'j') threads = atoi(optarg);
+        else if (opt == 'S') seed = strtoull(optarg, NULL, 10);
+        else {
+            fprintf(stderr, "usage: %s [-n battles] [-j threads] [-S seed] [strategy...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (threads < 1) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const Strategy *picked[MAX_STRATEGIES];
+    int count = 0;
+    for (int i = optind; i < argc && count < MAX_STRATEGIES; i++) {
+        if (!(picked[count++] = sim_strategy(argv[i]))) {
+            fprintf(stderr, "%s: unknown strategy %s, one of:", argv[0], argv[i]);
+            for (const Strategy *s = sim_strategies; s->name; s++) fprintf(stderr, " %s", s->name);
+            fprintf(stderr, "\n");
+            exit(1);
+        }
+    }
+    if (!count) for (const Strategy *s = sim_strategies; s->name && count < MAX_STRATEGIES; s++) picked[count++] = s;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t total = 0, turns = 0;
+    printf("Win %% of the row strategy (ties count half), %llu battles per pairing\n%-10s", (unsigned long long) battles, "");
+    for (int j = 0; j < count; j++) printf("%10s", picked[j]->name);
+    printf("\n");
+    for (int i = 0; i < count; i++) {
+        printf("%-10s", picked[i]->name);
+        for (int j = 0; j < count; j++) {
+            Result r;
+            sim_run(picked[i], picked[j], battles, threads, seed + (uint64_t) (i * count + j) * 0x100000000ULL, &r);
+            printf("%10.2f", r.battles ? (r.wins[0] + r.ties / 2.0) * 100 / r.battles:0);
+            fflush(stdout);
+            total += r.battles;
+            turns += r.turns;
+        }
+        printf("\n");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%llu battles, %.2f turns each, %.1fs on %d threads, %.1fM battles/s\n", (unsigned long long) total,
+        total ? (double) turns / total:0, secs, threads, secs > 0 ? total / secs / 1e6:0);
+    return 0;
+}
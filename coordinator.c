@@ -0,0 +1,256 @@
+/*
+ * Matchmaking coordinator of federated battle servers:
+ * Nodes (battle -c) offer the players they could not match among their own,
+ * the coordinator pairs offers of different nodes by rating, widening the
+ * accepted gap as they wait like the servers do, and tells the node of the
+ * older offer to host the battle and the other to relay its player there.
+ * The protocol is in federation.h. Listens on a unix socket path or a TCP port.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include "federation.h"
+
+#define MAX_NODES 256
+#define MAX_OFFERS 65536
+#define WINDOW 100 // Rating difference accepted right away
+#define WIDEN 50 // Rating difference added per second of waiting
+#define TICK 500 // ms between pairing passes, the windows widen meanwhile
+
+typedef struct Federatednode {
+    int soc; // -1 for a free slot
+    char addr[64]; // Where it takes relays, empty until it said
+    int port;
+    short stalled; // Did not take a line, dropped after the pairing pass
+    char in[FED_LINE * 4];
+    int inlen;
+} Node;
+
+typedef struct Playeroffer {
+    short node;
+    int rating;
+    long long since; // ms
+    char name[FED_NAME + 1];
+} Offer;
+
+int open_socket(char *where);
+void take_node(int listen_soc);
+void node_input(short i);
+void node_line(short i, char *line);
+void drop_node(short i);
+void drop_offer(int j);
+void pair_offers();
+void tell(short i, const char *line, int len);
+long long now_ms();
+
+Node nodes[MAX_NODES];
+Offer offers[MAX_OFFERS]; // Oldest first
+int noffers;
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s socket_path|port\n", argv[0]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN); // A node gone shows up as a read of 0
+    int listen_soc = open_socket(argv[1]);
+    struct pollfd fds[MAX_NODES + 1];
+    for (short i = 0; i < MAX_NODES; i++) nodes[i].soc = -1;
+    long long last = now_ms();
+    while (1) {
+        fds[0].fd = listen_soc;
+        fds[0].events = POLLIN;
+        for (short i = 0; i < MAX_NODES; i++) {
+            fds[i + 1].fd = nodes[i].soc; // Negative ones are skipped
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll(fds, MAX_NODES + 1, TICK) == -1) {
+            if (errno != EINTR) fprintf(stderr, "%s/poll: %s\n", __func__, strerror(errno));
+            continue;
+        }
+        if (fds[0].revents & POLLIN) take_node(listen_soc);
+        for (short i = 0; i < MAX_NODES; i++) {
+            if (nodes[i].soc != -1 && fds[i + 1].fd == nodes[i].soc && fds[i + 1].revents) node_input(i);
+        }
+        if (now_ms() - last >= TICK) { // Offers arriving pair themselves, widened windows need a pass
+            pair_offers();
+            last = now_ms();
+        }
+    }
+}
+
+/*
+ * Listen on a unix socket if given a path, on a TCP port otherwise
+*/
+int open_socket(char *where) {
+    int soc;
+    if (strchr(where, '/')) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(where) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "%s: socket path too long\n", __func__);
+            exit(1);
+        }
+        strcpy(addr.sun_path, where);
+        unlink(where); // Left by a former run
+        if ((soc = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 || bind(soc, (struct sockaddr *) &addr, sizeof(addr)) || listen(soc, 16)) {
+            fprintf(stderr, "%s/socket: %s\n", __func__, strerror(errno));
+            exit(1);
+        }
+        return soc;
+    }
+    int yes = 1;
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(atoi(where)), .sin_addr = {.s_addr = INADDR_ANY}};
+    if ((soc = socket(AF_INET, SOCK_STREAM, 0)) == -1 || setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))
+        || bind(soc, (struct sockaddr *) &addr, sizeof(addr)) || listen(soc, 16)) {
+        fprintf(stderr, "%s/socket: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    return soc;
+}
+
+/*
+ * Take a new node into a free slot
+*/
+void take_node(int listen_soc) {
+    int soc = accept(listen_soc, NULL, NULL);
+    if (soc == -1) {
+        if (errno != EINTR && errno != ECONNABORTED) fprintf(stderr, "%s/accept: %s\n", __func__, strerror(errno));
+        return;
+    }
+    for (short i = 0; i < MAX_NODES; i++) {
+        if (nodes[i].soc != -1) continue;
+        if (fcntl(soc, F_SETFL, O_NONBLOCK) == -1) fprintf(stderr, "%s/fcntl: %s\n", __func__, strerror(errno)); // A stalled node is not waited for
+        nodes[i].soc = soc;
+        nodes[i].stalled = 0;
+        nodes[i].addr[0] = '\0';
+        nodes[i].inlen = 0;
+        return;
+    }
+    fprintf(stderr, "%s: more than %d nodes\n", __func__, MAX_NODES);
+    close(soc);
+}
+
+/*
+ * Read what a node sent and act on its whole lines
+*/
+void node_input(short i) {
+    Node *node = &nodes[i];
+    ssize_t n = read(node->soc, node->in + node->inlen, sizeof(node->in) - node->inlen);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) return;
+    if (n <= 0) {
+        drop_node(i);
+        return;
+    }
+    node->inlen += n;
+    char *line = node->in, *end;
+    while ((end = memchr(line, '\n', node->in + node->inlen - line))) {
+        *end = '\0';
+        node_line(i, line);
+        if (node->soc == -1) return; // Dropped by the pairing pass
+        line = end + 1;
+    }
+    node->inlen -= line - node->in;
+    memmove(node->in, line, node->inlen);
+    if (node->inlen == sizeof(node->in)) node->inlen = 0; // No line end in sight, drop it
+}
+
+/*
+ * Act on a line of a node
+*/
+void node_line(short i, char *line) {
+    int rating, at = 0;
+    if (sscanf(line, "node %63s %d", nodes[i].addr, &nodes[i].port) == 2) return;
+    if (sscanf(line, "offer %d %n", &rating, &at) == 1 && at && line[at] && strlen(line + at) <= FED_NAME) {
+        for (int j = 0; j < noffers; j++) { // Offered again, it waits on from now
+            if (offers[j].node == i && !strcmp(offers[j].name, line + at)) drop_offer(j);
+        }
+        if (noffers == MAX_OFFERS) return; // Stays with its node
+        Offer *o = &offers[noffers++];
+        o->node = i;
+        o->rating = rating;
+        o->since = now_ms();
+        strcpy(o->name, line + at);
+        pair_offers();
+    }
+    else if (!strncmp(line, "withdraw ", 9)) {
+        for (int j = 0; j < noffers; j++) {
+            if (offers[j].node == i && !strcmp(offers[j].name, line + 9)) {
+                drop_offer(j);
+                break;
+            }
+        }
+    }
+    else fprintf(stderr, "%s: bad line from node %d: %.40s\n", __func__, i, line);
+}
+
+/*
+ * Forget a node and its offers
+*/
+void drop_node(short i) {
+    close(nodes[i].soc);
+    nodes[i].soc = -1;
+    for (int j = noffers - 1; j >= 0; j--) if (offers[j].node == i) drop_offer(j);
+}
+
+void drop_offer(int j) {
+    memmove(&offers[j], &offers[j + 1], (noffers - j - 1) * sizeof(Offer));
+    noffers--;
+}
+
+/*
+ * Pair offers of different nodes, the oldest first with the closest rating in its window
+*/
+void pair_offers() {
+    long long now = now_ms();
+    for (int i = 0; i < noffers; i++) {
+        Offer a = offers[i];
+        int window = WINDOW + (now - a.since) / 1000 * WIDEN, best = -1;
+        if (!nodes[a.node].addr[0] || nodes[a.node].stalled) continue; // Cannot host
+        for (int j = i + 1; j < noffers; j++) {
+            Offer *b = &offers[j];
+            if (b->node == a.node || nodes[b->node].stalled || abs(b->rating - a.rating) > window) continue;
+            if (best == -1 || abs(b->rating - a.rating) < abs(offers[best].rating - a.rating)) best = j;
+        }
+        if (best == -1) continue;
+        Offer b = offers[best]; // Both off the queue before telling, whatever the nodes do
+        drop_offer(best);
+        drop_offer(i--);
+        unsigned long long key;
+        if (getrandom(&key, sizeof(key), 0) != sizeof(key)) key = (unsigned long long) now << 20 ^ rand(); // Not guessed by a stranger
+        char line[FED_LINE];
+        int n = snprintf(line, sizeof(line), "host %llu %s\n", key, a.name);
+        tell(a.node, line, n);
+        n = snprintf(line, sizeof(line), "join %llu %s %d %d %s%s\n", key, nodes[a.node].addr, nodes[a.node].port, (int) strlen(b.name), b.name, a.name);
+        tell(b.node, line, n); // A host left waiting gives up after FED_WAIT
+    }
+    for (short i = 0; i < MAX_NODES; i++) if (nodes[i].soc != -1 && nodes[i].stalled) drop_node(i);
+}
+
+/*
+ * Send a node a line, a node that does not take it whole right away is marked to be dropped
+*/
+void tell(short i, const char *line, int len) {
+    int sent = 0, k;
+    if (nodes[i].stalled) return;
+    while (sent < len && ((k = write(nodes[i].soc, line + sent, len - sent)) > 0 || (k == -1 && errno == EINTR))) if (k > 0) sent += k;
+    if (sent < len) nodes[i].stalled = 1;
+}
+
+/*
+ * Monotonic clock in milliseconds
+*/
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,29 @@
+/*
+ * Federation protocol:
+ * Shared by the battle servers (nodes) and the coordinator that pairs
+ * the players they could not match among their own. Lines of text over
+ * a unix or TCP socket, a name always last as names may hold spaces.
+ * Node to coordinator:
+ *   node <addr> <port>       where the node takes relays, once connected
+ *   offer <rating> <name>    a player waiting unmatched on the node
+ *   withdraw <name>          matched or gone since
+ * Coordinator to node (the offers are taken off the queue):
+ *   host <key> <name>        keep the player for whoever brings the key
+ *   join <key> <addr> <port> <len> <name><host's name>
+ *                            relay the player (len bytes of name) to that node
+ * A relaying node connects to the host's port and sends FED_HELLO, then
+ * "<key> <binary> <rating> <len> <name><host's name>\n" and the player's
+ * input as is. The host prompts it as any newcomer (the 19 bytes of the text
+ * prompt, skipped), runs the battle and frames whatever it sends back
+ * (server frame 17, the bytes for the player), then frame 18 (the result
+ * as a binary protocol result, the new rating as 4 bytes big endian), and
+ * hangs up. Either side dropping the relay gives the player back to its lobby.
+*/
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#define FED_HELLO "\xb7" "FED1" // As long as the binary protocol's hello
+#define FED_LINE 256 // Bytes of the longest line
+#define FED_NAME 20 // Bytes of the longest name
+
+#endif
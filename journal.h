@@ -0,0 +1,56 @@
+/*
+ * Battle journal format:
+ * Shared by the server, which appends to it, and the replay tool.
+ * A journal is a directory of segments named by number, each starting
+ * with JOURNAL_MAGIC and followed by whole records, never rewritten.
+ * A record is a JR_HEAD byte head (length of the whole record, kind,
+ * battle id, time in us since the epoch) and a payload by kind, all in
+ * host byte order.
+*/
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define JOURNAL_MAGIC "BTLJRNL1"
+#define JOURNAL_MAGIC_LEN 8
+#define JOURNAL_NEXT "next" // File of the journal directory holding the battle ids reserved so far
+#define JR_HEAD 19
+#define JR_MAX 256 // Bytes of the longest record
+// Record kinds and their payloads
+#define J_START 1 // Name length and name of c1, then of c2, 2 byte ratings of c1 and c2
+#define J_TURN 2 // Moves of c1 and c2, damage dealt by c1 and c2, then hp, powers and blocks left of c1 and c2, J_LATE_* bits
+#define J_CHAT 3 // Speaker (0 for c1, 1 for c2), the speech
+#define J_SPAM 4 // Spammer (0 for c1, 1 for c2)
+#define J_END 5 // Result (0 tie, 1 c1 won, 2 c2 won), J_GONE_* bits
+#define J_LATE_C1 1 // Out of time, attacked for them
+#define J_LATE_C2 2
+#define J_GONE_C1 1 // Disconnected
+#define J_GONE_C2 2
+
+/*
+ * Write a record head, return the payload's offset
+*/
+static inline short jr_head(char rec[], short len, char kind, uint64_t battle, uint64_t us) {
+    uint16_t n = len;
+    memcpy(rec, &n, 2);
+    rec[2] = kind;
+    memcpy(rec + 3, &battle, 8);
+    memcpy(rec + 11, &us, 8);
+    return JR_HEAD;
+}
+
+/*
+ * Read a record head, return the record length, 0 if it is not a record
+*/
+static inline short jr_parse(const char rec[], char *kind, uint64_t *battle, uint64_t *us) {
+    uint16_t n;
+    memcpy(&n, rec, 2);
+    *kind = rec[2];
+    memcpy(battle, rec + 3, 8);
+    memcpy(us, rec + 11, 8);
+    return (n >= JR_HEAD && n <= JR_MAX) ? n:0;
+}
+
+#endif
@@ -0,0 +1,654 @@
+/*
+ * Load generator for the battle server:
+ * Connects many local clients, registers them, and plays their battles with
+ * scripted or random moves, reconnecting some after each battle. Reports
+ * matches per second, turn round trips, join latency and the server memory.
+ *
+ * A scenario file holds one "key value" per line, '#' starts a comment:
+ *     clients 1000     # bots connected at once
+ *     duration 30      # seconds measured, after the ramp
+ *     ramp 5           # seconds to bring every bot up
+ *     moves random     # or a script of a/p/b/s cycled through, e.g. aapbs
+ *     speak 0.05       # odds a random move is a speech
+ *     churn 0.1        # odds a bot reconnects after a battle
+ *     think 0 20       # ms a bot waits before moving, picked between the two
+ *     seed 1           # same seed, same moves and churn
+ *     port 56218
+ *     prefix lg        # bot names are prefix + index
+ * Command line options override the file.
+*/
+#define _GNU_SOURCE // memmem
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <dirent.h>
+
+#ifndef PORT
+    #define PORT 56218
+#endif
+
+#define MAX_BOTS 65536
+#define MAX_EVENTS 256 // epoll events per wakeup
+#define BOT_BUF 2048 // Bytes of server output a bot holds while looking for markers
+#define MARK_KEEP 64 // Bytes kept when no marker is found, markers can be split across reads
+#define MAX_SCRIPT 64
+#define MAX_PREFIX 12
+#define RETRY_MS 100 // ms before reconnecting after an error
+#define HIST_SUB 3 // Histogram precision, 2^HIST_SUB linear sub-buckets per power of 2
+#define HIST_BUCKETS 320
+#define SPEECH "gg\n"
+// Bot states
+#define L_IDLE 0 // Not connected
+#define L_CONNECT 1
+#define L_NAME 2 // Connected, registering
+#define L_LOBBY 3
+#define L_BATTLE 4
+// Pending bot actions
+#define A_NONE 0
+#define A_CONNECT 1
+#define A_MOVE 2
+#define A_SPEECH 3 // Send the speech line once prompted
+// Server output markers, in the order they are tested
+#define K_NAME 0
+#define K_WAIT 1
+#define K_ENGAGE 2
+#define K_MOVE 3
+#define K_SPEAK 4
+#define K_WIN 5
+#define K_LOSE 6
+#define K_TIE 7
+#define MARKS 8
+
+typedef struct Loadscenario {
+    int clients;
+    int duration; // s
+    int ramp; // s
+    char moves[MAX_SCRIPT]; // "random", or a move script
+    double speak;
+    double churn;
+    int think_min, think_max; // ms
+    unsigned seed;
+    int port;
+    char prefix[MAX_PREFIX];
+} Scenario;
+
+typedef struct Loadbot {
+    int soc;
+    int id;
+    short state;
+    short action; // Pending action, A_NONE when none
+    long long due; // us the action is due
+    int heappos; // Index in the action heap, -1 when not in it
+    int opp; // Opponent bot, -1 when not battling
+    short pow, blc; // Moves left, so no move is ever refused
+    unsigned step; // Next move of the script
+    long long joined; // us the connect started
+    long long moved; // us the move of this turn was sent, 0 before the first
+    int len;
+    char buf[BOT_BUF];
+} Bot;
+
+typedef struct Loadhist {
+    unsigned long long count[HIST_BUCKETS];
+    unsigned long long total;
+} Hist;
+
+static const char *marks[MARKS] = {"name?", "Awaiting next opponent", "You engage ", "(s)peak something\r\n\r\n",
+    "\r\nSpeak: ", "You win!", "You scurry away", "You achieve a tie!"};
+
+Scenario scn = {.clients = 100, .duration = 10, .ramp = 1, .moves = "random", .speak = 0.02, .churn = 0.05,
+    .think_min = 0, .think_max = 0, .seed = 1, .port = PORT, .prefix = "lg"};
+Bot *bots;
+Bot **heap; // Pending actions, earliest first
+int heaplen;
+int epfd;
+unsigned seed;
+struct sockaddr_in server;
+// Results
+Hist rtt, join;
+unsigned long long battles; // Battle ends seen, two per match
+unsigned long long connects, refused, drops, moves, speeches;
+int connected;
+volatile sig_atomic_t stop;
+
+void read_scenario(char *path);
+void usage(char *prog);
+void bot_connect(Bot *b);
+void bot_close(Bot *b, short retry);
+void bot_input(Bot *b);
+void bot_mark(Bot *b, short k, char *at, char *end);
+void bot_move(Bot *b);
+void bot_send(Bot *b, char *msg, int len);
+void turn_over(Bot *b);
+void schedule(Bot *b, short action, long long due);
+void heap_up(int i);
+void heap_down(int i);
+void heap_remove(Bot *b);
+int think();
+double chance();
+void hist_add(Hist *h, long long us);
+long long hist_pct(Hist *h, double pct);
+long server_rss(int pid);
+int find_server(int port);
+void report(double secs, int pid, long peak);
+long long now_us();
+void on_stop(int sig);
+
+int main(int argc, char *argv[]) {
+    int opt, pid = 0;
+    Scenario cli = {.clients = -1, .duration = -1, .ramp = -1, .port = -1};
+    while ((opt = getopt(argc, argv, "f:c:d:r:m:p:P:S:")) != -1) {
+        if (opt == 'f') read_scenario(optarg); // Scenario file
+        else if (opt == 'c') cli.clients = atoi(optarg);
+        else if (opt == 'd') cli.duration = atoi(optarg);
+        else if (opt == 'r') cli.ramp = atoi(optarg);
+        else if (opt == 'm') snprintf(cli.moves, MAX_SCRIPT, "%s", optarg);
+        else if (opt == 'p') cli.port = atoi(optarg);
+        else if (opt == 'P') pid = atoi(optarg); // Server process, for its memory
+        else if (opt == 'S') cli.seed = strtoul(optarg, NULL, 10);
+        else usage(argv[0]);
+    }
+    // Command line over the scenario file
+    if (cli.clients >= 0) scn.clients = cli.clients;
+    if (cli.duration >= 0) scn.duration = cli.duration;
+    if (cli.ramp >= 0) scn.ramp = cli.ramp;
+    if (cli.port >= 0) scn.port = cli.port;
+    if (*cli.moves) memcpy(scn.moves, cli.moves, MAX_SCRIPT);
+    if (cli.seed) scn.seed = cli.seed;
+    if (scn.clients < 1 || scn.clients > MAX_BOTS) {
+        fprintf(stderr, "%s: clients must be 1 to %d\n", argv[0], MAX_BOTS);
+        exit(1);
+    }
+    seed = scn.seed;
+    // Every bot needs a descriptor
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &lim) == -1) fprintf(stderr, "%s/setrlimit: %s\n", __func__, strerror(errno));
+    }
+    if (!pid) pid = find_server(scn.port);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_stop);
+    signal(SIGTERM, on_stop);
+    server.sin_family = AF_INET;
+    server.sin_port = htons(scn.port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        fprintf(stderr, "%s/epoll_create1: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    bots = calloc(scn.clients, sizeof(Bot));
+    heap = calloc(scn.clients, sizeof(Bot *));
+    if (!bots || !heap) {
+        fprintf(stderr, "%s/calloc: %s\n", __func__, strerror(errno));
+        exit(1);
+    }
+    long long start = now_us();
+    for (int i = 0; i < scn.clients; i++) { // Spread the connects over the ramp
+        bots[i].id = i;
+        bots[i].soc = -1;
+        bots[i].opp = -1;
+        bots[i].heappos = -1;
+        schedule(&bots[i], A_CONNECT, start + (long long) scn.ramp * 1000000 * i / scn.clients);
+    }
+    printf("%d clients on port %d, ramp %ds, measuring %ds, moves %s, server pid %d\n", scn.clients, scn.port, scn.ramp, scn.duration, scn.moves, pid);
+    // Measure from the end of the ramp
+    long long begin = start + scn.ramp * 1000000LL, end = begin + scn.duration * 1000000LL, tick = begin;
+    short measuring = 0;
+    long peak = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop) {
+        long long now = now_us();
+        if (!measuring && now >= begin) { // Ramp done, start over the results
+            memset(&rtt, 0, sizeof(Hist));
+            battles = moves = speeches = 0;
+            measuring = 1;
+        }
+        if (now >= end) break;
+        if (measuring && now >= tick) { // Progress, once a second
+            long rss = server_rss(pid);
+            if (rss > peak) peak = rss;
+            if (tick > begin) printf("%3llds: %d connected, %llu matches, rss %ld kB\n", (tick - begin) / 1000000, connected, battles / 2, rss);
+            tick += 1000000;
+        }
+        while (heaplen && heap[0]->due <= now) { // Due actions
+            Bot *b = heap[0];
+            short action = b->action;
+            heap_remove(b);
+            if (action == A_CONNECT) bot_connect(b);
+            else if (action == A_MOVE) bot_move(b);
+            else if (action == A_SPEECH) {
+                bot_send(b, SPEECH, sizeof(SPEECH) - 1);
+                bot_move(b); // The speech took no turn
+            }
+        }
+        long long wait = tick - now;
+        if (heaplen && heap[0]->due - now < wait) wait = heap[0]->due - now;
+        if (wait < 0) wait = 0;
+        int n = epoll_wait(epfd, events, MAX_EVENTS, (wait + 999) / 1000);
+        if (n == -1) {
+            if (errno != EINTR) fprintf(stderr, "%s/epoll_wait: %s\n", __func__, strerror(errno));
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            Bot *b = &bots[events[i].data.u32];
+            if (b->state == L_CONNECT) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) getsockopt(b->soc, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err || !(events[i].events & EPOLLOUT)) {
+                    refused++;
+                    bot_close(b, 1);
+                    continue;
+                }
+                struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.u32 = b->id};
+                epoll_ctl(epfd, EPOLL_CTL_MOD, b->soc, &ev);
+                b->state = L_NAME;
+                connected++;
+                connects++;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) bot_input(b);
+        }
+    }
+    report((now_us() - begin) / 1e6, pid, peak);
+    return 0;
+}
+
+/*
+ * Load a scenario file over the defaults
+*/
+void read_scenario(char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s/fopen: %s: %s\n", __func__, path, strerror(errno));
+        exit(1);
+    }
+    char line[256], key[32], val[64];
+    int no = 0;
+    while (fgets(line, sizeof(line), f)) {
+        no++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        int n = sscanf(line, "%31s %63s", key, val);
+        if (n < 1) continue; // Blank
+        if (n < 2) {
+            fprintf(stderr, "%s: %s:%d: %s has no value\n", __func__, path, no, key);
+            exit(1);
+        }
+        if (!strcmp(key, "clients")) scn.clients = atoi(val);
+        else if (!strcmp(key, "duration")) scn.duration = atoi(val);
+        else if (!strcmp(key, "ramp")) scn.ramp = atoi(val);
+        else if (!strcmp(key, "moves")) snprintf(scn.moves, MAX_SCRIPT, "%s", val);
+        else if (!strcmp(key, "speak")) scn.speak = atof(val);
+        else if (!strcmp(key, "churn")) scn.churn = atof(val);
+        else if (!strcmp(key, "think")) {
+            if (sscanf(line, "%*s %d %d", &scn.think_min, &scn.think_max) < 2) scn.think_max = scn.think_min;
+        }
+        else if (!strcmp(key, "seed")) scn.seed = strtoul(val, NULL, 10);
+        else if (!strcmp(key, "port")) scn.port = atoi(val);
+        else if (!strcmp(key, "prefix")) snprintf(scn.prefix, MAX_PREFIX, "%.*s", MAX_PREFIX - 1, val);
+        else {
+            fprintf(stderr, "%s: %s:%d: unknown key %s\n", __func__, path, no, key);
+            exit(1);
+        }
+    }
+    fclose(f);
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-f scenario] [-c clients] [-d seconds] [-r ramp_seconds] [-m random|script] [-p port] [-P server_pid] [-S seed]\n", prog);
+    exit(1);
+}
+
+/*
+ * Start a nonblocking connect, the bot registers once it completes
+*/
+void bot_connect(Bot *b) {
+    b->soc = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (b->soc == -1) {
+        fprintf(stderr, "%s/socket: %s\n", __func__, strerror(errno));
+        schedule(b, A_CONNECT, now_us() + RETRY_MS * 1000);
+        return;
+    }
+    int on = 1;
+    setsockopt(b->soc, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    b->joined = now_us();
+    b->state = L_CONNECT;
+    b->len = 0;
+    if (connect(b->soc, (struct sockaddr *) &server, sizeof(server)) == -1 && errno != EINPROGRESS) {
+        refused++;
+        bot_close(b, 1);
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLOUT, .data.u32 = b->id};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, b->soc, &ev) == -1) {
+        fprintf(stderr, "%s/epoll_ctl: %s\n", __func__, strerror(errno));
+        bot_close(b, 1);
+    }
+}
+
+/*
+ * Disconnect a bot, and reconnect it later if retry
+*/
+void bot_close(Bot *b, short retry) {
+    if (b->state >= L_NAME) connected--;
+    if (b->soc != -1) close(b->soc);
+    b->soc = -1;
+    b->state = L_IDLE;
+    b->opp = -1;
+    heap_remove(b);
+    if (retry) schedule(b, A_CONNECT, now_us() + RETRY_MS * 1000);
+}
+
+/*
+ * Read what the server sent, and act on every marker in the order they came
+*/
+void bot_input(Bot *b) {
+    while (b->soc != -1) {
+        int n = read(b->soc, b->buf + b->len, BOT_BUF - b->len);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) { // Dropped by the server
+            drops++;
+            bot_close(b, 1);
+            return;
+        }
+        if (n == -1) return;
+        b->len += n;
+        char *at = b->buf, *end = b->buf + b->len;
+        while (b->soc != -1) { // Earliest marker first
+            short k = -1;
+            char *first = end;
+            for (short i = 0; i < MARKS; i++) {
+                char *m = memmem(at, end - at, marks[i], strlen(marks[i]));
+                if (m && m < first) {
+                    first = m;
+                    k = i;
+                }
+            }
+            if (k == -1) break;
+            char *next = first + strlen(marks[k]);
+            if (k == K_ENGAGE) { // The opponent name runs to '!'
+                char *bang = memchr(next, '!', end - next);
+                if (!bang) break; // Not all here yet
+                next = bang + 1;
+            }
+            bot_mark(b, k, first + strlen(marks[k]), next);
+            at = next;
+        }
+        if (b->soc == -1) return;
+        if (at == b->buf && b->len > BOT_BUF - MARK_KEEP) at = b->buf + b->len - MARK_KEEP; // Nothing of interest
+        b->len = end - at;
+        memmove(b->buf, at, b->len);
+    }
+}
+
+/*
+ * Act on a marker, text holds what follows it up to end
+*/
+void bot_mark(Bot *b, short k, char *text, char *end) {
+    long long now = now_us();
+    if (k == K_NAME) {
+        char name[32];
+        int n = snprintf(name, sizeof(name), "%s%d\n", scn.prefix, b->id);
+        bot_send(b, name, n);
+    }
+    else if (k == K_WAIT) {
+        if (b->state == L_NAME) hist_add(&join, now - b->joined);
+        b->state = L_LOBBY;
+    }
+    else if (k == K_ENGAGE) {
+        int len = strlen(scn.prefix);
+        b->opp = (end - text > len + 1 && !memcmp(text, scn.prefix, len)) ? atoi(text + len):-1;
+        if (b->opp < 0 || b->opp >= scn.clients) b->opp = -1; // Not one of ours
+        b->state = L_BATTLE;
+        b->pow = 3;
+        b->blc = 3;
+        b->moved = 0;
+    }
+    else if (k == K_MOVE) {
+        turn_over(b);
+        schedule(b, A_MOVE, now + think() * 1000LL);
+    }
+    else if (k == K_SPEAK) schedule(b, A_SPEECH, now + think() * 1000LL);
+    else { // Battle over
+        turn_over(b);
+        battles++;
+        b->state = L_LOBBY;
+        b->opp = -1;
+        heap_remove(b);
+        if (chance() < scn.churn) bot_close(b, 1);
+    }
+}
+
+/*
+ * Count the round trip of the turn just resolved, from the last of both moves
+*/
+void turn_over(Bot *b) {
+    if (!b->moved) return;
+    long long last = b->moved;
+    if (b->opp >= 0 && bots[b->opp].opp == b->id && bots[b->opp].moved > last) last = bots[b->opp].moved;
+    hist_add(&rtt, now_us() - last);
+}
+
+/*
+ * Pick and send the move of the turn
+*/
+void bot_move(Bot *b) {
+    if (b->state != L_BATTLE) return;
+    char mov;
+    if (strcmp(scn.moves, "random")) mov = scn.moves[b->step++ % strlen(scn.moves)];
+    else if (chance() < scn.speak) mov = 's';
+    else mov = "aaapb"[rand_r(&seed) % 5];
+    if (mov == 'p' && b->pow < 1) mov = 'a';
+    if (mov == 'b' && b->blc < 1) mov = 'a';
+    if (mov == 'p') b->pow--;
+    if (mov == 'b') b->blc--;
+    if (mov == 's') speeches++;
+    else {
+        b->moved = now_us();
+        moves++;
+    }
+    bot_send(b, &mov, 1);
+}
+
+/*
+ * Send to the server, small writes to a socket with room never block
+*/
+void bot_send(Bot *b, char *msg, int len) {
+    if (write(b->soc, msg, len) != len) {
+        drops++;
+        bot_close(b, 1);
+    }
+}
+
+/*
+ * Set the pending action of a bot, replacing any
+*/
+void schedule(Bot *b, short action, long long due) {
+    heap_remove(b);
+    b->action = action;
+    b->due = due;
+    b->heappos = heaplen;
+    heap[heaplen++] = b;
+    heap_up(b->heappos);
+}
+
+void heap_up(int i) {
+    Bot *b = heap[i];
+    while (i > 0 && heap[(i - 1) / 2]->due > b->due) {
+        heap[i] = heap[(i - 1) / 2];
+        heap[i]->heappos = i;
+        i = (i - 1) / 2;
+    }
+    heap[i] = b;
+    b->heappos = i;
+}
+
+void heap_down(int i) {
+    Bot *b = heap[i];
+    while (2 * i + 1 < heaplen) {
+        int c = 2 * i + 1;
+        if (c + 1 < heaplen && heap[c + 1]->due < heap[c]->due) c++;
+        if (heap[c]->due >= b->due) break;
+        heap[i] = heap[c];
+        heap[i]->heappos = i;
+        i = c;
+    }
+    heap[i] = b;
+    b->heappos = i;
+}
+
+/*
+ * Drop the pending action of a bot, if any
+*/
+void heap_remove(Bot *b) {
+    int i = b->heappos;
+    if (i < 0) return;
+    b->heappos = -1;
+    b->action = A_NONE;
+    Bot *last = heap[--heaplen];
+    if (last == b) return;
+    heap[i] = last;
+    last->heappos = i;
+    heap_up(i);
+    heap_down(last->heappos);
+}
+
+/*
+ * Think time of a move in ms
+*/
+int think() {
+    if (scn.think_max <= scn.think_min) return scn.think_min;
+    return scn.think_min + rand_r(&seed) % (scn.think_max - scn.think_min + 1);
+}
+
+double chance() {
+    return rand_r(&seed) / (RAND_MAX + 1.0);
+}
+
+/*
+ * Count a value in a histogram, buckets are 2^HIST_SUB per power of 2 (as the server's)
+*/
+void hist_add(Hist *h, long long us) {
+    if (us < 0) us = 0;
+    short i = us;
+    if (us >= 1 << HIST_SUB) {
+        short top = 63 - __builtin_clzll(us); // Power of 2
+        i = ((top - HIST_SUB + 1) << HIST_SUB) + ((us >> (top - HIST_SUB)) & ((1 << HIST_SUB) - 1));
+    }
+    if (i >= HIST_BUCKETS) i = HIST_BUCKETS - 1;
+    h->count[i]++;
+    h->total++;
+}
+
+/*
+ * Upper bound of the bucket holding a percentile, 0 when empty
+*/
+long long hist_pct(Hist *h, double pct) {
+    unsigned long long rank = h->total * pct / 100, seen = 0;
+    if (!h->total) return 0;
+    for (short i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen > rank) return (i < 1 << HIST_SUB) ? i:(((long long) (1 << HIST_SUB) + (i & ((1 << HIST_SUB) - 1)) + 1) << ((i >> HIST_SUB) - 1)) - 1;
+    }
+    return 0;
+}
+
+/*
+ * Resident memory of a process in kB, 0 if unknown
+*/
+long server_rss(int pid) {
+    if (pid <= 0) return 0;
+    char path[64], line[128];
+    long kb = 0;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f)) if (sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+    fclose(f);
+    return kb;
+}
+
+/*
+ * Find the process listening on a local port, the lowest pid holding the socket (the parent of forked battles)
+*/
+int find_server(int port) {
+    char line[512];
+    unsigned long inode = 0;
+    FILE *f = fopen("/proc/net/tcp", "r");
+    if (!f) return 0;
+    while (!inode && fgets(line, sizeof(line), f)) {
+        unsigned lport, st;
+        unsigned long ino;
+        if (sscanf(line, " %*d: %*x:%x %*x:%*x %x %*x:%*x %*x:%*x %*x %*d %*d %lu", &lport, &st, &ino) == 3 && lport == (unsigned) port && st == 0x0A) inode = ino; // LISTEN
+    }
+    fclose(f);
+    if (!inode) return 0;
+    char want[64];
+    snprintf(want, sizeof(want), "socket:[%lu]", inode);
+    int found = 0;
+    DIR *proc = opendir("/proc");
+    struct dirent *p;
+    while (proc && (p = readdir(proc))) {
+        int pid = atoi(p->d_name);
+        if (pid <= 0 || (found && pid > found)) continue;
+        char dir[64], link[64];
+        snprintf(dir, sizeof(dir), "/proc/%d/fd", pid);
+        DIR *fds = opendir(dir);
+        struct dirent *fd;
+        while (fds && (fd = readdir(fds))) {
+            char path[64 + sizeof(fd->d_name)];
+            snprintf(path, sizeof(path), "%s/%s", dir, fd->d_name);
+            ssize_t n = readlink(path, link, sizeof(link) - 1);
+            if (n <= 0) continue;
+            link[n] = '\0';
+            if (!strcmp(link, want)) {
+                found = pid;
+                break;
+            }
+        }
+        if (fds) closedir(fds);
+    }
+    if (proc) closedir(proc);
+    return found;
+}
+
+/*
+ * Print the results, one "name value" per line so runs can be diffed
+*/
+void report(double secs, int pid, long peak) {
+    long rss = server_rss(pid);
+    if (rss > peak) peak = rss;
+    if (secs <= 0) secs = 1e-6;
+    printf("seconds %.1f\n", secs);
+    printf("clients %d\n", scn.clients);
+    printf("connected %d\n", connected);
+    printf("matches %llu\n", battles / 2);
+    printf("matches_per_sec %.1f\n", battles / 2 / secs);
+    printf("moves_per_sec %.1f\n", moves / secs);
+    printf("speeches %llu\n", speeches);
+    printf("turn_rtt_us p50 %lld p99 %lld p999 %lld (%llu turns)\n", hist_pct(&rtt, 50), hist_pct(&rtt, 99), hist_pct(&rtt, 99.9), rtt.total);
+    printf("join_us p50 %lld p99 %lld p999 %lld (%llu joins)\n", hist_pct(&join, 50), hist_pct(&join, 99), hist_pct(&join, 99.9), join.total);
+    printf("connects %llu refused %llu dropped %llu\n", connects, refused, drops);
+    printf("server_rss_kb %ld peak %ld\n", rss, peak);
+}
+
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void on_stop(int sig) {
+    stop = 1;
+}
@@ -0,0 +1,188 @@
+/*
+ * Battle journal reader:
+ * Lists the battles of a journal directory (journal.h), or prints one of
+ * them turn by turn, following the journal as the server appends with -f.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include "journal.h"
+
+#define MAX_SEGMENTS 65536
+#define FOLLOW_PAUSE 100 // ms between looks at a followed journal
+
+typedef struct Segmentreader {
+    unsigned long long seg; // Number of the segment read
+    FILE *f;
+    long at; // Offset of the next whole record
+} Reader;
+
+int segments(const char *dir, unsigned long long seg[], int max);
+int compare_seg(const void *a, const void *b);
+int next_record(const char *dir, Reader *r, char rec[], int follow);
+int print_record(char rec[], short len, uint64_t want);
+void print_time(uint64_t us);
+
+int listing; // No battle asked for, list them
+
+int main(int argc, char *argv[]) {
+    int opt, follow = 0;
+    while ((opt = getopt(argc, argv, "f")) != -1) {
+        if (opt == 'f') follow = 1; // Keep reading as the journal grows
+        else {
+            fprintf(stderr, "usage: %s [-f] journal_dir [battle]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-f] journal_dir [battle]\n", argv[0]);
+        exit(1);
+    }
+    const char *dir = argv[optind];
+    uint64_t want = (optind + 1 < argc) ? strtoull(argv[optind + 1], NULL, 10):0;
+    listing = !want;
+    Reader r = {0, NULL, 0};
+    char rec[JR_MAX];
+    int len;
+    while ((len = next_record(dir, &r, rec, follow)) > 0) {
+        if (print_record(rec, len, want)) break; // The battle asked for ended
+    }
+    if (r.f) fclose(r.f);
+    return 0;
+}
+
+/*
+ * Numbers of the segments of a journal, sorted, return how many
+*/
+int segments(const char *dir, unsigned long long seg[], int max) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        exit(1);
+    }
+    struct dirent *e;
+    int n = 0;
+    while ((e = readdir(d)) && n < max) {
+        unsigned long long s;
+        char tail[8];
+        if (sscanf(e->d_name, "%llu.%7s", &s, tail) == 2 && !strcmp(tail, "jnl")) seg[n++] = s;
+    }
+    closedir(d);
+    qsort(seg, n, sizeof(seg[0]), compare_seg);
+    return n;
+}
+
+int compare_seg(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Read the next whole record into rec, moving on to later segments, return its length or 0 at the end
+ * A record cut short is the end of the journal, or not written yet when following
+*/
+int next_record(const char *dir, Reader *r, char rec[], int follow) {
+    static unsigned long long seg[MAX_SEGMENTS];
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = FOLLOW_PAUSE * 1000000L};
+    while (1) {
+        if (r->f) {
+            char kind;
+            uint64_t battle, us;
+            clearerr(r->f);
+            fseek(r->f, r->at, SEEK_SET);
+            if (fread(rec, 1, JR_HEAD, r->f) == JR_HEAD) {
+                short len = jr_parse(rec, &kind, &battle, &us);
+                if (!len) {
+                    fprintf(stderr, "%016llu.jnl: bad record at %ld\n", r->seg, r->at);
+                    return 0;
+                }
+                if (fread(rec + JR_HEAD, 1, len - JR_HEAD, r->f) == (size_t) (len - JR_HEAD)) {
+                    r->at += len;
+                    return len;
+                }
+            }
+        }
+        // Nothing whole left in this segment, go on to the one after it if any
+        int n = segments(dir, seg, MAX_SEGMENTS), i = 0;
+        while (i < n && seg[i] <= r->seg) i++;
+        if (i < n) {
+            char path[PATH_MAX], magic[JOURNAL_MAGIC_LEN];
+            if (r->f) fclose(r->f);
+            r->seg = seg[i];
+            snprintf(path, sizeof(path), "%s/%016llu.jnl", dir, r->seg);
+            if (!(r->f = fopen(path, "rb"))) {
+                perror(path);
+                return 0;
+            }
+            if (fread(magic, 1, JOURNAL_MAGIC_LEN, r->f) != JOURNAL_MAGIC_LEN || memcmp(magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN)) {
+                fprintf(stderr, "%s: not a journal segment\n", path);
+                return 0;
+            }
+            r->at = JOURNAL_MAGIC_LEN;
+            continue;
+        }
+        if (!follow) return 0;
+        nanosleep(&pause, NULL);
+    }
+}
+
+/*
+ * Print a record if it is of the battle asked for (a summary of starts and ends when listing)
+ * return 1 once that battle ended
+*/
+int print_record(char rec[], short len, uint64_t want) {
+    static const char *moves[128] = {['a'] = "attack", ['p'] = "power", ['b'] = "block", ['s'] = "speak"};
+    static const char *results[] = {"tie", "c1 won", "c2 won"};
+    char kind;
+    uint64_t battle, us;
+    jr_parse(rec, &kind, &battle, &us);
+    char *p = rec + JR_HEAD;
+    if (listing) {
+        if (kind != J_START && kind != J_END) return 0;
+    }
+    else if (battle != want) return 0;
+    print_time(us);
+    printf(" #%llu ", (unsigned long long) battle);
+    if (kind == J_START) {
+        short r1, r2;
+        char *n2 = p + 1 + p[0];
+        memcpy(&r1, n2 + 1 + n2[0], 2);
+        memcpy(&r2, n2 + 3 + n2[0], 2);
+        printf("start %.*s (%d) vs %.*s (%d)\n", p[0], p + 1, r1, n2[0], n2 + 1, r2);
+    }
+    else if (kind == J_TURN) {
+        const char *m1 = moves[p[0] & 127], *m2 = moves[p[1] & 127];
+        printf("turn c1 %s%s for %d, c2 %s%s for %d | c1 hp %d pow %d blc %d, c2 hp %d pow %d blc %d\n",
+            m1 ? m1:"?", (p[10] & J_LATE_C1) ? " (late)":"", p[2], m2 ? m2:"?", (p[10] & J_LATE_C2) ? " (late)":"", p[3],
+            p[4], p[6], p[7], p[5], p[8], p[9]);
+    }
+    else if (kind == J_CHAT) {
+        int n = len - JR_HEAD - 1;
+        if (n > 0 && p[n] == '\n') n--; // p[0] is the speaker, the text follows
+        printf("c%d says %.*s\n", p[0] + 1, n, p + 1);
+    }
+    else if (kind == J_SPAM) printf("c%d forfeits for spamming\n", p[0] + 1);
+    else if (kind == J_END) {
+        printf("end %s%s%s\n", (p[0] >= 0 && p[0] <= 2) ? results[(int) p[0]]:"?",
+            (p[1] & J_GONE_C1) ? ", c1 left":"", (p[1] & J_GONE_C2) ? ", c2 left":"");
+        return !listing;
+    }
+    else printf("record of unknown kind %d\n", kind);
+    return 0;
+}
+
+/*
+ * Print a record time as local time to the millisecond
+*/
+void print_time(uint64_t us) {
+    time_t secs = us / 1000000;
+    struct tm tm;
+    char buf[32];
+    localtime_r(&secs, &tm);
+    strftime(buf, sizeof(buf), "%F %T", &tm);
+    printf("%s.%03d", buf, (int) (us % 1000000 / 1000));
+}
@@ -0,0 +1,72 @@
+/*
+ * Combat rules:
+ * Shared by the server and the simulator so the two can not drift apart.
+ * A turn is written once over masks (all ones when true, zero when false),
+ * so the same text resolves one battle on plain integers or a batch of
+ * them on GCC vectors.
+*/
+#ifndef RULES_H
+#define RULES_H
+
+#define MAX_HP 21
+#define MAX_POW 3
+#define MAX_BLC 3
+#define A_DMG 2
+#define P_DMG 6
+#define B_DMG 1
+
+// Damage dealt, p/b: the battler powers/blocks (attacks otherwise), ob: the opponent blocks
+#define RULE_DMG(p, b, ob) ((A_DMG + ((p) & (P_DMG - A_DMG)) + ((b) & (B_DMG - A_DMG))) & ~(ob))
+// A move spending from left is only legal with some left, m the mask of the move
+#define RULE_LEGAL(m, left) ((m) & ((left) > 0))
+
+/*
+ * Mask of a scalar condition
+*/
+static inline short rule_mask(int cond) {
+    return -(short) (cond != 0);
+}
+
+/*
+ * Spend a move, return it or '\0' if it has none left or is unintelligible
+ * Attacks and speeches are free
+*/
+static inline char rule_move(short *pow, short *blc, char mov) {
+    if (mov == 'a' || mov == 's') return mov;
+    if (mov == 'p' && *pow > 0) {
+        *pow -= 1;
+        return mov;
+    }
+    if (mov == 'b' && *blc > 0) {
+        *blc -= 1;
+        return mov;
+    }
+    return '\0';
+}
+
+/*
+ * Damage a move deals against the opponent's move of the same turn
+*/
+static inline short rule_dmg(char mov, char omov) {
+    return RULE_DMG(rule_mask(mov == 'p'), rule_mask(mov == 'b'), rule_mask(omov == 'b'));
+}
+
+/*
+ * Play a turn of both battlers' (legal) moves
+*/
+static inline void rule_turn(short *hp1, short *hp2, char mov1, char mov2) {
+    short dmg1 = rule_dmg(mov1, mov2), dmg2 = rule_dmg(mov2, mov1);
+    *hp1 -= dmg2;
+    *hp2 -= dmg1;
+}
+
+/*
+ * Outcome of a battle, -1 while both stand, 0 for a tie, else the winner (1 or 2)
+*/
+static inline short rule_outcome(short hp1, short hp2) {
+    if (hp1 > 0 && hp2 > 0) return -1;
+    if (hp1 < 1 && hp2 < 1) return 0;
+    return (hp1 < 1) ? 2:1;
+}
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Headless battle simulator:
+ * Battler state lives in structure-of-arrays batches, SIM_LANES battles are
+ * loaded into GCC vectors and played turn by turn until all of them end,
+ * with the same rule text as the server (rules.h). sim_run() spreads the
+ * batches over threads.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "rules.h"
+#include "sim.h"
+
+typedef short Lanes __attribute__((vector_size(SIM_LANES * sizeof(short))));
+typedef uint32_t Seeds __attribute__((vector_size(SIM_LANES * sizeof(uint32_t))));
+
+typedef struct Simjob {
+    const Strategy *s[2];
+    uint64_t battles;
+    uint64_t seed;
+    Result result;
+} Job;
+
+const Strategy sim_strategies[] = {
+    {"attack", 0, 0, 0, 0},
+    {"power", 256, 0, 0, 0}, // Power moves first
+    {"block", 0, 256, 0, 0}, // Blocks first
+    {"random", 85, 85, 0, 0}, // A third each
+    {"finisher", 0, 0, 1, 0},
+    {"cautious", 0, 0, 1, 1},
+    {"gambler", 128, 0, 1, 1},
+    {NULL, 0, 0, 0, 0}
+};
+
+void choose(const Strategy *s, Lanes r, Lanes hp, Lanes pow, Lanes blc, Lanes ohp, Lanes opow, Lanes *p, Lanes *b);
+Lanes draw(Seeds *rng);
+void *sim_thread(void *arg);
+
+/*
+ * Look a built in strategy up by name, NULL if unknown
+*/
+const Strategy *sim_strategy(const char *name) {
+    for (const Strategy *s = sim_strategies; s->name; s++) if (!strcmp(s->name, name)) return s;
+    return NULL;
+}
+
+/*
+ * Allocate a batch of fresh battles, NULL on failure
+*/
+Batch *sim_batch_new(int count, uint64_t seed) {
+    Batch *b = calloc(1, sizeof(Batch));
+    if (!b) return NULL;
+    b->count = (count + SIM_LANES - 1) / SIM_LANES * SIM_LANES;
+    size_t lanes = b->count * sizeof(short);
+    short **arrays[] = {&b->hp[0], &b->hp[1], &b->pow[0], &b->pow[1], &b->blc[0], &b->blc[1], &b->turns};
+    for (short i = 0; i < 7; i++) if (!(*arrays[i] = aligned_alloc(sizeof(Lanes), lanes))) {
+        sim_batch_free(b);
+        return NULL;
+    }
+    if (!(b->rng = aligned_alloc(sizeof(Seeds), b->count * sizeof(uint32_t)))) {
+        sim_batch_free(b);
+        return NULL;
+    }
+    for (int i = 0; i < b->count; i++) { // splitmix64, never a zero xorshift state
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        b->rng[i] = (z ^ (z >> 31)) | 1;
+    }
+    sim_batch_reset(b);
+    return b;
+}
+
+void sim_batch_free(Batch *b) {
+    if (!b) return;
+    for (short i = 0; i < 2; i++) {
+        free(b->hp[i]);
+        free(b->pow[i]);
+        free(b->blc[i]);
+    }
+    free(b->turns);
+    free(b->rng);
+    free(b);
+}
+
+/*
+ * Start every battle of a batch over, callers can then handicap sides by hand
+*/
+void sim_batch_reset(Batch *b) {
+    for (int i = 0; i < b->count; i++) {
+        b->hp[0][i] = b->hp[1][i] = MAX_HP;
+        b->pow[0][i] = b->pow[1][i] = MAX_POW;
+        b->blc[0][i] = b->blc[1][i] = MAX_BLC;
+        b->turns[i] = 0;
+    }
+}
+
+/*
+ * Play every battle of a batch to its end and add up the outcomes
+*/
+void sim_batch_play(Batch *b, const Strategy *s0, const Strategy *s1, Result *out) {
+    for (int at = 0; at < b->count; at += SIM_LANES) {
+        Lanes hp0 = *(Lanes *) (b->hp[0] + at), hp1 = *(Lanes *) (b->hp[1] + at);
+        Lanes pow0 = *(Lanes *) (b->pow[0] + at), pow1 = *(Lanes *) (b->pow[1] + at);
+        Lanes blc0 = *(Lanes *) (b->blc[0] + at), blc1 = *(Lanes *) (b->blc[1] + at);
+        Lanes turns = *(Lanes *) (b->turns + at);
+        Seeds rng = *(Seeds *) (b->rng + at);
+        Lanes live = (hp0 > 0) & (hp1 > 0);
+        while (1) {
+            short any = 0;
+            for (short i = 0; i < SIM_LANES; i++) any |= live[i];
+            if (!any) break;
+            Lanes p0, b0, p1, b1;
+            choose(s0, draw(&rng), hp0, pow0, blc0, hp1, pow1, &p0, &b0);
+            choose(s1, draw(&rng), hp1, pow1, blc1, hp0, pow0, &p1, &b1);
+            // Ended battles sit the turn out
+            p0 &= live;
+            b0 &= live;
+            p1 &= live;
+            b1 &= live;
+            Lanes dmg0 = RULE_DMG(p0, b0, b1) & live, dmg1 = RULE_DMG(p1, b1, b0) & live;
+            hp0 -= dmg1;
+            hp1 -= dmg0;
+            pow0 += p0; // Masks are -1
+            pow1 += p1;
+            blc0 += b0;
+            blc1 += b1;
+            turns -= live;
+            live = (hp0 > 0) & (hp1 > 0);
+        }
+        *(Lanes *) (b->hp[0] + at) = hp0;
+        *(Lanes *) (b->hp[1] + at) = hp1;
+        *(Lanes *) (b->pow[0] + at) = pow0;
+        *(Lanes *) (b->pow[1] + at) = pow1;
+        *(Lanes *) (b->blc[0] + at) = blc0;
+        *(Lanes *) (b->blc[1] + at) = blc1;
+        *(Lanes *) (b->turns + at) = turns;
+        *(Seeds *) (b->rng + at) = rng;
+        Lanes won0 = (hp0 > 0) & (hp1 < 1), won1 = (hp1 > 0) & (hp0 < 1), tied = (hp0 < 1) & (hp1 < 1);
+        for (short i = 0; i < SIM_LANES; i++) { // Masks are -1
+            out->wins[0] -= won0[i];
+            out->wins[1] -= won1[i];
+            out->ties -= tied[i];
+            out->turns += turns[i];
+        }
+    }
+    out->battles += b->count;
+}
+
+/*
+ * Pick the moves of one side of SIM_LANES battles, as masks of power moves and blocks (attacks otherwise)
+*/
+void choose(const Strategy *s, Lanes r, Lanes hp, Lanes pow, Lanes blc, Lanes ohp, Lanes opow, Lanes *p, Lanes *b) {
+    Lanes power = r < s->power, block = ~power & (r < (short) (s->power + s->block));
+    if (s->finish) { // A power move that knocks out
+        Lanes kill = (ohp <= P_DMG) & (pow > 0);
+        power |= kill;
+        block &= ~kill;
+    }
+    if (s->guard) { // Nothing to finish, but the opponent could
+        Lanes risk = ~power & (hp <= P_DMG) & (opow > 0);
+        block |= risk;
+    }
+    *p = RULE_LEGAL(power, pow);
+    *b = ~*p & RULE_LEGAL(block, blc);
+}
+
+/*
+ * Next random byte of each lane, xorshift32
+*/
+Lanes draw(Seeds *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 17;
+    *rng ^= *rng << 5;
+    return __builtin_convertvector(*rng >> 24, Lanes);
+}
+
+/*
+ * Play battles between two strategies over threads, side 0 plays s0
+*/
+void sim_run(const Strategy *s0, const Strategy *s1, uint64_t battles, int threads, uint64_t seed, Result *out) {
+    if (threads < 1) threads = 1;
+    Job jobs[threads];
+    pthread_t tids[threads];
+    memset(out, 0, sizeof(Result));
+    for (int i = 0; i < threads; i++) {
+        jobs[i] = (Job) {.s = {s0, s1}, .battles = battles / threads + (i < (int) (battles % threads)), .seed = seed + i * 0x1000000ULL};
+        if (pthread_create(&tids[i], NULL, sim_thread, &jobs[i])) {
+            fprintf(stderr, "%s/pthread_create: %s\n", __func__, strerror(errno));
+            sim_thread(&jobs[i]); // Inline instead
+            tids[i] = 0;
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        if (tids[i]) pthread_join(tids[i], NULL);
+        out->battles += jobs[i].result.battles;
+        out->wins[0] += jobs[i].result.wins[0];
+        out->wins[1] += jobs[i].result.wins[1];
+        out->ties += jobs[i].result.ties;
+        out->turns += jobs[i].result.turns;
+    }
+}
+
+/*
+ * Play a job's battles batch by batch, the last one rounded up to whole vectors
+*/
+void *sim_thread(void *arg) {
+    Job *job = arg;
+    Batch *b = sim_batch_new(SIM_BATCH, job->seed);
+    if (!b) {
+        fprintf(stderr, "%s/sim_batch_new: %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+    for (uint64_t done = 0; done < job->battles; done += b->count) {
+        if (job->battles - done < (uint64_t) b->count) b->count = (job->battles - done + SIM_LANES - 1) / SIM_LANES * SIM_LANES;
+        sim_batch_reset(b);
+        sim_batch_play(b, job->s[0], job->s[1], &job->result);
+    }
+    sim_batch_free(b);
+    return NULL;
+}
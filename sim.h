@@ -0,0 +1,49 @@
+/*
+ * Headless battle simulator:
+ * Plays battles between two strategies with the server's rules (rules.h),
+ * many battles per vector and batches of them per thread.
+*/
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+#define SIM_LANES 16 // Battles per vector
+#define SIM_BATCH 4096 // Battles per batch, a multiple of SIM_LANES
+
+// How a battler picks its moves, odds are out of 256
+typedef struct Simstrategy {
+    const char *name;
+    short power; // Odds of a power move
+    short block; // Odds of a block, when not powering
+    short finish; // Power move whenever it would knock the opponent out
+    short guard; // Block while a power move would knock it out
+} Strategy;
+
+// Battler state of a batch, structure of arrays, side 0 and 1
+typedef struct Simbatch {
+    int count; // Battles, rounded up to SIM_LANES
+    short *hp[2];
+    short *pow[2];
+    short *blc[2];
+    short *turns; // Turns each battle lasted
+    uint32_t *rng; // Random state per battle
+} Batch;
+
+typedef struct Simresult {
+    uint64_t battles;
+    uint64_t wins[2]; // Won by side 0, side 1
+    uint64_t ties;
+    uint64_t turns;
+} Result;
+
+extern const Strategy sim_strategies[]; // Built in, ended by a NULL name
+
+const Strategy *sim_strategy(const char *name);
+Batch *sim_batch_new(int count, uint64_t seed);
+void sim_batch_free(Batch *b);
+void sim_batch_reset(Batch *b);
+void sim_batch_play(Batch *b, const Strategy *s0, const Strategy *s1, Result *out);
+void sim_run(const Strategy *s0, const Strategy *s1, uint64_t battles, int threads, uint64_t seed, Result *out);
+
+#endif